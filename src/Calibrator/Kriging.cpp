@@ -3,7 +3,11 @@
 #include "../Parameters.h"
 #include "../File/File.h"
 #include "../Downscaler/Downscaler.h"
+#include "../KDTree.h"
+#include "../SparseMatrix.h"
+#include "../SparseCholesky.h"
 #include <math.h>
+#include <algorithm>
 
 CalibratorKriging::CalibratorKriging(const Variable& iVariable, const Options& iOptions):
       Calibrator(iVariable, iOptions),
@@ -40,6 +44,9 @@ CalibratorKriging::CalibratorKriging(const Variable& iVariable, const Options& i
       else if(type == "barnes") {
          mKrigingType = TypeBarnes;
       }
+      else if(type == "wendland") {
+         mKrigingType = TypeWendland;
+      }
       else {
          Util::error("CalibratorKriging: 'type' not recognized");
       }
@@ -81,6 +88,9 @@ CalibratorKriging::CalibratorKriging(const Variable& iVariable, const Options& i
       }
 
       iOptions.getValue("window", mWindow);
+      if(mWindow < 0) {
+         Util::error("CalibratorKriging: 'window' must be >= 0");
+      }
       if(mLowerThreshold > mUpperThreshold) {
          Util::error("CalibratorKriging: the lower value must be less than upper value in 'range'");
       }
@@ -112,53 +122,57 @@ bool CalibratorKriging::calibrateCore(File& iFile, const ParameterFile* iParamet
       return false;
    }
 
-   // Precompute weights from auxillary variable
-   std::vector<std::vector<std::vector<std::vector<float> > > > auxWeights;
+   // Precompute weights from auxillary variable. The weight is the fraction of the valid
+   // timesteps within +- window where the auxillary variable is inside the range. The weights are
+   // stored contiguously, with the same ordering as the fields within each timestep.
+   std::vector<float> auxWeights;
    if(mAuxVariable != "") {
-      // Initialize
-      auxWeights.resize(nLat);
-      for(int i = 0; i < nLat; i++) {
-         auxWeights[i].resize(nLon);
-         for(int j = 0; j < nLon; j++) {
-            auxWeights[i][j].resize(nEns);
-            for(int e = 0; e < nEns; e++) {
-               auxWeights[i][j][e].resize(nTime, 0);
-            }
-         }
-      }
-      // Load auxillarcy variable
+      // Load auxillary variable
       std::vector<FieldPtr> auxFields;
       auxFields.resize(nTime);
       for(int t = 0; t < nTime; t++) {
          auxFields[t] = iFile.getField(mAuxVariable, t);
       }
 
-      // Compute auxillary weights
-      for(int t = 0; t < nTime; t++) {
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
+      // Compute auxillary weights, using running counts over a window that slides forward in time
+      long nPoints = (long) nLat * nLon * nEns;
+      auxWeights.resize(nTime * nPoints);
+      #pragma omp parallel for
+      for(int i = 0; i < nLat; i++) {
+         std::vector<int> numInRange(nLon * nEns, 0);
+         std::vector<int> numValid(nLon * nEns, 0);
+         for(int t = -mWindow; t < nTime; t++) {
+            // Add the timestep entering the window and remove the one leaving it
+            int tAdd = t + mWindow;
+            int tRemove = t - mWindow - 1;
             for(int j = 0; j < nLon; j++) {
                for(int e = 0; e < nEns; e++) {
-                  float total = 0;
-                  int start = std::max(t-mWindow,0);
-                  int end   = std::min(nTime-1,t+mWindow);
-                  int numValid = 0;
-                  for(int tt = start; tt <= end; tt++) {
-                     float aux = (*auxFields[tt])(i,j,e);
+                  int k = j * nEns + e;
+                  if(tAdd < nTime) {
+                     float aux = (*auxFields[tAdd])(i,j,e);
+                     if(Util::isValid(aux)) {
+                        numInRange[k] += (aux >= mLowerThreshold && aux <= mUpperThreshold);
+                        numValid[k]++;
+                     }
+                  }
+                  if(tRemove >= 0) {
+                     float aux = (*auxFields[tRemove])(i,j,e);
                      if(Util::isValid(aux)) {
-                        if(aux >= mLowerThreshold && aux <= mUpperThreshold) {
-                           total++;
-                        }
-                        numValid++;
+                        numInRange[k] -= (aux >= mLowerThreshold && aux <= mUpperThreshold);
+                        numValid[k]--;
                      }
                   }
-                  int windowSize = end - start + 1;
-                  if(numValid == 0)
-                     auxWeights[i][j][e][t] = 1;
-                  else
-                     auxWeights[i][j][e][t] += total / numValid;
                }
             }
+            if(t < 0)
+               continue;
+            float* weights = &auxWeights[t * nPoints + (long) i * nLon * nEns];
+            for(int k = 0; k < nLon * nEns; k++) {
+               if(numValid[k] == 0)
+                  weights[k] = 1;
+               else
+                  weights[k] = (float) numInRange[k] / numValid[k];
+            }
          }
       }
    }
@@ -179,76 +193,170 @@ bool CalibratorKriging::calibrateCore(File& iFile, const ParameterFile* iParamet
    // S:       The obs-to-current_grid_point covariance (Nx1)
    // bias:    The bias at each obs location (Nx1)
    //
-   // Note that when computing the weights, we can take a shortcut since most values in
-   // S are zero. However, the weights will still have the length of all stations (not the
-   // number of nearby stations), since when computing the bias we still need to 
-   // weight in far away biases (because they can covary with the nearby stations)
-
-   // Compute obs-obs covariance-matrix once
-   vec2 matrix;
+   // Since the matrix is symmetric, gridpoint_bias = S' * (matrix)^-1 * bias. Therefore solve
+   // z = (matrix)^-1 * bias once for each timestep, using a sparse Cholesky factorization of the
+   // matrix, and then compute the bias at all gridpoints with one sparse matrix-vector product S' * z.
+   // Only covariances above 0 are stored in the matrix and in S. These are found with a search tree,
+   // since the covariance is 0 beyond 'radius' (and beyond 'efoldDist' for cressman and wendland).
    int N = obsLocations.size();
    std::cout << "      Point locations: " << N << std::endl;
-   matrix.resize(N);
+
+   // Search tree of the points with valid coordinates. Their indices into validIndices are the J-indices
+   std::vector<int> validIndices;
    for(int ii = 0; ii < N; ii++) {
-      matrix[ii].resize(N,0);
+      if(Util::isValid(obsLocations[ii].lat()) && Util::isValid(obsLocations[ii].lon()))
+         validIndices.push_back(ii);
    }
-   for(int ii = 0; ii < N; ii++) {
-      Location iloc = obsLocations[ii];
-      // The diagonal is 1, since the distance from a point to itself
-      // is 0, therefore its weight is 1.
-      matrix[ii][ii] = 1;
-      // The matrix is symmetric, so only compute one of the halves
-      for(int jj = ii+1; jj < N; jj++) {
-         Location jloc = obsLocations[jj];
-         // Improve conditioning of matrix when you have two or more stations
-         // that are very close
-         float factor = 0.414 / 0.5;
-         float R = calcCovar(iloc, jloc)*factor;
-         // Store the number in both halves
-         matrix[ii][jj] = R;
-         matrix[jj][ii] = R;
+   KDTree obsTree(KDTree::TypeCartesian);
+   if(validIndices.size() > 0) {
+      vec2 obsLats(1);
+      vec2 obsLons(1);
+      obsLats[0].resize(validIndices.size());
+      obsLons[0].resize(validIndices.size());
+      for(int ii = 0; ii < validIndices.size(); ii++) {
+         obsLats[0][ii] = obsLocations[validIndices[ii]].lat();
+         obsLons[0][ii] = obsLocations[validIndices[ii]].lon();
       }
+      obsTree.build(obsLats, obsLons);
    }
+   float support = mRadius;
+   if(mKrigingType == TypeCressman || mKrigingType == TypeWendland)
+      support = std::min(mRadius, mEfoldDist);
+   // Search further than the support, since calcCovar can use the approximate distance, which
+   // differs slightly from the great-circle distance used by the tree
+   float searchRadius = 2 * support;
 
-   // Compute (matrix)^-1
-   std::cout << "      Precomputing inverse of obs-to-obs covariance matrix: ";
+   // Compute obs-obs covariance-matrix once
+   std::cout << "      Precomputing sparse obs-to-obs covariance matrix: ";
    std::cout.flush();
    double s1 = Util::clock();
-   vec2 inverse = Util::inverse(matrix);
+   std::vector<std::vector<int> > matrixColumns(N);
+   std::vector<std::vector<float> > matrixValues(N);
+   #pragma omp parallel for
+   for(int ii = 0; ii < N; ii++) {
+      const Location& iloc = obsLocations[ii];
+      std::vector<int> candidates(1, ii);
+      if(Util::isValid(iloc.lat()) && Util::isValid(iloc.lon())) {
+         std::vector<int> I, J;
+         std::vector<float> dists;
+         obsTree.getWithinRadius(iloc.lat(), iloc.lon(), searchRadius, I, J, dists);
+         for(int k = 0; k < J.size(); k++)
+            candidates.push_back(validIndices[J[k]]);
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+      for(int k = 0; k < candidates.size(); k++) {
+         int jj = candidates[k];
+         // The diagonal is 1, since the distance from a point to itself
+         // is 0, therefore its weight is 1.
+         if(jj == ii) {
+            matrixColumns[ii].push_back(jj);
+            matrixValues[ii].push_back(1);
+            continue;
+         }
+         float covar = calcCovar(iloc, obsLocations[jj]);
+         if(Util::isValid(covar) && covar > 0) {
+            // Improve conditioning of matrix when you have two or more stations
+            // that are very close
+            float factor = 0.414 / 0.5;
+            matrixColumns[ii].push_back(jj);
+            matrixValues[ii].push_back(covar * factor);
+         }
+      }
+   }
+   SparseMatrix matrix(N);
+   for(int ii = 0; ii < N; ii++) {
+      matrix.addRow(matrixColumns[ii], matrixValues[ii]);
+   }
+   // Only the wendland covariances are guaranteed to give a positive definite matrix. The cressman
+   // and barnes matrices (cut off at 'radius') are often indefinite, but can still be solved.
+   SparseCholesky factor;
+   if(!factor.factorize(matrix, mKrigingType == TypeWendland)) {
+      if(mKrigingType == TypeWendland)
+         Util::warning("CalibratorKriging: The obs-to-obs covariance matrix is singular or not positive definite. Skipping kriging...");
+      else
+         Util::warning("CalibratorKriging: The obs-to-obs covariance matrix is singular. Consider using type=wendland. Skipping kriging...");
+      return false;
+   }
    double e1 = Util::clock();
-   std::cout << e1 - s1 << " seconds" << std::endl;
+   std::cout << e1 - s1 << " seconds (" << matrix.getNumNonZeros() << " covariances, " << factor.getNumStored() << " values in factor)" << std::endl;
 
    // Compute grid-point to obs-point covariances
    std::cout << "      Precomputing gridpoint-to-obs covariances: ";
    std::cout.flush();
    double s2 = Util::clock();
-   // Store the covariances of each gridpoint to every obs-point. To save memory, 
-   // only store values that are above 0. Store the index of the obs-point.
-   // This means that Sindex does not have the same size for every gridpoint.
-   std::vector<std::vector<std::vector<float> > > S; // lat, lon, obspoint
-   std::vector<std::vector<std::vector<int> > > Sindex;
-   S.resize(nLat);
-   Sindex.resize(nLat);
-   for(int i = 0; i < nLat; i++) {
-      S[i].resize(nLon);
-      Sindex[i].resize(nLon);
-   }
-
+   // Row i*nLon+j holds the covariances between gridpoint (i,j) and every obs-point. The row is
+   // empty if no obs-point has a covariance above 0.
+   std::vector<std::vector<int> > Sindex(nLat * nLon);
+   std::vector<std::vector<float> > S(nLat * nLon);
    #pragma omp parallel for
    for(int i = 0; i < nLat; i++) {
       for(int j = 0; j < nLon; j++) {
          float lat = lats[i][j];
          float lon = lons[i][j];
          float elev = elevs[i][j];
+         if(!Util::isValid(lat) || !Util::isValid(lon))
+            continue;
          const Location gridPoint(lat, lon, elev);
-         for(int ii = 0; ii < N; ii++) {
-            Location obsPoint = obsLocations[ii];
-            float covar = calcCovar(obsPoint, gridPoint);
+         std::vector<int> I, J;
+         std::vector<float> dists;
+         obsTree.getWithinRadius(lat, lon, searchRadius, I, J, dists);
+         std::vector<int> candidates(J.size());
+         for(int k = 0; k < J.size(); k++)
+            candidates[k] = validIndices[J[k]];
+         std::sort(candidates.begin(), candidates.end());
+         int index = i * nLon + j;
+         for(int k = 0; k < candidates.size(); k++) {
+            int ii = candidates[k];
+            float covar = calcCovar(obsLocations[ii], gridPoint);
             if(covar > 0) {
-               S[i][j].push_back(covar);
-               Sindex[i][j].push_back(ii);
+               S[index].push_back(covar);
+               Sindex[index].push_back(ii);
+            }
+         }
+      }
+   }
+   SparseMatrix covariances(N);
+   for(int index = 0; index < nLat * nLon; index++) {
+      covariances.addRow(Sindex[index], S[index]);
+   }
+
+   // When cross-validating, the point with the highest covariance is left out at each gridpoint.
+   // Leaving out point k changes the solution z to z - c * z[k] / c[k], where c is column k of
+   // (matrix)^-1, and therefore changes the gridpoint bias by -(S' * c / c[k]) * z[k]. The factor in
+   // parenthesis does not depend on time, and c only needs to be computed once for each point.
+   std::vector<int> cvIndices;
+   std::vector<float> cvFactors;
+   if(mCrossValidate) {
+      cvIndices.resize(nLat * nLon, Util::MV);
+      cvFactors.resize(nLat * nLon, 0);
+      std::vector<std::vector<int> > gridpointsOfPoint(N);
+      for(int index = 0; index < nLat * nLon; index++) {
+         float maxCovar = Util::MV;
+         for(int k = 0; k < S[index].size(); k++) {
+            if(!Util::isValid(cvIndices[index]) || S[index][k] > maxCovar) {
+               cvIndices[index] = Sindex[index][k];
+               maxCovar = S[index][k];
             }
          }
+         if(Util::isValid(cvIndices[index]))
+            gridpointsOfPoint[cvIndices[index]].push_back(index);
+      }
+      #pragma omp parallel for schedule(dynamic)
+      for(int ii = 0; ii < N; ii++) {
+         if(gridpointsOfPoint[ii].size() == 0)
+            continue;
+         std::vector<float> unit(N, 0);
+         unit[ii] = 1;
+         std::vector<float> column;
+         factor.solve(unit, column);
+         for(int k = 0; k < gridpointsOfPoint[ii].size(); k++) {
+            int index = gridpointsOfPoint[ii][k];
+            float total = 0;
+            for(int jj = 0; jj < S[index].size(); jj++)
+               total += S[index][jj] * column[Sindex[index][jj]];
+            cvFactors[index] = total / column[ii];
+         }
       }
    }
    double e2 = Util::clock();
@@ -257,11 +365,10 @@ bool CalibratorKriging::calibrateCore(File& iFile, const ParameterFile* iParamet
    // Loop over offsets
    for(int t = 0; t < nTime; t++) {
       FieldPtr field = iFile.getField(mVariable, t);
-      FieldPtr accum = iFile.getEmptyField(0);
-      FieldPtr weights = iFile.getEmptyField(0);
 
       // Arrange all the biases for all stations into one vector
       std::vector<float> bias(N,0);
+      bool hasMissingBias = false;
       for(int k = 0; k < obsLocations.size(); k++) {
          Location loc = obsLocations[k];
          Parameters parameters = iParameterFile->getParameters(t, loc, false);
@@ -276,68 +383,33 @@ bool CalibratorKriging::calibrateCore(File& iFile, const ParameterFile* iParamet
                   currBias = currBias - 1;
                }
             }
+            else {
+               hasMissingBias = true;
+            }
             bias[k] = currBias;
          }
       }
+      // The bias at every gridpoint depends on the bias at every station, so no correction
+      // can be made if any are missing
+      if(hasMissingBias)
+         continue;
+
+      std::vector<float> z;
+      factor.solve(bias, z);
+      // Missing for gridpoints without nearby stations
+      std::vector<float> gridBias;
+      covariances.multiply(z, gridBias);
 
       #pragma omp parallel for
       for(int i = 0; i < nLat; i++) {
          for(int j = 0; j < nLon; j++) {
-
-            std::vector<float> currS = S[i][j];
-            std::vector<int> currI = Sindex[i][j];
-            int currN = currS.size();
-
-            // No correction if there are no nearby stations
-            if(currN == 0)
-               continue;
+            int index = i * nLon + j;
+            float finalBias = gridBias[index];
 
             // Don't use the nearest station when cross validating
-            float maxCovar = Util::MV;
-            int ImaxCovar = Util::MV;
-            if(mCrossValidate) {
-               for(int ii = 0; ii < currS.size(); ii++) {
-                  if(!Util::isValid(ImaxCovar) || currS[ii] > maxCovar) {
-                     ImaxCovar = ii;
-                     maxCovar = currS[ii];
-                  }
-               }
-               currS[ImaxCovar] = 0;
-               vec2 cvMatrix = matrix;
-               for(int ii = 0; ii < currN; ii++) {
-                  cvMatrix[ImaxCovar][ii] = 0;
-                  cvMatrix[ii][ImaxCovar] = 0;
-               }
-               cvMatrix[ImaxCovar][ImaxCovar] = 1;
-               inverse = Util::inverse(cvMatrix);
-            }
-
-            // Compute weights (matrix-vector product)
-            std::vector<float> weights;
-            weights.resize(N, 0);
-            for(int ii = 0; ii < N; ii++) {
-               // Only loop over non-zero values in the vector
-               for(int jj = 0; jj < currN; jj++) {
-                  int JJ = currI[jj];
-                  weights[ii] += inverse[ii][JJ] * currS[jj];
-               }
-            }
-            // Set the weight of the nearest location to 0 when cross-validating
-            if(mCrossValidate) {
-               weights[ImaxCovar] = 0;
-            }
-
-            // Compute final bias (dot product of bias and weights)
-            float finalBias = 0;
-            for(int ii = 0; ii < N; ii++) {
-               float currBias = bias[ii];
-               if(!Util::isValid(currBias)) {
-                  finalBias = Util::MV;
-                  break;
-               }
-               finalBias += bias[ii]*weights[ii];
+            if(mCrossValidate && Util::isValid(finalBias)) {
+               finalBias -= cvFactors[index] * z[cvIndices[index]];
             }
-
             if(Util::isValid(finalBias)) {
                // Reconstruct the factor/divisor by adding the flucuations
                // onto the mean of 1
@@ -347,35 +419,38 @@ bool CalibratorKriging::calibrateCore(File& iFile, const ParameterFile* iParamet
                   finalBias = finalBias - 1;
 
                // Apply bias to each ensemble member
+               const float* weights = NULL;
+               if(mAuxVariable != "")
+                  weights = &auxWeights[t * (long) nLat * nLon * nEns + (long) index * nEns];
                for(int e = 0; e < nEns; e++) {
-                  float rawValue = (*field)(i,j,e);
+                  float memberBias = finalBias;
 
                   // Adjust bias based on auxillary weight
                   if(mAuxVariable != "") {
-                     float weight = auxWeights[i][j][e][t];
+                     float weight = weights[e];
                      if(mOperator == Util::OperatorAdd || mOperator == Util::OperatorSubtract) {
-                        finalBias = finalBias * weight;
+                        memberBias = finalBias * weight;
                      }
                      else {
-                        finalBias = pow(finalBias, weight);
+                        memberBias = pow(finalBias, weight);
                      }
                   }
 
                   if(mOperator == Util::OperatorAdd) {
-                     (*field)(i,j,e) += finalBias;
+                     (*field)(i,j,e) += memberBias;
                   }
                   else if(mOperator == Util::OperatorSubtract) {
-                     (*field)(i,j,e) -= finalBias;
+                     (*field)(i,j,e) -= memberBias;
                   }
                   else if(mOperator == Util::OperatorMultiply) {
                      // TODO: How do we ensure that the matrix is positive definite in this
                      // case?
-                     (*field)(i,j,e) *= finalBias;
+                     (*field)(i,j,e) *= memberBias;
                   }
                   else if(mOperator == Util::OperatorDivide) {
                      // TODO: How do we ensure that the matrix is positive definite in this
                      // case?
-                     (*field)(i,j,e) /= finalBias;
+                     (*field)(i,j,e) /= memberBias;
                   }
                   else {
                      Util::error("Unrecognized operator in CalibratorKriging");
@@ -420,6 +495,18 @@ float CalibratorKriging::calcCovar(const Location& loc1, const Location& loc2) c
          weight = horizWeight * vertWeight;
          return weight;
       }
+      else if(mKrigingType == TypeWendland) {
+         if(horizDist >= mEfoldDist || (Util::isValid(mMaxElevDiff) && vertDist >= mMaxElevDiff))
+            return 0;
+         float h = horizDist / mEfoldDist;
+         float horizWeight = pow(1 - h, 4) * (4 * h + 1);
+         float vertWeight = 1;
+         if(Util::isValid(mMaxElevDiff)) {
+            float v = vertDist / mMaxElevDiff;
+            vertWeight = pow(1 - v, 4) * (4 * v + 1);
+         }
+         weight = horizWeight * vertWeight;
+      }
    }
    return weight;
 }
@@ -478,12 +565,12 @@ std::string CalibratorKriging::description(bool full) {
    if(full) {
       ss << Util::formatDescription("-c kriging","Spreads bias in space by using kriging. A parameter file is required, which must have one column with the bias.")<< std::endl;
       ss << Util::formatDescription("   radius=30000","Only use values from locations within this radius (in meters). Must be >= 0.") << std::endl;
-      ss << Util::formatDescription("   efoldDist=30000","How fast should the weight of a station reduce with distance? For cressman: linearly decrease to this distance (in meters); For barnes: reduce to 1/e after this distance (in meters). Must be >= 0.") << std::endl;
+      ss << Util::formatDescription("   efoldDist=30000","How fast should the weight of a station reduce with distance? For cressman: linearly decrease to this distance (in meters); For barnes: reduce to 1/e after this distance (in meters); For wendland: smoothly decrease to 0 at this distance (in meters). Must be >= 0.") << std::endl;
       ss << Util::formatDescription("   maxElevDiff=undef","What is the maximum elevation difference (in meters) that bias can be spread to? Must be >= 0. Leave undefined if no reduction of bias in the vertical is desired.") << std::endl;
       ss << Util::formatDescription("   auxVariable=undef","Should an auxilary variable be used to turn off kriging? For example turn off kriging where there is precipitation.") << std::endl;
       ss << Util::formatDescription("   range=undef","What range of the auxillary variable should kriging be turned on for? For example use 0,0.3 to turn kriging off for precip > 0.3.") << std::endl;
       ss << Util::formatDescription("   window=0","Use a time window to allow weighting of the kriging. Use the fraction of timesteps within +- window where the auxillary variable is within the range. Use 0 for no window.") << std::endl;
-      ss << Util::formatDescription("   type=cressman","Weighting function used in kriging. One of 'cressman', or 'barnes'.") << std::endl;
+      ss << Util::formatDescription("   type=cressman","Weighting function used in kriging. One of 'cressman', 'barnes', or 'wendland'. Wendland is a compactly supported covariance function that always gives a positive definite obs-to-obs matrix, and since it is 0 beyond 'efoldDist', the matrix is sparse when 'efoldDist' is small compared to the domain.") << std::endl;
       ss << Util::formatDescription("   operator=add","How should the bias be applied to the raw forecast? One of 'add', 'subtract', 'multiply', 'divide'. For add/subtract, the mean of the field is assumed to be 0, and for multiply/divide, 1.") << std::endl;
       ss << Util::formatDescription("   approxDist=true","When computing the distance between two points, should the equirectangular approximation be used to save time? Should be good enough for most kriging purposes.") << std::endl;
       ss << Util::formatDescription("   crossValidate=false","If true, then don't use the nearest point in the kriging. The end result is a field that can be verified against observations at the kriging points.") << std::endl;
@@ -13,7 +13,9 @@ class CalibratorKriging : public Calibrator {
       float calcCovar(const Location& loc1, const Location& loc2) const;
       enum Type {
          TypeCressman = 10,
-         TypeBarnes   = 20
+         TypeBarnes   = 20,
+         //! Wendland C2 function, (1-r)^4 * (4r+1), which is 0 beyond 'efoldDist'
+         TypeWendland = 30
       };
       //! Compute the bias at the training point
       Parameters train(const std::vector<ObsEns>& iData) const;
@@ -3,6 +3,7 @@
 #include "../Util.h"
 #include "../File/File.h"
 #include "../ParameterFile/ParameterFile.h"
+#include "../KDTree.h"
 CalibratorMask::CalibratorMask(const Variable& iVariable, const Options& iOptions) :
       Calibrator(iVariable, iOptions),
       mUseNearestOnly(false),
@@ -32,31 +33,52 @@ bool CalibratorMask::calibrateCore(File& iFile, const ParameterFile* iParameterF
       isWithinRadius[i].resize(nLon, 0);
    }
 
+   // Search tree for finding the gridpoints within the radius of each parameter point
+   KDTree searchTree(KDTree::TypeCartesian);
+   if(!mUseNearestOnly)
+      searchTree.build(lats, lons);
+
    for(int t = 0; t < nTime; t++) {
       FieldPtr field = iFile.getField(mVariable, t);
+      if(!mUseNearestOnly && (t == 0 || iParameterFile->isTimeDependent())) {
+         std::vector<Location> locations = iParameterFile->getLocations();
+         // Query the tree in parallel, but mark the hits serially afterwards since several
+         // parameter points can cover the same gridpoint
+         std::vector<std::vector<int> > hitsI(locations.size());
+         std::vector<std::vector<int> > hitsJ(locations.size());
+         #pragma omp parallel for
+         for(int k = 0; k < locations.size(); k++) {
+            Parameters parameters = iParameterFile->getParameters(t, locations[k]);
+            float radius = parameters[0];
+            if(!Util::isValid(radius) || !Util::isValid(locations[k].lat()) || !Util::isValid(locations[k].lon()))
+               continue;
+            std::vector<int> I, J;
+            std::vector<float> distances;
+            searchTree.getWithinRadius(locations[k].lat(), locations[k].lon(), radius, I, J, distances);
+            for(int n = 0; n < I.size(); n++) {
+               if(distances[n] < radius) {
+                  hitsI[k].push_back(I[n]);
+                  hitsJ[k].push_back(J[n]);
+               }
+            }
+         }
+         for(int k = 0; k < locations.size(); k++) {
+            for(int n = 0; n < hitsI[k].size(); n++) {
+               isWithinRadius[hitsI[k][n]][hitsJ[k][n]] = 1;
+            }
+         }
+      }
       #pragma omp parallel for
       for(int i = 0; i < nLat; i++) {
          for(int j = 0; j < nLon; j++) {
-            if(t == 0 || iParameterFile->isTimeDependent()) {
+            if(mUseNearestOnly && (t == 0 || iParameterFile->isTimeDependent())) {
                Location loc(Util::MV, Util::MV, Util::MV);
                Location currLocation(lats[i][j], lons[i][j], elevs[i][j]);
-               if(mUseNearestOnly) {
-                  iParameterFile->getNearestLocation(t, currLocation, loc);
-                  Parameters parameters = iParameterFile->getParameters(t, Location(lats[i][j], lons[i][j], elevs[i][j]));
-                  float dist = currLocation.getDistance(loc);
-                  if(Util::isValid(dist) && dist < parameters[0]) {
-                     isWithinRadius[i][j] = 1;
-                  }
-               }
-               else {
-                  std::vector<Location> locations = iParameterFile->getLocations();
-                  for(int k = 0; k < locations.size(); k++) {
-                     Parameters parameters = iParameterFile->getParameters(t, locations[k]);
-                     float dist = currLocation.getDistance(locations[k]);
-                     if(Util::isValid(dist) && dist < parameters[0]) {
-                        isWithinRadius[i][j] = 1;
-                     }
-                  }
+               iParameterFile->getNearestLocation(t, currLocation, loc);
+               Parameters parameters = iParameterFile->getParameters(t, Location(lats[i][j], lons[i][j], elevs[i][j]));
+               float dist = currLocation.getDistance(loc);
+               if(Util::isValid(dist) && dist < parameters[0]) {
+                  isWithinRadius[i][j] = 1;
                }
             }
             // Remove the point if keep and we are not within the radius or we don't keep and are
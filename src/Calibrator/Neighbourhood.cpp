@@ -1,16 +1,22 @@
 #include "Neighbourhood.h"
 #include <algorithm>
+#include <limits>
 #include <math.h>
 #include <boost/math/distributions/gamma.hpp>
 #include "../Util.h"
 #include "../File/File.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 CalibratorNeighbourhood::CalibratorNeighbourhood(const Variable& iVariable, const Options& iOptions):
       Calibrator(iVariable, iOptions),
       mRadius(3),
       mStatType(Util::StatTypeMean),
       mFast(true),
       mApprox(false),
-      mQuantile(Util::MV) {
+      mQuantile(Util::MV),
+      mKernel(KernelSquare),
+      mSigma(Util::MV) {
    iOptions.getValue("radius", mRadius);
    iOptions.getValue("fast", mFast);
    iOptions.getValue("approx", mApprox);
@@ -35,6 +41,55 @@ CalibratorNeighbourhood::CalibratorNeighbourhood(const Variable& iVariable, cons
          Util::error("'quantile' must be on the interval [0,1]");
       }
    }
+
+   std::string kernel;
+   if(iOptions.getValue("kernel", kernel)) {
+      if(kernel == "square")
+         mKernel = KernelSquare;
+      else if(kernel == "disc")
+         mKernel = KernelDisc;
+      else if(kernel == "gaussian")
+         mKernel = KernelGaussian;
+      else if(kernel == "weights")
+         mKernel = KernelWeights;
+      else {
+         std::stringstream ss;
+         ss << "Could not recognize kernel=" << kernel;
+         Util::error(ss.str());
+      }
+   }
+   if(mKernel != KernelSquare && mStatType != Util::StatTypeMean && mStatType != Util::StatTypeSum) {
+      Util::error("CalibratorNeighbourhood: kernel=" + kernel + " can only be used with stat=mean or stat=sum");
+   }
+   if(iOptions.getValue("sigma", mSigma)) {
+      if(!Util::isValid(mSigma) || mSigma <= 0) {
+         Util::error("CalibratorNeighbourhood: 'sigma' must be > 0");
+      }
+   }
+   if(mKernel == KernelWeights) {
+      iOptions.getRequiredValues("weights", mWeights);
+      int width = round(sqrt(mWeights.size()));
+      if(width * width != mWeights.size() || width % 2 == 0) {
+         std::stringstream ss;
+         ss << "CalibratorNeighbourhood: The number of weights (" << mWeights.size() << ") must be the square of an odd number";
+         Util::error(ss.str());
+      }
+      bool hasPositive = false;
+      for(int k = 0; k < mWeights.size(); k++) {
+         if(!Util::isValid(mWeights[k]) || mWeights[k] < 0)
+            Util::error("CalibratorNeighbourhood: 'weights' must be >= 0");
+         hasPositive = hasPositive || mWeights[k] > 0;
+      }
+      if(!hasPositive)
+         Util::error("CalibratorNeighbourhood: At least one weight must be > 0");
+      int radius = (width - 1) / 2;
+      if(iOptions.getValue("radius", mRadius) && mRadius != radius) {
+         std::stringstream ss;
+         ss << "CalibratorNeighbourhood: 'radius' (" << mRadius << ") does not match the " << width << "x" << width << " weights";
+         Util::error(ss.str());
+      }
+      mRadius = radius;
+   }
    iOptions.check();
 }
 
@@ -67,6 +122,611 @@ int CalibratorNeighbourhood::numMissingValues(const Field& iField, int iEnsIndex
    }
    return count;
 }
+void CalibratorNeighbourhood::calcSummedArea(const Field& iInput, int iEnsIndex, int iRadius,
+      std::vector<double>& iValues, std::vector<double>& iSquares, std::vector<int>& iCounts, Field& iOutput, bool iParallel) const {
+   int nLat = iInput.getNumY();
+   int nLon = iInput.getNumX();
+   bool useSquares = mStatType == Util::StatTypeStd;
+   // The tables have an extra row and column of zeros at the start, so that the sum of the first
+   // i rows and j columns is at index i * width + j. Accumulate in double precision, since the
+   // neighbourhood sums are differences of large accumulated values.
+   int width = nLon + 1;
+   iValues.assign((long) (nLat + 1) * width, 0);
+   iCounts.assign((long) (nLat + 1) * width, 0);
+   if(useSquares)
+      iSquares.assign((long) (nLat + 1) * width, 0);
+   double* values = &iValues[0];
+   double* squares = useSquares ? &iSquares[0] : NULL;
+   int* counts = &iCounts[0];
+
+   // The standard deviation is computed from the sums of x - K and (x - K)^2, where K is the mean of
+   // the member. Since VAR(X) = VAR(X - K), this avoids subtracting two large and almost equal
+   // numbers when the variance is small compared to the mean, similarly to Util::calculateStat.
+   double shift = 0;
+   if(useSquares) {
+      double total = 0;
+      long count = 0;
+      for(int i = 0; i < nLat; i++) {
+         for(int j = 0; j < nLon; j++) {
+            float value = iInput(i, j, iEnsIndex);
+            if(Util::isValid(value)) {
+               total += value;
+               count++;
+            }
+         }
+      }
+      if(count > 0)
+         shift = total / count;
+   }
+
+   // Accumulate along each row
+   #pragma omp parallel for if(iParallel)
+   for(int i = 0; i < nLat; i++) {
+      double* rowValues = values + (long) (i + 1) * width;
+      double* rowSquares = useSquares ? squares + (long) (i + 1) * width : NULL;
+      int* rowCounts = counts + (long) (i + 1) * width;
+      double total = 0;
+      double total2 = 0;
+      int count = 0;
+      for(int j = 0; j < nLon; j++) {
+         float value = iInput(i, j, iEnsIndex);
+         if(Util::isValid(value)) {
+            double shifted = value - shift;
+            total += shifted;
+            total2 += shifted * shifted;
+            count++;
+         }
+         rowValues[j + 1] = total;
+         rowCounts[j + 1] = count;
+         if(useSquares)
+            rowSquares[j + 1] = total2;
+      }
+   }
+
+   // Accumulate down each column. Each thread handles a strip of columns, so that it reads
+   // contiguous memory in each row.
+   int stripWidth = 64;
+   int numStrips = (width + stripWidth - 1) / stripWidth;
+   #pragma omp parallel for if(iParallel)
+   for(int s = 0; s < numStrips; s++) {
+      int start = s * stripWidth;
+      int end = std::min(width, start + stripWidth);
+      for(int i = 1; i <= nLat; i++) {
+         double* rowValues = values + (long) i * width;
+         const double* prevValues = rowValues - width;
+         int* rowCounts = counts + (long) i * width;
+         const int* prevCounts = rowCounts - width;
+         for(int j = start; j < end; j++) {
+            rowValues[j] += prevValues[j];
+            rowCounts[j] += prevCounts[j];
+         }
+         if(useSquares) {
+            double* rowSquares = squares + (long) i * width;
+            const double* prevSquares = rowSquares - width;
+            for(int j = start; j < end; j++)
+               rowSquares[j] += prevSquares[j];
+         }
+      }
+   }
+
+   // Compute the neighbourhood sums from the corners of each neighbourhood
+   #pragma omp parallel for if(iParallel)
+   for(int i = 0; i < nLat; i++) {
+      long i0 = (long) std::max(0, i - iRadius) * width;
+      long i1 = (long) std::min(nLat, i + iRadius + 1) * width;
+      for(int j = 0; j < nLon; j++) {
+         int j0 = std::max(0, j - iRadius);
+         int j1 = std::min(nLon, j + iRadius + 1);
+         int count = counts[i1 + j1] - counts[i1 + j0] - counts[i0 + j1] + counts[i0 + j0];
+         if(count > 0) {
+            double value = values[i1 + j1] - values[i1 + j0] - values[i0 + j1] + values[i0 + j0];
+            if(mStatType == Util::StatTypeMean) {
+               value = value / count + shift;
+            }
+            else if(mStatType == Util::StatTypeStd) {
+               double value2 = squares[i1 + j1] - squares[i1 + j0] - squares[i0 + j1] + squares[i0 + j0];
+               double mean = value / count;
+               double variance = value2 / count - mean * mean;
+               // The round-off error of the variance is proportional to the accumulated squares.
+               // Set variances below this level to 0, so that neighbourhoods with constant values
+               // get 0 (and not a small or negative variance).
+               double tolerance = 8 * std::numeric_limits<double>::epsilon() * squares[i1 + j1] / count;
+               value = variance > tolerance ? sqrt(variance) : 0;
+            }
+            iOutput(i, j, iEnsIndex) = value;
+         }
+         else {
+            // Same as the brute force method when the whole neighbourhood is missing
+            iOutput(i, j, iEnsIndex) = Util::MV;
+         }
+      }
+   }
+}
+void CalibratorNeighbourhood::calcRunningMin(const float* iInput, int iNum, int iRadius, float* iOutput, std::vector<float>& iWork) {
+   // van Herk/Gil-Werman algorithm: Pad the line with iRadius values of infinity on each side and
+   // split it into blocks with the same length as the window. Any window then covers the end of
+   // one block and the start of the next, so its minimum is the smaller of the suffix minimum of
+   // the first block and the prefix minimum of the second. This needs 3 comparisons per value,
+   // regardless of the radius.
+   int window = 2 * iRadius + 1;
+   int length = iNum + 2 * iRadius;
+   iWork.resize(3 * length);
+   float* padded = &iWork[0];
+   float* prefix = padded + length;
+   float* suffix = prefix + length;
+   float infinity = std::numeric_limits<float>::infinity();
+   for(int k = 0; k < iRadius; k++) {
+      padded[k] = infinity;
+      padded[length - 1 - k] = infinity;
+   }
+   for(int k = 0; k < iNum; k++)
+      padded[iRadius + k] = iInput[k];
+
+   for(int start = 0; start < length; start += window) {
+      int end = std::min(length, start + window) - 1;
+      prefix[start] = padded[start];
+      for(int k = start + 1; k <= end; k++)
+         prefix[k] = std::min(prefix[k-1], padded[k]);
+      suffix[end] = padded[end];
+      for(int k = end - 1; k >= start; k--)
+         suffix[k] = std::min(suffix[k+1], padded[k]);
+   }
+   // The window for output k covers padded values k to k + window - 1
+   for(int k = 0; k < iNum; k++)
+      iOutput[k] = std::min(suffix[k], prefix[k + window - 1]);
+}
+
+void CalibratorNeighbourhood::calcRunningExtreme(const Field& iInput, int iEnsIndex, int iRadius, bool iMax, Field& iOutput) const {
+   int nLat = iInput.getNumY();
+   int nLon = iInput.getNumX();
+   // Compute the maximum as the negative of the minimum of the negated values. Missing values are
+   // replaced by infinity, so that they never become the minimum, and a neighbourhood with only
+   // missing values has a minimum of infinity.
+   float sign = iMax ? -1 : 1;
+   float infinity = std::numeric_limits<float>::infinity();
+
+   // Minimum along each row
+   std::vector<float> rowMin((long) nLat * nLon);
+   #pragma omp parallel
+   {
+      std::vector<float> line(nLon);
+      std::vector<float> work;
+      #pragma omp for
+      for(int i = 0; i < nLat; i++) {
+         for(int j = 0; j < nLon; j++) {
+            float value = iInput(i, j, iEnsIndex);
+            line[j] = Util::isValid(value) ? sign * value : infinity;
+         }
+         calcRunningMin(&line[0], nLon, iRadius, &rowMin[(long) i * nLon], work);
+      }
+   }
+
+   // Minimum down each column of the row minimums
+   #pragma omp parallel
+   {
+      std::vector<float> line(nLat);
+      std::vector<float> result(nLat);
+      std::vector<float> work;
+      #pragma omp for
+      for(int j = 0; j < nLon; j++) {
+         for(int i = 0; i < nLat; i++)
+            line[i] = rowMin[(long) i * nLon + j];
+         calcRunningMin(&line[0], nLat, iRadius, &result[0], work);
+         for(int i = 0; i < nLat; i++)
+            iOutput(i, j, iEnsIndex) = result[i] == infinity ? Util::MV : sign * result[i];
+      }
+   }
+}
+
+void CalibratorNeighbourhood::calcRunningQuantile(const Field& iInput, int iEnsIndex, int iRadius, float iQuantile, Field& iOutput) const {
+   int nLat = iInput.getNumY();
+   int nLon = iInput.getNumX();
+   // Process bands of rows. Within a band, each valid value is replaced by its rank among the
+   // valid values that the band's neighbourhoods cover. The ranks in the current neighbourhood are
+   // counted in a binary indexed (Fenwick) tree, which gives the k'th smallest value in O(log n).
+   // The neighbourhood slides along each row, adding and removing one column of values at a time.
+   // This gives the exact quantile, and the cost per gridpoint grows linearly with the radius,
+   // instead of with the square of the radius as in the brute force method.
+   int bandSize = 32;
+   int numBands = (nLat + bandSize - 1) / bandSize;
+   std::vector<float> result((long) nLat * nLon);
+   #pragma omp parallel
+   {
+      std::vector<std::pair<float, int> > sorted;
+      std::vector<int> ranks;
+      std::vector<int> tree;
+      #pragma omp for schedule(dynamic)
+      for(int b = 0; b < numBands; b++) {
+         int bandStart = b * bandSize;
+         int bandEnd = std::min(nLat, bandStart + bandSize);
+         int rowStart = std::max(0, bandStart - iRadius);
+         int rowEnd = std::min(nLat, bandEnd + iRadius);
+
+         // Rank the valid values. Missing values get rank -1.
+         sorted.clear();
+         ranks.assign((rowEnd - rowStart) * nLon, -1);
+         for(int i = rowStart; i < rowEnd; i++) {
+            for(int j = 0; j < nLon; j++) {
+               float value = iInput(i, j, iEnsIndex);
+               if(Util::isValid(value))
+                  sorted.push_back(std::pair<float, int>(value, (i - rowStart) * nLon + j));
+            }
+         }
+         std::sort(sorted.begin(), sorted.end());
+         int numRanks = sorted.size();
+         for(int k = 0; k < numRanks; k++)
+            ranks[sorted[k].second] = k;
+         int topBit = 1;
+         while(topBit * 2 <= numRanks)
+            topBit *= 2;
+         tree.assign(numRanks + 1, 0);
+
+         for(int i = bandStart; i < bandEnd; i++) {
+            int i0 = std::max(0, i - iRadius) - rowStart;
+            int i1 = std::min(nLat - 1, i + iRadius) - rowStart;
+            int count = 0;
+            // Slide the neighbourhood one column to the right at a time. Start before the first
+            // column, so that the first neighbourhood is filled up column by column.
+            for(int j = -iRadius - 1; j < nLon; j++) {
+               for(int side = 0; side < 2; side++) {
+                  // Add the column entering on the right and remove the one leaving on the left
+                  int col = side == 0 ? j + iRadius : j - iRadius - 1;
+                  int sign = side == 0 ? 1 : -1;
+                  if(col < 0 || col >= nLon)
+                     continue;
+                  for(int ii = i0; ii <= i1; ii++) {
+                     int rank = ranks[ii * nLon + col];
+                     if(rank < 0)
+                        continue;
+                     count += sign;
+                     for(int k = rank + 1; k <= numRanks; k += k & (-k))
+                        tree[k] += sign;
+                  }
+               }
+               if(j < 0)
+                  continue;
+
+               float* output = &result[(long) i * nLon + j];
+               if(count == 0) {
+                  *output = Util::MV;
+                  continue;
+               }
+               // Interpolate between two order statistics, in the same way as Util::calculateStat
+               int lowerIndex = floor(iQuantile * (count-1));
+               int upperIndex = ceil(iQuantile * (count-1));
+               float lowerValue = sorted[findKthRank(tree, topBit, lowerIndex)].first;
+               if(lowerIndex == upperIndex) {
+                  *output = lowerValue;
+               }
+               else {
+                  float upperValue = sorted[findKthRank(tree, topBit, upperIndex)].first;
+                  float lowerQuantile = (float) lowerIndex / (count-1);
+                  float upperQuantile = (float) upperIndex / (count-1);
+                  float f = (iQuantile - lowerQuantile)/(upperQuantile - lowerQuantile);
+                  *output = lowerValue + (upperValue - lowerValue) * f;
+               }
+            }
+            // The last columns are still in the tree
+            for(int col = std::max(0, nLon - iRadius - 1); col < nLon; col++) {
+               for(int ii = i0; ii <= i1; ii++) {
+                  int rank = ranks[ii * nLon + col];
+                  if(rank < 0)
+                     continue;
+                  for(int k = rank + 1; k <= numRanks; k += k & (-k))
+                     tree[k]--;
+               }
+            }
+         }
+      }
+   }
+   // Write the output at the end, in case the input and output fields are the same
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         iOutput(i, j, iEnsIndex) = result[(long) i * nLon + j];
+      }
+   }
+}
+
+int CalibratorNeighbourhood::findKthRank(const std::vector<int>& iTree, int iTopBit, int iK) {
+   // Descend the tree, skipping over blocks of ranks that contain at most iK values
+   int numRanks = iTree.size() - 1;
+   int position = 0;
+   for(int step = iTopBit; step > 0; step /= 2) {
+      if(position + step <= numRanks && iTree[position + step] <= iK) {
+         position += step;
+         iK -= iTree[position];
+      }
+   }
+   return position;
+}
+
+void CalibratorNeighbourhood::getKernel(int iRadius, std::vector<double>& iWeights) const {
+   int width = 2 * iRadius + 1;
+   if(mKernel == KernelWeights) {
+      assert(mWeights.size() == width * width);
+      iWeights.assign(mWeights.begin(), mWeights.end());
+      return;
+   }
+   iWeights.resize(width * width);
+   double sigma = Util::isValid(mSigma) ? mSigma : iRadius / 3.0;
+   for(int di = -iRadius; di <= iRadius; di++) {
+      for(int dj = -iRadius; dj <= iRadius; dj++) {
+         int dist2 = di * di + dj * dj;
+         double weight = 1;
+         if(mKernel == KernelDisc)
+            weight = dist2 <= iRadius * iRadius;
+         else if(mKernel == KernelGaussian && dist2 > 0)
+            weight = exp(-0.5 * dist2 / (sigma * sigma));
+         iWeights[(di + iRadius) * width + dj + iRadius] = weight;
+      }
+   }
+}
+
+void CalibratorNeighbourhood::calcWeighted(const Field& iInput, int iEnsIndex, int iRadius, Field& iOutput) const {
+   int nLat = iInput.getNumY();
+   int nLon = iInput.getNumX();
+   long size = (long) nLat * nLon;
+   int width = 2 * iRadius + 1;
+
+   // Normalized convolution: Convolve the values (with missing values set to 0) and the mask of
+   // valid values with the kernel. The first gives the weighted sum of the valid values, and the
+   // second the total weight of the valid values, which the weighted mean is divided by. The
+   // member's mean is removed from the values first, to reduce round-off errors.
+   std::vector<double> values(size, 0);
+   std::vector<double> mask(size, 0);
+   double shift = 0;
+   long count = 0;
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         float value = iInput(i, j, iEnsIndex);
+         if(Util::isValid(value)) {
+            shift += value;
+            count++;
+         }
+      }
+   }
+   if(count > 0)
+      shift /= count;
+   double maxAnomaly = 0;
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         float value = iInput(i, j, iEnsIndex);
+         if(Util::isValid(value)) {
+            long k = (long) i * nLon + j;
+            values[k] = value - shift;
+            mask[k] = 1;
+            maxAnomaly = std::max(maxAnomaly, fabs(values[k]));
+         }
+      }
+   }
+
+   std::vector<double> kernel;
+   getKernel(iRadius, kernel);
+   double minWeight = std::numeric_limits<double>::infinity();
+   double totalWeight = 0;
+   for(int k = 0; k < kernel.size(); k++) {
+      if(kernel[k] > 0)
+         minWeight = std::min(minWeight, kernel[k]);
+      totalWeight += kernel[k];
+   }
+   // When no valid values have a positive weight, the total weight is 0. Otherwise it is at least
+   // the smallest weight.
+   double tolerance = 0.5 * minWeight;
+
+   std::vector<double> smoothedValues;
+   std::vector<double> smoothedMask;
+   if(mKernel == KernelGaussian) {
+      // The gaussian is the product of a gaussian in each direction
+      std::vector<double> kernel1D(kernel.begin() + iRadius * width, kernel.begin() + (iRadius + 1) * width);
+      convolveSeparable(values, nLat, nLon, kernel1D, smoothedValues);
+      convolveSeparable(mask, nLat, nLon, kernel1D, smoothedMask);
+   }
+   else if(mKernel == KernelDisc) {
+      convolveDisc(values, nLat, nLon, iRadius, smoothedValues);
+      convolveDisc(mask, nLat, nLon, iRadius, smoothedMask);
+   }
+   else if(width * width <= 256) {
+      convolveDirect(values, nLat, nLon, iRadius, kernel, smoothedValues);
+      convolveDirect(mask, nLat, nLon, iRadius, kernel, smoothedMask);
+   }
+   else {
+      convolveFft(values, mask, nLat, nLon, iRadius, kernel, smoothedValues, smoothedMask);
+      // The FFT spreads round-off errors to all points, including those without valid values
+      tolerance = std::max(tolerance, 1e-12 * totalWeight * (1 + maxAnomaly));
+   }
+
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         long k = (long) i * nLon + j;
+         float value = Util::MV;
+         if(smoothedMask[k] > tolerance) {
+            if(mStatType == Util::StatTypeMean)
+               value = smoothedValues[k] / smoothedMask[k] + shift;
+            else
+               value = smoothedValues[k] + shift * smoothedMask[k];
+         }
+         iOutput(i, j, iEnsIndex) = value;
+      }
+   }
+}
+
+void CalibratorNeighbourhood::convolveSeparable(const std::vector<double>& iInput, int nLat, int nLon, const std::vector<double>& iKernel, std::vector<double>& iOutput) {
+   int radius = (iKernel.size() - 1) / 2;
+   // Along each row
+   std::vector<double> rows(iInput.size());
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      const double* input = &iInput[(long) i * nLon];
+      double* output = &rows[(long) i * nLon];
+      for(int j = 0; j < nLon; j++) {
+         double total = 0;
+         int start = std::max(-radius, -j);
+         int end = std::min(radius, nLon - 1 - j);
+         for(int dj = start; dj <= end; dj++)
+            total += iKernel[dj + radius] * input[j + dj];
+         output[j] = total;
+      }
+   }
+   // Along each column, by adding up whole rows
+   iOutput.assign(iInput.size(), 0);
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      double* output = &iOutput[(long) i * nLon];
+      int start = std::max(-radius, -i);
+      int end = std::min(radius, nLat - 1 - i);
+      for(int di = start; di <= end; di++) {
+         double weight = iKernel[di + radius];
+         const double* input = &rows[(long) (i + di) * nLon];
+         for(int j = 0; j < nLon; j++)
+            output[j] += weight * input[j];
+      }
+   }
+}
+
+void CalibratorNeighbourhood::convolveDisc(const std::vector<double>& iInput, int nLat, int nLon, int iRadius, std::vector<double>& iOutput) {
+   // Each row of the disc covers a contiguous set of columns, whose sum is the difference of two
+   // prefix sums. This costs one subtraction per row of the disc, instead of one addition per point.
+   int width = nLon + 1;
+   std::vector<double> prefix((long) nLat * width);
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      double* row = &prefix[(long) i * width];
+      const double* input = &iInput[(long) i * nLon];
+      row[0] = 0;
+      for(int j = 0; j < nLon; j++)
+         row[j + 1] = row[j] + input[j];
+   }
+   // The largest h such that h^2 + di^2 <= radius^2
+   std::vector<int> halfWidths(2 * iRadius + 1);
+   for(int di = -iRadius; di <= iRadius; di++) {
+      int h = iRadius;
+      while(h * h + di * di > iRadius * iRadius)
+         h--;
+      halfWidths[di + iRadius] = h;
+   }
+
+   iOutput.assign(iInput.size(), 0);
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      double* output = &iOutput[(long) i * nLon];
+      int start = std::max(-iRadius, -i);
+      int end = std::min(iRadius, nLat - 1 - i);
+      for(int di = start; di <= end; di++) {
+         int h = halfWidths[di + iRadius];
+         const double* row = &prefix[(long) (i + di) * width];
+         for(int j = 0; j < nLon; j++)
+            output[j] += row[std::min(nLon, j + h + 1)] - row[std::max(0, j - h)];
+      }
+   }
+}
+
+void CalibratorNeighbourhood::convolveDirect(const std::vector<double>& iInput, int nLat, int nLon, int iRadius, const std::vector<double>& iKernel, std::vector<double>& iOutput) {
+   int width = 2 * iRadius + 1;
+   iOutput.assign(iInput.size(), 0);
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      double* output = &iOutput[(long) i * nLon];
+      int start = std::max(-iRadius, -i);
+      int end = std::min(iRadius, nLat - 1 - i);
+      for(int di = start; di <= end; di++) {
+         const double* input = &iInput[(long) (i + di) * nLon];
+         for(int dj = -iRadius; dj <= iRadius; dj++) {
+            double weight = iKernel[(di + iRadius) * width + dj + iRadius];
+            if(weight == 0)
+               continue;
+            int jStart = std::max(0, -dj);
+            int jEnd = std::min(nLon, nLon - dj);
+            for(int j = jStart; j < jEnd; j++)
+               output[j] += weight * input[j + dj];
+         }
+      }
+   }
+}
+
+void CalibratorNeighbourhood::convolveFft(const std::vector<double>& iInput1, const std::vector<double>& iInput2, int nLat, int nLon, int iRadius, const std::vector<double>& iKernel,
+      std::vector<double>& iOutput1, std::vector<double>& iOutput2) {
+   // Overlap-save method: The FFT gives a circular convolution of each tile, which is only correct
+   // at least iRadius points away from the edges of the tile. The tiles therefore overlap by
+   // 2 * iRadius points, and only their inner blocks are used.
+   int width = 2 * iRadius + 1;
+   int size = 1;
+   while(size < 2 * width)
+      size *= 2;
+   int block = size - 2 * iRadius;
+
+   // The kernel is flipped, so that the convolution gives the sum of kernel(d) * input(p + d)
+   std::vector<std::complex<double> > kernelTransform(size * size, 0);
+   std::vector<std::complex<double> > work;
+   for(int di = -iRadius; di <= iRadius; di++) {
+      for(int dj = -iRadius; dj <= iRadius; dj++) {
+         int k = ((size - di) % size) * size + (size - dj) % size;
+         kernelTransform[k] = iKernel[(di + iRadius) * width + dj + iRadius];
+      }
+   }
+   fft2(kernelTransform, size, false, work);
+
+   iOutput1.resize(iInput1.size());
+   iOutput2.resize(iInput2.size());
+   int numTilesY = (nLat + block - 1) / block;
+   int numTilesX = (nLon + block - 1) / block;
+   #pragma omp parallel
+   {
+      std::vector<std::complex<double> > tile(size * size);
+      std::vector<std::complex<double> > tileWork;
+      #pragma omp for schedule(dynamic)
+      for(int t = 0; t < numTilesY * numTilesX; t++) {
+         int iStart = (t / numTilesX) * block;
+         int jStart = (t % numTilesX) * block;
+         for(int a = 0; a < size; a++) {
+            int i = iStart - iRadius + a;
+            for(int b = 0; b < size; b++) {
+               int j = jStart - iRadius + b;
+               if(i >= 0 && i < nLat && j >= 0 && j < nLon) {
+                  long k = (long) i * nLon + j;
+                  tile[a * size + b] = std::complex<double>(iInput1[k], iInput2[k]);
+               }
+               else {
+                  tile[a * size + b] = 0;
+               }
+            }
+         }
+         fft2(tile, size, false, tileWork);
+         for(int k = 0; k < size * size; k++)
+            tile[k] *= kernelTransform[k];
+         fft2(tile, size, true, tileWork);
+
+         // The kernel is real, so the real and imaginary parts are the convolutions of each input
+         int iEnd = std::min(block, nLat - iStart);
+         int jEnd = std::min(block, nLon - jStart);
+         for(int a = 0; a < iEnd; a++) {
+            for(int b = 0; b < jEnd; b++) {
+               long k = (long) (iStart + a) * nLon + jStart + b;
+               const std::complex<double>& value = tile[(a + iRadius) * size + b + iRadius];
+               iOutput1[k] = value.real();
+               iOutput2[k] = value.imag();
+            }
+         }
+      }
+   }
+}
+
+void CalibratorNeighbourhood::fft2(std::vector<std::complex<double> >& iValues, int iSize, bool iInverse, std::vector<std::complex<double> >& iWork) {
+   iWork.resize(iSize);
+   for(int i = 0; i < iSize; i++) {
+      std::copy(iValues.begin() + i * iSize, iValues.begin() + (i + 1) * iSize, iWork.begin());
+      Util::fft(iWork, iInverse);
+      std::copy(iWork.begin(), iWork.end(), iValues.begin() + i * iSize);
+   }
+   for(int j = 0; j < iSize; j++) {
+      for(int i = 0; i < iSize; i++)
+         iWork[i] = iValues[i * iSize + j];
+      Util::fft(iWork, iInverse);
+      for(int i = 0; i < iSize; i++)
+         iValues[i * iSize + j] = iWork[i];
+   }
+}
+
 void CalibratorNeighbourhood::calibrateField(const Field& iInput, Field& iOutput, const Parameters* iParameters) const {
    double start_time = Util::clock();
    int radius = mRadius;
@@ -77,119 +737,122 @@ void CalibratorNeighbourhood::calibrateField(const Field& iInput, Field& iOutput
       radius = (*iParameters)[0];
    }
 
+   if(mKernel == KernelWeights && radius != mRadius) {
+      std::stringstream ss;
+      ss << "CalibratorNeighbourhood: The radius (" << radius << ") does not match the weights";
+      Util::error(ss.str());
+   }
+
    int count_stat = 0;
-   for(int e = 0; e < nEns; e++) {
-      if(mFast && (mStatType == Util::StatTypeMean || mStatType == Util::StatTypeSum)) {
-         vec2 values;
-         vec2 counts;
-         values.resize(nLat);
-         counts.resize(nLat);
-         for(int i = 0; i < nLat; i++) {
-            values[i].resize(nLon, 0);
-            counts[i].resize(nLon, 0);
+   if(mKernel != KernelSquare) {
+      for(int e = 0; e < nEns; e++) {
+         calcWeighted(iInput, e, radius, iOutput);
+      }
+   }
+   else if(mFast && (mStatType == Util::StatTypeMean || mStatType == Util::StatTypeSum || mStatType == Util::StatTypeStd)) {
+      // Process the members concurrently when there are enough of them to keep all threads busy.
+      // Otherwise, parallelize the scans within each member.
+      int numThreads = 1;
+#ifdef _OPENMP
+      numThreads = omp_get_max_threads();
+#endif
+      bool parallelMembers = nEns >= numThreads;
+      #pragma omp parallel if(parallelMembers)
+      {
+         std::vector<double> values;
+         std::vector<double> squares;
+         std::vector<int> counts;
+         #pragma omp for schedule(dynamic)
+         for(int e = 0; e < nEns; e++) {
+            calcSummedArea(iInput, e, radius, values, squares, counts, iOutput, !parallelMembers);
          }
-         // Compute accumulated values
-         for(int i = 0; i < nLat; i++) {
-            for(int j = 0; j < nLon; j++) {
-               float value = iInput(i, j, e);
-               if(j == 0 && i == 0) {
-                  // Lower corner
-                  if(Util::isValid(value)) {
-                     values[i][j] = iInput(i, j, e);
-                     counts[i][j] = 1;
-                  }
-               }
-               else if(j == 0) {
-                  // Lower row
-                  if(Util::isValid(value)) {
-                     values[i][j] = values[i-1][j] + iInput(i,j,e);
-                     counts[i][j] = counts[i-1][j] + 1;
-                  }
-                  else {
-                     values[i][j] = values[i-1][j];
-                     counts[i][j] = counts[i-1][j];
-                  }
-               }
-               else if(i == 0) {
-                  // Left column
-                  if(Util::isValid(value)) {
-                     values[i][j] = values[i][j-1] + iInput(i,j,e);
-                     counts[i][j] = counts[i][j-1] + 1;
-                  }
-                  else {
-                     values[i][j] = values[i][j-1];
-                     counts[i][j] = counts[i][j-1];
+      }
+   }
+   else if(mFast && (mStatType == Util::StatTypeMin || mStatType == Util::StatTypeMax)) {
+      for(int e = 0; e < nEns; e++) {
+         calcRunningExtreme(iInput, e, radius, mStatType == Util::StatTypeMax, iOutput);
+      }
+   }
+   else {
+      for(int e = 0; e < nEns; e++) {
+         if(numMissingValues(iInput, e) == 0 &&
+               mApprox && (mStatType == Util::StatTypeMedian || mStatType == Util::StatTypeQuantile)) {
+            // Compute quantiles in a faster, but approximate way
+            vec2 values;
+            values.resize(nLat);
+            for(int i = 0; i < nLat; i++) {
+               values[i].resize(nLon, 0);
+            }
+            #pragma omp parallel for
+            for(int i = 0; i < nLat; i++) {
+               if(i < radius || i >= nLat - radius) {
+                  // Regular way
+                  for(int j = 0; j < nLon; j++) {
+                     // Put neighbourhood into vector
+                     std::vector<float> neighbourhood;
+                     int Ni = std::min(nLat-1, i+radius) - std::max(0, i-radius) + 1;
+                     int Nj = std::min(nLon-1, j+radius) - std::max(0, j-radius) + 1;
+                     assert(Ni > 0);
+                     assert(Nj > 0);
+                     neighbourhood.resize(Ni*Nj, Util::MV);
+                     int index = 0;
+                     for(int ii = std::max(0, i-radius); ii <= std::min(nLat-1, i+radius); ii++) {
+                        for(int jj = std::max(0, j-radius); jj <= std::min(nLon-1, j+radius); jj++) {
+                           float value = iInput(ii,jj,e);
+                           assert(index < Ni*Nj);
+                           neighbourhood[index] = value;
+                           index++;
+                        }
+                     }
+                     assert(index == Ni*Nj);
+                     values[i][j] = Util::calculateStat(neighbourhood, mStatType, mQuantile);
+                     count_stat += neighbourhood.size();
                   }
-
                }
                else {
-                  if(Util::isValid(value)) {
-                     values[i][j] = values[i][j-1] + values[i-1][j] - values[i-1][j-1] + iInput(i,j,e);
-                     counts[i][j] = counts[i][j-1] + counts[i-1][j] - counts[i-1][j-1] + 1;
+                  // Fast way: Compute stats on each sliver
+                  std::vector<float> slivers(nLon, 0);
+                  for(int j = 0; j < nLon; j++) {
+                     std::vector<float> sliver(2*radius+1, 0);
+                     int count = 0;
+                     for(int ii = i - radius; ii <= i + radius; ii++) {
+                        sliver[count] = iInput(ii, j, e);
+                        count++;
+                     }
+                     slivers[j] = Util::calculateStat(sliver, mStatType, mQuantile);
+                     count_stat += sliver.size();
                   }
-                  else {
-                     values[i][j] = values[i][j-1] + values[i-1][j] - values[i-1][j-1];
-                     counts[i][j] = counts[i][j-1] + counts[i-1][j] - counts[i-1][j-1];
+                  for(int j = 0; j < nLon; j++) {
+                     std::vector<float> curr;
+                     curr.reserve(2*radius);
+                     for(int jj = std::max(0, j - radius); jj <= std::min(nLon-1, j + radius); jj++) {
+                        curr.push_back(slivers[jj]);
+                     }
+                     values[i][j] = Util::calculateStat(curr, mStatType, mQuantile);
+                     count_stat += curr.size();
                   }
                }
             }
-         }
-         // Put neighbourhood into vector
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
-            for(int j = 0; j < nLon; j++) {
-               int i1 = std::min(nLat-1, i + radius);
-               int j1 = std::min(nLon-1, j + radius);
-               int i0 = i - radius - 1;
-               int j0 = j - radius - 1;
-               float value11 = values[i1][j1];
-               float value00 = 0;
-               float value10 = 0;
-               float value01 = 0;
-               int count11 = counts[i1][j1];
-               int count00 = 0;
-               int count10 = 0;
-               int count01 = 0;
-               if(i0 >= 0 && j0 >= 0) {
-                  value00 = values[i0][j0];
-                  value10 = values[i1][j0];
-                  value01 = values[i0][j1];
-                  count00 = counts[i0][j0];
-                  count10 = counts[i1][j0];
-                  count01 = counts[i0][j1];
-               }
-               else if(j0 >= 0) {
-                  value10 = values[i1][j0];
-                  count10 = counts[i1][j0];
-               }
-               else if(i0 >= 0) {
-                  value01 = values[i0][j1];
-                  count01 = counts[i0][j1];
-               }
-               float value = value11 + value00 - value10 - value01;
-               int count = count11 + count00 - count10 - count01;
-               if(count > 0) {
-                  if(mStatType == Util::StatTypeMean) {
-                     value /= count;
-                  }
-                  iOutput(i,j,e) = value;
+            #pragma omp parallel for
+            for(int i = 0; i < nLat; i++) {
+               for(int j = 0; j < nLon; j++) {
+                  iOutput(i,j,e) = values[i][j];
                }
             }
          }
-      }
-      else if(numMissingValues(iInput, e) == 0 && (
-               (mFast && (mStatType == Util::StatTypeMin || mStatType == Util::StatTypeMax)) ||
-               (mApprox && (mStatType == Util::StatTypeMedian || mStatType == Util::StatTypeQuantile)))) {
-         // Compute min/max quickly or any other quantile in a faster, but approximate way
-         vec2 values;
-         values.resize(nLat);
-         for(int i = 0; i < nLat; i++) {
-            values[i].resize(nLon, 0);
+         else if(mFast && (mStatType == Util::StatTypeMedian || mStatType == Util::StatTypeQuantile)) {
+            float quantile = mStatType == Util::StatTypeMedian ? 0.5 : mQuantile;
+            calcRunningQuantile(iInput, e, radius, quantile, iOutput);
          }
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
-            if(i < radius || i >= nLat - radius) {
-               // Regular way
+         else {
+            // Compute by brute force
+            vec2 values;
+            values.resize(nLat);
+            for(int i = 0; i < nLat; i++) {
+               values[i].resize(nLon, 0);
+            }
+            #pragma omp parallel for
+            for(int i = 0; i < nLat; i++) {
                for(int j = 0; j < nLon; j++) {
                   // Put neighbourhood into vector
                   std::vector<float> neighbourhood;
@@ -212,72 +875,11 @@ void CalibratorNeighbourhood::calibrateField(const Field& iInput, Field& iOutput
                   count_stat += neighbourhood.size();
                }
             }
-            else {
-               // Fast way: Compute stats on each sliver
-               std::vector<float> slivers(nLon, 0);
+            #pragma omp parallel for
+            for(int i = 0; i < nLat; i++) {
                for(int j = 0; j < nLon; j++) {
-                  std::vector<float> sliver(2*radius+1, 0);
-                  int count = 0;
-                  for(int ii = i - radius; ii <= i + radius; ii++) {
-                     sliver[count] = iInput(ii, j, e);
-                     count++;
-                  }
-                  slivers[j] = Util::calculateStat(sliver, mStatType, mQuantile);
-                  count_stat += sliver.size();
-               }
-               for(int j = 0; j < nLon; j++) {
-                  std::vector<float> curr;
-                  curr.reserve(2*radius);
-                  for(int jj = std::max(0, j - radius); jj <= std::min(nLon-1, j + radius); jj++) {
-                     curr.push_back(slivers[jj]);
-                  }
-                  values[i][j] = Util::calculateStat(curr, mStatType, mQuantile);
-                  count_stat += curr.size();
-               }
-            }
-         }
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
-            for(int j = 0; j < nLon; j++) {
-               iOutput(i,j,e) = values[i][j];
-            }
-         }
-      }
-      else {
-         // Compute by brute force
-         vec2 values;
-         values.resize(nLat);
-         for(int i = 0; i < nLat; i++) {
-            values[i].resize(nLon, 0);
-         }
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
-            for(int j = 0; j < nLon; j++) {
-               // Put neighbourhood into vector
-               std::vector<float> neighbourhood;
-               int Ni = std::min(nLat-1, i+radius) - std::max(0, i-radius) + 1;
-               int Nj = std::min(nLon-1, j+radius) - std::max(0, j-radius) + 1;
-               assert(Ni > 0);
-               assert(Nj > 0);
-               neighbourhood.resize(Ni*Nj, Util::MV);
-               int index = 0;
-               for(int ii = std::max(0, i-radius); ii <= std::min(nLat-1, i+radius); ii++) {
-                  for(int jj = std::max(0, j-radius); jj <= std::min(nLon-1, j+radius); jj++) {
-                     float value = iInput(ii,jj,e);
-                     assert(index < Ni*Nj);
-                     neighbourhood[index] = value;
-                     index++;
-                  }
+                  iOutput(i,j,e) = values[i][j];
                }
-               assert(index == Ni*Nj);
-               values[i][j] = Util::calculateStat(neighbourhood, mStatType, mQuantile);
-               count_stat += neighbourhood.size();
-            }
-         }
-         #pragma omp parallel for
-         for(int i = 0; i < nLat; i++) {
-            for(int j = 0; j < nLon; j++) {
-               iOutput(i,j,e) = values[i][j];
             }
          }
       }
@@ -294,8 +896,11 @@ std::string CalibratorNeighbourhood::description(bool full) {
       ss << Util::formatDescription("   radius=3", "Use gridpoints within this number of points within in both east-west and north-south direction. The radius can alternatively be specified using a location-independent parameter file, with one parameter.") << std::endl;
       ss << Util::formatDescription("   stat=mean", "What statistical operator should be applied to the neighbourhood? One of 'mean', 'median', 'min', 'max', 'quantile', 'std', or 'sum'. 'std' is the population standard deviation.") << std::endl;
       ss << Util::formatDescription("   quantile=undef", "If stat=quantile is selected, what quantile (number on the interval [0,1]) should be used?") << std::endl;
-      ss << Util::formatDescription("   fast=1", "Use shortcuts to compute 'max', 'min', 'mean' or 'sum' faster.") << std::endl;
-      ss << Util::formatDescription("   approx=0", "Use approximations to compute 'median' or 'quantile' faster.") << std::endl;
+      ss << Util::formatDescription("   kernel=square", "Shape of the neighbourhood. 'square' uses all gridpoints within the radius in both directions. 'disc' uses gridpoints within a distance of radius gridpoints. 'gaussian' weights gridpoints by a gaussian function of the distance, truncated at the radius in both directions. 'weights' uses the weights in 'weights'. Kernels other than 'square' can only be used with stat=mean or stat=sum, and compute the weighted mean or weighted sum of the non-missing values. The cost of 'disc' and 'gaussian' grows linearly with the radius.") << std::endl;
+      ss << Util::formatDescription("   sigma=undef", "Standard deviation (in number of gridpoints) of the gaussian kernel. Defaults to radius/3.") << std::endl;
+      ss << Util::formatDescription("   weights=undef", "Weights for kernel=weights, as a comma-separated list with (2*radius+1)^2 values. The values are ordered row by row, starting with the offsets -radius in both the y and x directions. The radius is determined by the number of weights. Large kernels are applied using fast Fourier transforms.") << std::endl;
+      ss << Util::formatDescription("   fast=1", "Use shortcuts to compute 'max', 'min', 'mean', 'sum', 'std', 'median' or 'quantile' faster. The results are the same as without shortcuts, up to round-off errors. The cost of 'max', 'min', 'mean', 'sum' and 'std' does not depend on the radius, and the cost of 'median' and 'quantile' grows linearly with the radius.") << std::endl;
+      ss << Util::formatDescription("   approx=0", "Use approximations to compute 'median' or 'quantile' faster. Only used for ensemble members without missing values. Usually not needed, since fast=1 computes these exactly.") << std::endl;
    }
    else
       ss << Util::formatDescription("-c neighbourhood", "Applies a statistical operator on a neighbourhood") << std::endl;
@@ -23,5 +23,56 @@ class CalibratorNeighbourhood : public Calibrator {
       bool mFast;
       bool mApprox;
       int numMissingValues(const Field& iField, int iEnsIndex) const;
+      //! Compute the neighbourhood mean, sum, or standard deviation for one member, using
+      //! summed-area tables
+      //! @param iValues Work buffer for the table of accumulated values
+      //! @param iSquares Work buffer for the table of accumulated squared values (only used for std)
+      //! @param iCounts Work buffer for the table of accumulated number of valid values
+      //! @param iParallel Should the tables be computed with multiple threads?
+      void calcSummedArea(const Field& iInput, int iEnsIndex, int iRadius,
+            std::vector<double>& iValues, std::vector<double>& iSquares, std::vector<int>& iCounts, Field& iOutput, bool iParallel) const;
+      //! Compute the neighbourhood min or max for one member, using separable running minimums.
+      //! Missing values are ignored.
+      void calcRunningExtreme(const Field& iInput, int iEnsIndex, int iRadius, bool iMax, Field& iOutput) const;
+      //! Compute the exact neighbourhood quantile for one member, using a sliding window over the
+      //! ranks of the values. Missing values are ignored.
+      void calcRunningQuantile(const Field& iInput, int iEnsIndex, int iRadius, float iQuantile, Field& iOutput) const;
+      //! Find the rank of the iK'th smallest (starting at 0) value counted in a Fenwick tree
+      //! @param iTopBit Largest power of 2 not exceeding the number of ranks
+      static int findKthRank(const std::vector<int>& iTree, int iTopBit, int iK);
+      //! Compute the minimum of each window of +- iRadius values along a line, in constant time per
+      //! value. Windows are truncated at the ends of the line.
+      //! @param iWork Work buffer, resized as needed
+      static void calcRunningMin(const float* iInput, int iNum, int iRadius, float* iOutput, std::vector<float>& iWork);
+
+      //! Shape of the neighbourhood
+      enum KernelType {
+         KernelSquare = 0,   // All points within the radius in both directions, with equal weights
+         KernelDisc = 10,    // All points within the radius, with equal weights
+         KernelGaussian = 20,
+         KernelWeights = 30  // Weights specified by the user
+      };
+      KernelType mKernel;
+      float mSigma;
+      std::vector<float> mWeights;
+      //! Compute the weights of the kernel. The weight for offset (di, dj) is stored at index
+      //! (di + iRadius) * (2 * iRadius + 1) + dj + iRadius.
+      void getKernel(int iRadius, std::vector<double>& iWeights) const;
+      //! Compute the weighted neighbourhood mean or sum for one member, using a kernel other than
+      //! the square. Missing values are handled by normalized convolution.
+      void calcWeighted(const Field& iInput, int iEnsIndex, int iRadius, Field& iOutput) const;
+      //! Convolve an nLat * nLon array with a separable kernel, iKernel(di) * iKernel(dj)
+      static void convolveSeparable(const std::vector<double>& iInput, int nLat, int nLon, const std::vector<double>& iKernel, std::vector<double>& iOutput);
+      //! Convolve an nLat * nLon array with a disc of equal weights, using prefix sums along each row
+      static void convolveDisc(const std::vector<double>& iInput, int nLat, int nLon, int iRadius, std::vector<double>& iOutput);
+      //! Convolve an nLat * nLon array with a kernel by summing over the kernel for each point
+      static void convolveDirect(const std::vector<double>& iInput, int nLat, int nLon, int iRadius, const std::vector<double>& iKernel, std::vector<double>& iOutput);
+      //! Convolve two nLat * nLon arrays with a kernel using FFTs of overlapping tiles. The two
+      //! arrays are transformed together as the real and imaginary parts of one complex array.
+      static void convolveFft(const std::vector<double>& iInput1, const std::vector<double>& iInput2, int nLat, int nLon, int iRadius, const std::vector<double>& iKernel,
+            std::vector<double>& iOutput1, std::vector<double>& iOutput2);
+      //! Compute the 2D FFT of an iSize * iSize array in place
+      //! @param iWork Work buffer, resized as needed
+      static void fft2(std::vector<std::complex<double> >& iValues, int iSize, bool iInverse, std::vector<std::complex<double> >& iWork);
 };
 #endif
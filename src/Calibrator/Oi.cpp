@@ -3,7 +3,10 @@
 #include "../Parameters.h"
 #include "../File/File.h"
 #include "../Downscaler/Downscaler.h"
+#include "../KDTree.h"
+#include "../SparseMatrix.h"
 #include <math.h>
+#include <map>
 #include <armadillo>
 #include "Neighbourhood.h"
 
@@ -26,6 +29,10 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
       mSaveDiff(false),
       mDeltaVariable(""),
       mUseEns(true),
+      mBatch(false),
+      mTileSize(1),
+      mSinglePrecision(false),
+      mOutputRadius(3),
       // Add mDeltaVariable
       mX(Util::MV),
       mY(Util::MV),
@@ -44,8 +51,10 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
       mLandOnly(false),
       mTransformType(TransformTypeNone),
       mDiaFile(""),
+      mLooFile(""),
       mGamma(0.25),
       mRhoType(RhoTypeGaussian),
+      mLocalizationType(LocalizationTypeBox),
       mBoxCoxThreshold(Util::MV) {
    iOptions.getValue("biasVariable", mBiasVariable);
    iOptions.getValue("d", mHLength);
@@ -70,6 +79,26 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
    iOptions.getValue("numVariable", mNumVariable);
    iOptions.getValue("elevGradient", mElevGradient);
    iOptions.getValue("useEns", mUseEns);
+   iOptions.getValue("batch", mBatch);
+   iOptions.getValue("tileSize", mTileSize);
+   std::string precision;
+   if(iOptions.getValue("precision", precision)) {
+      if(precision == "double")
+         mSinglePrecision = false;
+      else if(precision == "float")
+         mSinglePrecision = true;
+      else {
+         std::stringstream ss;
+         ss << "Could not recognize precision=" << precision << std::endl;
+         Util::error(ss.str());
+      }
+   }
+   if(!iOptions.getValues("sigmaRadii", mSigmaRadii)) {
+      mSigmaRadii.push_back(25);
+      mSigmaRadii.push_back(5);
+      mSigmaRadii.push_back(3);
+   }
+   iOptions.getValue("outputRadius", mOutputRadius);
    iOptions.getValue("wmin", mWMin);
    iOptions.getValue("epsilon", mEpsilon);
    if(iOptions.getValue("epsilonC", mEpsilonC))
@@ -79,6 +108,7 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
    iOptions.getValue("crossValidate", mCrossValidate);
    iOptions.getValue("landOnly", mLandOnly);
    iOptions.getValue("diaFile", mDiaFile);
+   iOptions.getValue("looFile", mLooFile);
    iOptions.getValue("diagnose", mDiagnose);
    iOptions.getValue("newDeltaVar", mNewDeltaVar);
    iOptions.getValue("boxCoxThreshold", mBoxCoxThreshold);
@@ -105,6 +135,32 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
          Util::error(ss.str());
       }
    }
+   std::string localization;
+   if(iOptions.getValue("localization", localization)) {
+      if(localization == "box")
+         mLocalizationType = LocalizationTypeBox;
+      else if(localization == "radius")
+         mLocalizationType = LocalizationTypeRadius;
+      else {
+         std::stringstream ss;
+         ss << "Could not recognize localization=" << localization << std::endl;
+         Util::error(ss.str());
+      }
+   }
+   if(!Util::isValid(mTileSize) || mTileSize < 1) {
+      Util::error("CalibratorOi: 'tileSize' must be >= 1");
+   }
+   if(mTileSize > 1 && mCrossValidate) {
+      Util::error("CalibratorOi: 'tileSize' > 1 cannot be used with cross-validation");
+   }
+   for(int i = 0; i < mSigmaRadii.size(); i++) {
+      if(!Util::isValid(mSigmaRadii[i]) || mSigmaRadii[i] < 0) {
+         Util::error("CalibratorOi: 'sigmaRadii' must be >= 0");
+      }
+   }
+   if(!Util::isValid(mOutputRadius) || mOutputRadius < 0) {
+      Util::error("CalibratorOi: 'outputRadius' must be >= 0");
+   }
 
    iOptions.check();
 
@@ -113,14 +169,95 @@ CalibratorOi::CalibratorOi(Variable iVariable, const Options& iOptions):
 
 // Set up convenient functions for debugging in gdb
 template<class Matrix>
-void print_matrix(Matrix matrix) {
-       matrix.print(std::cout);
+void print_matrix(Matrix matrix, std::ostream& iStream=std::cout) {
+       matrix.print(iStream);
+}
+
+template void print_matrix<CalibratorOi::mattype>(CalibratorOi::mattype matrix, std::ostream& iStream);
+template void print_matrix<CalibratorOi::cxtype>(CalibratorOi::cxtype matrix, std::ostream& iStream);
+
+//! Collects the diagnostic output from one tile of the analysis, so that it can be written after
+//! the parallel loop. Threads then never write to the output at the same time, and the output
+//! comes in the same order regardless of the number of threads.
+class OiTileLog {
+   public:
+      //! Stream for text that is written to standard output as is
+      std::ostream& out() {
+         return mOut;
+      };
+      void info(const std::string& iMessage) {
+         add(TypeInfo, iMessage);
+      };
+      void warning(const std::string& iMessage) {
+         add(TypeWarning, iMessage);
+      };
+      //! Move the collected messages to iMessages, leaving this log empty
+      void release(std::vector<std::pair<int, std::string> >& iMessages) {
+         add(TypeOut, "");
+         iMessages.swap(mMessages);
+         mMessages.clear();
+      };
+      //! Write messages collected by release
+      static void write(const std::vector<std::pair<int, std::string> >& iMessages) {
+         for(int i = 0; i < iMessages.size(); i++) {
+            if(iMessages[i].first == TypeInfo)
+               Util::info(iMessages[i].second);
+            else if(iMessages[i].first == TypeWarning)
+               Util::warning(iMessages[i].second);
+            else
+               std::cout << iMessages[i].second;
+         }
+      };
+   private:
+      enum Type {TypeOut, TypeInfo, TypeWarning};
+      void add(Type iType, const std::string& iMessage) {
+         // Keep text written to out() in order with the other messages
+         if(mOut.str() != "") {
+            mMessages.push_back(std::pair<int, std::string>(TypeOut, mOut.str()));
+            mOut.str("");
+         }
+         if(iMessage != "")
+            mMessages.push_back(std::pair<int, std::string>(iType, iMessage));
+      };
+      std::stringstream mOut;
+      std::vector<std::pair<int, std::string> > mMessages;
+};
+
+//! The stations used by each gridpoint in one tile and their rhos, stored in compressed sparse row
+//! form: the stations of gridpoint p are mIndices[mOffsets[p]] to mIndices[mOffsets[p+1]-1].
+struct OiTileStations {
+   std::vector<int> mOffsets;
+   std::vector<int> mIndices;
+   std::vector<float> mRhos;
+};
+
+CalibratorOi::mattype CalibratorOi::cholSolve(const mattype& iU, const mattype& iB) {
+   mattype Z = arma::solve(arma::trimatl(iU.t()), iB);
+   return arma::solve(arma::trimatu(iU), Z);
 }
 
-template void print_matrix<CalibratorOi::mattype>(CalibratorOi::mattype matrix);
-template void print_matrix<CalibratorOi::cxtype>(CalibratorOi::cxtype matrix);
+arma::fmat CalibratorOi::cholSolve(const mattype& iU, const arma::fmat& iB) {
+   return arma::conv_to<arma::fmat>::from(cholSolve(iU, arma::conv_to<mattype>::from(iB)));
+}
+
+bool CalibratorOi::cholFactor(mattype& iU, const mattype& iA) {
+   return arma::chol(iU, iA);
+}
+
+bool CalibratorOi::cholFactor(mattype& iU, const arma::fmat& iA) {
+   return arma::chol(iU, arma::conv_to<mattype>::from(iA));
+}
 
 bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFile) const {
+   if(mSinglePrecision)
+      return calibrateCoreT<float>(iFile, iParameterFile);
+   else
+      return calibrateCoreT<double>(iFile, iParameterFile);
+}
+
+template<class T> bool CalibratorOi::calibrateCoreT(File& iFile, const ParameterFile* iParameterFile) const {
+   typedef arma::Mat<T> mattype;
+   typedef arma::Col<T> vectype;
    int nY = iFile.getNumY();
    int nX = iFile.getNumX();
    int nEns = iFile.getNumEns();
@@ -128,11 +265,17 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
 
    // Single-member SOAR variables
    float sigmaThreshold = 0.001;
+   // The smoothers use the summed-area tables of the neighbourhood mean, so that the cost does not
+   // depend on the radius. Missing values are left out of the means.
    std::vector<CalibratorNeighbourhood> smoothers;
-   smoothers.push_back(CalibratorNeighbourhood(Variable(), Options("radius=25 stat=mean fast=0")));
-   smoothers.push_back(CalibratorNeighbourhood(Variable(), Options("radius=5 stat=mean fast=0")));
-   smoothers.push_back(CalibratorNeighbourhood(Variable(), Options("radius=3 stat=mean fast=0")));
-   CalibratorNeighbourhood outputSmoother = CalibratorNeighbourhood(Variable(), Options("radius=3 stat=mean fast=0"));
+   for(int r = 0; r < mSigmaRadii.size(); r++) {
+      std::stringstream ss;
+      ss << "radius=" << mSigmaRadii[r] << " stat=mean fast=1";
+      smoothers.push_back(CalibratorNeighbourhood(Variable(), Options(ss.str())));
+   }
+   std::stringstream outputOptions;
+   outputOptions << "radius=" << mOutputRadius << " stat=mean fast=1";
+   CalibratorNeighbourhood outputSmoother = CalibratorNeighbourhood(Variable(), Options(outputOptions.str()));
 
    vec2 lats = iFile.getLats();
    vec2 lons = iFile.getLons();
@@ -185,12 +328,29 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
      diaFile.open(mDiaFile.c_str());
    }
 
+   // Leave-one-out cross-validation results
+   std::ofstream looFile;
+   if(mLooFile != "") {
+      looFile.open(mLooFile.c_str());
+      if(!looFile.good()) {
+         std::stringstream ss;
+         ss << "CalibratorOi: Could not open looFile '" << mLooFile << "'";
+         Util::error(ss.str());
+      }
+      looFile << "time member lat lon elev obs background analysis residual" << std::endl;
+   }
+
    // Loop over each observation, find the nearest gridpoint and place the obs into all gridpoints
    // in the vicinity of the nearest neighbour. This is only meant to be an approximation, but saves
    // considerable time instead of doing a loop over each grid point and each observation.
+   // With localization=radius, the valid observations are instead put in a search tree, which
+   // is queried for each gridpoint.
+   bool useRadius = mLocalizationType == LocalizationTypeRadius;
 
    // Store the indicies (into the gLocations array) that a gridpoint has available
    std::vector<std::vector<std::vector<int> > > gLocIndices; // Y, X, obs indices
+   // Indices (into the gLocations array) of the observations that pass the checks
+   std::vector<int> gValidIndices;
    std::vector<float> gYi(gS, Util::MV);
    std::vector<float> gXi(gS, Util::MV);
    std::vector<float> gLafs(gS, Util::MV);
@@ -198,9 +358,11 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
    std::vector<float> gCi(gS, 1);
    std::vector<float> gRadarL(gS, 0);
    std::vector<float> gObs(gS, Util::MV);
-   gLocIndices.resize(nY);
-   for(int y = 0; y < nY; y++) {
-      gLocIndices[y].resize(nX);
+   if(!useRadius) {
+      gLocIndices.resize(nY);
+      for(int y = 0; y < nY; y++) {
+         gLocIndices[y].resize(nX);
+      }
    }
 
    // Calculate the factor that the horizontal decorrelation scale should be multiplied by
@@ -211,7 +373,7 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
 
    // Check that we do not run out of memory
    int gridpointRadius = Util::MV;
-   if(isRegularGrid) {
+   if(isRegularGrid && !useRadius) {
       gridpointRadius = radiusFactor * mHLength / gridSize;
 
       // When large radiuses are used, the process becomes memory-intensive. Try to fail here
@@ -268,7 +430,11 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
                // Don't include an observation if it is in the ocean and landOnly=1
                bool wrongLaf = Util::isValid(gLafs[i]) && mLandOnly && gLafs[i] == 0;
                if(!wrongLaf) {
-                  if(isRegularGrid) {
+                  gValidIndices.push_back(i);
+                  if(useRadius) {
+                     // Handled by the search tree below
+                  }
+                  else if(isRegularGrid) {
                      for(int y = std::max(0, Y - gridpointRadius); y < std::min(nY, Y + gridpointRadius); y++) {
                         for(int x = std::max(0, X - gridpointRadius); x < std::min(nX, X + gridpointRadius); x++) {
                            gLocIndices[y][x].push_back(i);
@@ -311,10 +477,38 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
          Util::warning(ss.str());
       }
    }
+   // Search tree of the valid observations. Their indices into gValidIndices are the J-indices
+   KDTree obsTree(KDTree::TypeCartesian);
+   if(gValidIndices.size() > 0) {
+      vec2 obsLats(1);
+      vec2 obsLons(1);
+      obsLats[0].resize(gValidIndices.size());
+      obsLons[0].resize(gValidIndices.size());
+      for(int i = 0; i < gValidIndices.size(); i++) {
+         obsLats[0][i] = gLocations[gValidIndices[i]].lat();
+         obsLons[0][i] = gLocations[gValidIndices[i]].lon();
+      }
+      obsTree.build(obsLats, obsLons);
+   }
+   Stations gStations;
+   setStations(gLocations, gLafs, gStations);
    double time_e = Util::clock();
    std::cout << "Assigning locations " << time_e - time_s << std::endl;
 
 
+   // Station to station correlations for single-member mode, with and without the land area
+   // fraction term. Computed when first needed.
+   SparseMatrix stationRhos;
+   SparseMatrix stationRhosLaf;
+   bool hasStationRhos = false;
+
+   // The stations used by each gridpoint, and their rhos, stored by tile. These only depend on the
+   // grid and the observations, so with several timesteps they are computed in the first timestep
+   // and reused for later ones. The second set is for single-member mode, which can use different
+   // tiles.
+   bool cacheLocations = nTime > 1;
+   std::vector<OiTileStations> cachedStations[2];
+
    // Loop over offsets
    for(int t = 0; t < nTime; t++) {
       FieldPtr field = iFile.getField(mVariable, t);
@@ -439,568 +633,852 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
       // Temporary field for single-member mode when using a transform
       FieldPtr sigmaTransformed = iFile.getEmptyField(0);
 
-      #pragma omp parallel for
-      for(int x = 0; x < nX; x++) {
-         for(int y = 0; y < nY; y++) {
-            float lat = lats[y][x];
-            float lon = lons[y][x];
-            float elev = elevs[y][x];
-            float laf = lafs[y][x];
-
-            //
-            // Create list of locations for this gridpoint
-            //
-            std::vector<int> lLocIndices0 = gLocIndices[y][x];
-            std::vector<int> lLocIndices;
-            lLocIndices.reserve(lLocIndices0.size());
+      if(singleMemberMode && !hasStationRhos) {
+         // Two stations can only be used together if they are both within the localization
+         // radius of a gridpoint
+         double time_s = Util::clock();
+         calcStationRhos(gLocations, gStations, gValidIndices, obsTree, 2 * radiusFactor * mHLength, stationRhos, stationRhosLaf);
+         hasStationRhos = true;
+         std::stringstream ss;
+         ss << "Computed " << stationRhos.getNumNonZeros() << " station to station correlations in " << Util::clock() - time_s << " s";
+         Util::info(ss.str());
+      }
+
+      // Leave-one-out cross-validation: the analysis at each station, with that station withheld.
+      // The station uses its neighbours in the same way as a gridpoint at its location. With the
+      // station placed last in the covariance matrix S = U' * U of the station and its neighbours,
+      // the closed-form update obs - analysis = (S^-1 d)_k / (S^-1)_kk, where d are the innovations,
+      // only needs the one factorization, since (S^-1)_kk = 1 / U_kk^2.
+      if(mLooFile != "" && !singleMemberMode) {
+         Util::warning("CalibratorOi: Leave-one-out cross-validation is only done in single-member mode");
+      }
+      else if(mLooFile != "") {
+         int nValidS = gValidIndices.size();
+         vec2 looBackground(nValidS);
+         vec2 looAnalysis(nValidS);
+         #pragma omp parallel for schedule(dynamic)
+         for(int q = 0; q < nValidS; q++) {
+            int k = gValidIndices[q];
+            looBackground[q].resize(nValidEns, Util::MV);
+            looAnalysis[q].resize(nValidEns, Util::MV);
+            if(!Util::isValid(gYhat[k]))
+               continue;
+            const Location& location = gLocations[k];
+            std::vector<int> I, J;
+            std::vector<float> dists;
+            obsTree.getWithinRadius(location.lat(), location.lon(), radiusFactor * mHLength, I, J, dists);
+            std::vector<int> lLocIndices0(J.size());
+            for(int i = 0; i < J.size(); i++)
+               lLocIndices0[i] = gValidIndices[J[i]];
+            std::sort(lLocIndices0.begin(), lLocIndices0.end());
+            float laf = gLafs[k];
+            std::vector<float> lRhosAll;
+            calcRhos(gStations, location.lat(), location.lon(), location.elev(), laf, lLocIndices0, lRhosAll);
             std::vector<std::pair<float,int> > lRhos0;
-            lRhos0.reserve(lLocIndices0.size());
             for(int i = 0; i < lLocIndices0.size(); i++) {
                int index = lLocIndices0[i];
-               float hdist = Util::getDistance(gLocations[index].lat(), gLocations[index].lon(), lat, lon, true);
-               float vdist = Util::MV;
-               if(Util::isValid(gLocations[index].elev() && Util::isValid(elev)))
-                  vdist = gLocations[index].elev() - elev;
-               float lafdist = 0;
-               if(Util::isValid(gLafs[index]) && Util::isValid(laf))
-                  lafdist = gLafs[index] - laf;
-               float rho = calcRho(hdist, vdist, lafdist, mRhoType);
                int X = gXi[index];
                int Y = gYi[index];
-               // Only include observations that are within the domain
-               if(!isRegularGrid || (X > 0 && X < lats[0].size()-1 && Y > 0 && Y < lats.size()-1)) {
-                  if(rho > mMinRho) {
-                     lRhos0.push_back(std::pair<float,int>(rho, i));
+               if(index != k && lRhosAll[i] > mMinRho && (!isRegularGrid || (X > 0 && X < nX-1 && Y > 0 && Y < nY-1)))
+                  lRhos0.push_back(std::pair<float,int>(lRhosAll[i], index));
+            }
+            if(lRhos0.size() > mMaxLocations) {
+               std::sort(lRhos0.begin(), lRhos0.end(), Util::sort_pair_first<float,int>());
+               lRhos0.erase(lRhos0.begin(), lRhos0.end() - mMaxLocations);
+            }
+            std::vector<int> lLocIndices(lRhos0.size());
+            for(int i = 0; i < lRhos0.size(); i++)
+               lLocIndices[i] = lRhos0[i].second;
+            lLocIndices.push_back(k);
+            int lS = lLocIndices.size();
+
+            bool lafValid = Util::isValid(laf);
+            float errorScale = mEpsilon * mEpsilon;
+            if(useBias)
+               errorScale *= 1 / (1 + mGamma);
+            mattype lSR(lS, lS);
+            for(int i = 0; i < lS; i++) {
+               int index = lLocIndices[i];
+               for(int j = 0; j < lS; j++) {
+                  int index_j = lLocIndices[j];
+                  float rho;
+                  if(!(lafValid ? stationRhosLaf : stationRhos).get(index, index_j, rho))
+                     rho = calcStationRho(gStations, gLocations[index], index, index_j, lafValid);
+                  lSR(i, j) = rho;
+               }
+               lSR(i, i) += errorScale * gCi[index];
+            }
+            arma::mat U;
+            if(!cholFactor(U, lSR))
+               continue;
+            mattype lInnov(lS, nValidEns);
+            for(int i = 0; i < lS; i++) {
+               int index = lLocIndices[i];
+               for(int e = 0; e < nValidEns; e++) {
+                  lInnov(i, e) = gObs[index] - (gY[index][validEns[e]] + gYhat[index]);
+               }
+            }
+            mattype Z = cholSolve(U, lInnov);
+            float Ukk = U(lS - 1, lS - 1);
+            for(int e = 0; e < nValidEns; e++) {
+               looBackground[q][e] = gY[k][validEns[e]] + gYhat[k];
+               looAnalysis[q][e] = gObs[k] - Z(lS - 1, e) * Ukk * Ukk;
+            }
+         }
+
+         float total = 0;
+         int count = 0;
+         for(int q = 0; q < nValidS; q++) {
+            int k = gValidIndices[q];
+            for(int e = 0; e < nValidEns; e++) {
+               if(!Util::isValid(looAnalysis[q][e]))
+                  continue;
+               float obs = invTransform(gObs[k]);
+               float analysis = invTransform(looAnalysis[q][e]);
+               looFile << t << " " << validEns[e] << " " << gLocations[k].lat() << " " << gLocations[k].lon()
+                  << " " << gLocations[k].elev() << " " << obs << " " << invTransform(looBackground[q][e])
+                  << " " << analysis << " " << obs - analysis << std::endl;
+               total += (obs - analysis) * (obs - analysis);
+               count++;
+            }
+         }
+         std::stringstream ss;
+         ss << "Leave-one-out cross-validation RMSE: " << (count > 0 ? sqrt(total / count) : Util::MV) << " (" << count << " values)";
+         Util::info(ss.str());
+      }
+
+      // Loop over tiles of gridpoints. The amount of work per gridpoint depends strongly on the
+      // number of nearby stations (none over the sea, many over dense networks), so the tiles are
+      // small and handed out to threads dynamically. Without tileSize, the tiles are only used for
+      // scheduling.
+      bool useTiles = singleMemberMode && mTileSize > 1;
+      bool useBatch = mBatch || useTiles;
+      int tileSizeX = 16;
+      int tileSizeY = 16;
+      if(useTiles) {
+         tileSizeX = mTileSize;
+         tileSizeY = mTileSize;
+      }
+      int nTilesX = (nX + tileSizeX - 1) / tileSizeX;
+      int nTilesY = (nY + tileSizeY - 1) / tileSizeY;
+      std::vector<std::vector<std::pair<int, std::string> > > tileMessages(nTilesX * nTilesY);
+      int cacheIndex = singleMemberMode ? 1 : 0;
+      bool hasCachedLocations = cachedStations[cacheIndex].size() > 0;
+      if(cacheLocations && !hasCachedLocations) {
+         cachedStations[cacheIndex].resize(nTilesX * nTilesY);
+      }
+      #pragma omp parallel for schedule(dynamic)
+      for(int tile = 0; tile < nTilesX * nTilesY; tile++) {
+         int tX0 = (tile / nTilesY) * tileSizeX;
+         int tY0 = (tile % nTilesY) * tileSizeY;
+         int tX1 = std::min(nX, tX0 + tileSizeX);
+         int tY1 = std::min(nY, tY0 + tileSizeY);
+         int tNumY = tY1 - tY0;
+         OiTileLog tLog;
+
+         // Single-member mode: Station covariances and their Cholesky factor, and the solution for
+         // each member, for the set of stations used by the last gridpoint in this tile
+         std::vector<int> batchLocIndices;
+         bool batchLafValid = false;
+         mattype batchP;
+         mattype batchR;
+         arma::mat batchU;
+         mattype batchZ;
+
+         // Local stations and their rhos for each gridpoint in the tile
+         int tNumPoints = (tX1 - tX0) * tNumY;
+         std::vector<std::vector<int> > tLocIndices(tNumPoints);
+         std::vector<vectype> tRhos(tNumPoints);
+         if(hasCachedLocations) {
+            const OiTileStations& tCached = cachedStations[cacheIndex][tile];
+            for(int p = 0; p < tNumPoints; p++) {
+               int start = tCached.mOffsets[p];
+               int end = tCached.mOffsets[p+1];
+               tLocIndices[p].assign(tCached.mIndices.begin() + start, tCached.mIndices.begin() + end);
+               tRhos[p] = vectype(end - start);
+               for(int i = start; i < end; i++)
+                  tRhos[p](i - start) = tCached.mRhos[i];
+            }
+         }
+         else {
+            for(int x = tX0; x < tX1; x++) {
+               for(int y = tY0; y < tY1; y++) {
+                  float lat = lats[y][x];
+                  float lon = lons[y][x];
+                  float elev = elevs[y][x];
+                  float laf = lafs[y][x];
+
+                  //
+                  // Create list of locations for this gridpoint
+                  //
+                  std::vector<int> lLocIndices0;
+                  if(useRadius) {
+                     std::vector<int> I, J;
+                     std::vector<float> dists;
+                     obsTree.getWithinRadius(lat, lon, radiusFactor * mHLength, I, J, dists);
+                     lLocIndices0.resize(J.size());
+                     for(int i = 0; i < J.size(); i++)
+                        lLocIndices0[i] = gValidIndices[J[i]];
+                     // Use the same order as localization=box
+                     std::sort(lLocIndices0.begin(), lLocIndices0.end());
+                  }
+                  else {
+                     lLocIndices0 = gLocIndices[y][x];
+                  }
+                  int p = (x - tX0) * tNumY + (y - tY0);
+                  std::vector<int>& lLocIndices = tLocIndices[p];
+                  lLocIndices.reserve(lLocIndices0.size());
+                  std::vector<std::pair<float,int> > lRhos0;
+                  lRhos0.reserve(lLocIndices0.size());
+                  std::vector<float> lRhosAll;
+                  calcRhos(gStations, lat, lon, elev, laf, lLocIndices0, lRhosAll);
+                  for(int i = 0; i < lLocIndices0.size(); i++) {
+                     int index = lLocIndices0[i];
+                     float rho = lRhosAll[i];
+                     int X = gXi[index];
+                     int Y = gYi[index];
+                     // Only include observations that are within the domain
+                     if(!isRegularGrid || (X > 0 && X < lats[0].size()-1 && Y > 0 && Y < lats.size()-1)) {
+                        if(rho > mMinRho) {
+                           lRhos0.push_back(std::pair<float,int>(rho, i));
+                        }
+                     }
+                  }
+
+                  // Don't include the best value if cross-validating
+                  if(mCrossValidate) {
+                     float maxRho = 0;
+                     float maxRhoIndex = Util::MV;
+                     for(int i = 0; i < lRhos0.size(); i++) {
+                        if(lRhos0[i].first > maxRho) {
+                           maxRho = lRhos0[i].first;
+                           maxRhoIndex = i;
+                        }
+                     }
+                     if(Util::isValid(maxRhoIndex)) {
+                        int ii = lRhos0[maxRhoIndex].second;
+                        int index = lLocIndices0[ii];
+                        float obsLat = gLocations[index].lat();
+                        float obsLon = gLocations[index].lon();
+                        lRhos0.erase(lRhos0.begin() + maxRhoIndex);
+                        std::stringstream ss;
+                        ss << "Omitting " << obsLat << "," << obsLon
+                           << " for forecast point " << lat << "," << lon << " due to cross-validation";
+                        tLog.info(ss.str());
+                     }
+                  }
+                  vectype& lRhos = tRhos[p];
+                  if(lRhos0.size() > mMaxLocations) {
+                     // If sorting is enabled and we have too many locations, then only keep the best ones based on rho.
+                     // Otherwise, just use the last locations added
+                     lRhos = vectype(mMaxLocations);
+                     std::sort(lRhos0.begin(), lRhos0.end(), Util::sort_pair_first<float,int>());
+                     for(int i = 0; i < mMaxLocations; i++) {
+                        // The best values start at the end of the array
+                        int index = lRhos0[lRhos0.size() - 1 - i].second;
+                        lLocIndices.push_back(lLocIndices0[index]);
+                        lRhos(i) = lRhos0[lRhos0.size() - 1 - i].first;
+                     }
+                  }
+                  else {
+                     lRhos = vectype(lRhos0.size());
+                     for(int i = 0; i < lRhos0.size(); i++) {
+                        int index = lRhos0[i].second;
+                        lLocIndices.push_back(lLocIndices0[index]);
+                        lRhos(i) = lRhos0[i].first;
+                     }
                   }
                }
             }
 
-            // Don't include the best value if cross-validating
-            if(mCrossValidate) {
-               float maxRho = 0;
-               float maxRhoIndex = Util::MV;
-               for(int i = 0; i < lRhos0.size(); i++) {
-                  if(lRhos0[i].first > maxRho) {
-                     maxRho = lRhos0[i].first;
-                     maxRhoIndex = i;
+            if(useTiles) {
+               // Use the same stations for all gridpoints in the tile: the union of the stations of
+               // each gridpoint, keeping the ones with the highest rho (for any gridpoint).
+               std::map<int,float> tMaxRhos;
+               for(int p = 0; p < tLocIndices.size(); p++) {
+                  for(int i = 0; i < tLocIndices[p].size(); i++) {
+                     int index = tLocIndices[p][i];
+                     std::map<int,float>::iterator it = tMaxRhos.find(index);
+                     if(it == tMaxRhos.end() || it->second < tRhos[p](i))
+                        tMaxRhos[index] = tRhos[p](i);
                   }
                }
-               if(Util::isValid(maxRhoIndex)) {
-                  int ii = lRhos0[maxRhoIndex].second;
-                  int index = lLocIndices0[ii];
-                  float obsLat = gLocations[index].lat();
-                  float obsLon = gLocations[index].lon();
-                  lRhos0.erase(lRhos0.begin() + maxRhoIndex);
-                  std::stringstream ss;
-                  ss << "Omitting " << obsLat << "," << obsLon
-                     << " for forecast point " << lat << "," << lon << " due to cross-validation";
-                  Util::info(ss.str());
+               std::vector<std::pair<float,int> > tRhos0;
+               tRhos0.reserve(tMaxRhos.size());
+               for(std::map<int,float>::const_iterator it = tMaxRhos.begin(); it != tMaxRhos.end(); it++) {
+                  tRhos0.push_back(std::pair<float,int>(it->second, it->first));
                }
-            }
-            arma::vec lRhos;
-            if(lRhos0.size() > mMaxLocations) {
-               // If sorting is enabled and we have too many locations, then only keep the best ones based on rho.
-               // Otherwise, just use the last locations added
-               lRhos = arma::vec(mMaxLocations);
-               std::sort(lRhos0.begin(), lRhos0.end(), Util::sort_pair_first<float,int>());
-               for(int i = 0; i < mMaxLocations; i++) {
-                  // The best values start at the end of the array
-                  int index = lRhos0[lRhos0.size() - 1 - i].second;
-                  lLocIndices.push_back(lLocIndices0[index]);
-                  lRhos(i) = lRhos0[lRhos0.size() - 1 - i].first;
+               if(tRhos0.size() > mMaxLocations) {
+                  std::sort(tRhos0.begin(), tRhos0.end(), Util::sort_pair_first<float,int>());
+                  tRhos0.erase(tRhos0.begin(), tRhos0.end() - mMaxLocations);
                }
-            }
-            else {
-               lRhos = arma::vec(lRhos0.size());
-               for(int i = 0; i < lRhos0.size(); i++) {
-                  int index = lRhos0[i].second;
-                  lLocIndices.push_back(lLocIndices0[index]);
-                  lRhos(i) = lRhos0[i].first;
+               std::vector<std::pair<int,float> > tOrder(tRhos0.size());
+               for(int i = 0; i < tRhos0.size(); i++)
+                  tOrder[i] = std::pair<int,float>(tRhos0[i].second, tRhos0[i].first);
+               std::sort(tOrder.begin(), tOrder.end());
+
+               // Gridpoints without any stations of their own are left without stations
+               for(int p = 0; p < tLocIndices.size(); p++) {
+                  if(tLocIndices[p].size() > 0) {
+                     tLocIndices[p].resize(tOrder.size());
+                     tRhos[p] = vectype(tOrder.size());
+                     for(int i = 0; i < tOrder.size(); i++) {
+                        tLocIndices[p][i] = tOrder[i].first;
+                        tRhos[p](i) = tOrder[i].second;
+                     }
+                  }
                }
             }
 
-            int lS = lLocIndices.size();
-            if(x == mX && y == mY) {
-               std::cout << "Number of local stations: " << lS << std::endl;
+            if(cacheLocations) {
+               OiTileStations& tCached = cachedStations[cacheIndex][tile];
+               tCached.mOffsets.resize(tNumPoints + 1);
+               tCached.mOffsets[0] = 0;
+               for(int p = 0; p < tNumPoints; p++)
+                  tCached.mOffsets[p+1] = tCached.mOffsets[p] + tLocIndices[p].size();
+               tCached.mIndices.resize(tCached.mOffsets[tNumPoints]);
+               tCached.mRhos.resize(tCached.mOffsets[tNumPoints]);
+               for(int p = 0; p < tNumPoints; p++) {
+                  for(int i = 0; i < tLocIndices[p].size(); i++) {
+                     tCached.mIndices[tCached.mOffsets[p] + i] = tLocIndices[p][i];
+                     tCached.mRhos[tCached.mOffsets[p] + i] = tRhos[p](i);
+                  }
+               }
             }
+         }
 
-            if(lS == 0) {
-               // If we have too few observations though, then use the background
-               for(int e = 0; e < nEns; e++) {
-                  if(mSaveDiff)
-                     (*output)(y, x, e) = Util::MV;
-                  else
-                     (*output)(y, x, e) = (*field)(y, x, e);
+         for(int x = tX0; x < tX1; x++) {
+            for(int y = tY0; y < tY1; y++) {
+               float lat = lats[y][x];
+               float lon = lons[y][x];
+               float elev = elevs[y][x];
+               float laf = lafs[y][x];
+               int p = (x - tX0) * tNumY + (y - tY0);
+               std::vector<int>& lLocIndices = tLocIndices[p];
+               vectype& lRhos = tRhos[p];
+
+               if(useBatch && singleMemberMode) {
+                  // Use a canonical ordering of the stations, so that gridpoints using the same set of
+                  // stations can share calculations
+                  std::vector<std::pair<int,float> > lOrder(lLocIndices.size());
+                  for(int i = 0; i < lLocIndices.size(); i++)
+                     lOrder[i] = std::pair<int,float>(lLocIndices[i], lRhos(i));
+                  std::sort(lOrder.begin(), lOrder.end());
+                  for(int i = 0; i < lOrder.size(); i++) {
+                     lLocIndices[i] = lOrder[i].first;
+                     lRhos(i) = lOrder[i].second;
+                  }
                }
-               continue;
-            }
 
-            vectype lObs(lS);
-            vectype lElevs(lS);
-            vectype lLafs(lS);
-            for(int i = 0; i < lLocIndices.size(); i++) {
-               int index = lLocIndices[i];
-               lObs[i] = gObs[index];
-               lElevs[i] = gElevs[index];
-               lLafs[i] = gLafs[index];
-            }
+               int lS = lLocIndices.size();
+               if(x == mX && y == mY) {
+                  tLog.out() << "Number of local stations: " << lS << std::endl;
+               }
 
-            // Compute Y (model at obs-locations)
-            mattype lY(lS, nValidEns);
-            vectype lYhat(lS);
+               if(lS == 0) {
+                  // If we have too few observations though, then use the background
+                  for(int e = 0; e < nEns; e++) {
+                     if(mSaveDiff)
+                        (*output)(y, x, e) = Util::MV;
+                     else
+                        (*output)(y, x, e) = (*field)(y, x, e);
+                  }
+                  continue;
+               }
 
-            for(int i = 0; i < lS; i++) {
-               // Use the nearest neighbour for this location
-               int index = lLocIndices[i];
-               for(int e = 0; e < nValidEns; e++) {
-                  int ei = validEns[e];
-                  lY(i, e) = gY[index][ei];
+               vectype lObs(lS);
+               vectype lElevs(lS);
+               vectype lLafs(lS);
+               for(int i = 0; i < lLocIndices.size(); i++) {
+                  int index = lLocIndices[i];
+                  lObs[i] = gObs[index];
+                  lElevs[i] = gElevs[index];
+                  lLafs[i] = gLafs[index];
                }
-               lYhat(i) = gYhat[index];
 
-            }
+               // Compute Y (model at obs-locations)
+               mattype lY(lS, nValidEns);
+               vectype lYhat(lS);
 
-            ////////////////////////////////////////////////////////////////////////////////////////
-            // Single-member mode:                                                                //
-            // Revert to static structure function when there is not enough ensemble information  //
-            ////////////////////////////////////////////////////////////////////////////////////////
-            if(singleMemberMode) {
-               // Current grid-point to station error covariance matrix
-               mattype lG(1, lS, arma::fill::zeros);
-               // Station to station error covariance matrix
-               mattype lP(lS, lS, arma::fill::zeros);
-               // Station variance
-               mattype lR(lS, lS, arma::fill::zeros);
                for(int i = 0; i < lS; i++) {
+                  // Use the nearest neighbour for this location
                   int index = lLocIndices[i];
-                  lR(i, i) = gCi[index];
-                  float hdist = Util::getDistance(gLocations[index].lat(), gLocations[index].lon(), lat, lon, true);
-                  float vdist = Util::MV;
-                  if(Util::isValid(gLocations[index].elev() && Util::isValid(elev)))
-                     vdist = gLocations[index].elev() - elev;
-                  float lafdist = 0;
-                  if(Util::isValid(gLafs[index]) && Util::isValid(laf))
-                     lafdist = gLafs[index] - laf;
-                  float rho = calcRho(hdist, vdist, lafdist, mRhoType);
-                  lG(0, i) = rho;
-                  for(int j = 0; j < lS; j++) {
-                     int index_j = lLocIndices[j];
-                     float hdist = Util::getDistance(gLocations[index].lat(), gLocations[index].lon(), gLocations[index_j].lat(), gLocations[index_j].lon(), true);
-                     float vdist = Util::MV;
-                     if(Util::isValid(gLocations[index].elev() && Util::isValid(gLocations[index_j].elev())))
-                        vdist = gLocations[index].elev() - gLocations[index_j].elev();
-                           float lafdist = 0;
-                     if(Util::isValid(gLafs[index]) && Util::isValid(laf))
-                        lafdist = gLafs[index] - gLafs[index_j];
-
-                     lP(i, j) = calcRho(hdist, vdist, lafdist, mRhoType);
+                  for(int e = 0; e < nValidEns; e++) {
+                     int ei = validEns[e];
+                     lY(i, e) = gY[index][ei];
                   }
-               }
-               mattype lGSR;  // Kalman gain
-               mattype lSRinv;
-               // TODO: This will be different for precipitation
-               if(useBias) {
-                  lSRinv = arma::inv(lP + 1 / (1 + mGamma) * mEpsilon * mEpsilon * lR);
-                  lGSR = lG * lSRinv;
-               }
-               else {
-                  lSRinv = arma::inv(lP + mEpsilon * mEpsilon * lR);
-                  lGSR = lG * lSRinv;
+                  lYhat(i) = gYhat[index];
+
                }
 
-               // This should loop over nValidEns. And use ei.
-               for(int e = 0; e < nValidEns; e++) {
-                  int ei = validEns[e];
-                  if (Util::isValid((*field)(y, x, ei))) {
-                     vectype currFcst = lY.col(e) + lYhat;
-                     vectype dx = lGSR * (lObs - currFcst);
-
-                     // Store sigma in transformed space
-                     (*output)(y, x, ei) = (*field)(y, x, ei) + dx[0];
-                     if(mTransformType != TransformTypeNone) {
-                        if( (*output)(y, x, ei)< -1.0 / mLambda) {
-                           (*output)(y, x, ei) = -1.0 / mLambda;
+               ////////////////////////////////////////////////////////////////////////////////////////
+               // Single-member mode:                                                                //
+               // Revert to static structure function when there is not enough ensemble information  //
+               ////////////////////////////////////////////////////////////////////////////////////////
+               if(singleMemberMode) {
+                  // Current grid-point to station error covariance matrix
+                  mattype lG(1, lS, arma::fill::zeros);
+                  std::vector<float> lGRhos;
+                  calcRhos(gStations, lat, lon, elev, laf, lLocIndices, lGRhos);
+                  for(int i = 0; i < lS; i++) {
+                     lG(0, i) = lGRhos[i];
+                  }
+
+                  // The station to station matrices only depend on the set of stations (and on whether
+                  // the gridpoint has a land area fraction), so with batch=1 these are reused from the
+                  // previous gridpoint when possible.
+                  bool lafValid = Util::isValid(laf);
+                  if(!useBatch || lafValid != batchLafValid || lLocIndices != batchLocIndices) {
+                     // Station to station error covariance matrix
+                     mattype lP(lS, lS, arma::fill::zeros);
+                     // Station variance
+                     mattype lR(lS, lS, arma::fill::zeros);
+                     for(int i = 0; i < lS; i++) {
+                        int index = lLocIndices[i];
+                        lR(i, i) = gCi[index];
+                        for(int j = 0; j < lS; j++) {
+                           int index_j = lLocIndices[j];
+                           float rho;
+                           if(!(lafValid ? stationRhosLaf : stationRhos).get(index, index_j, rho))
+                              rho = calcStationRho(gStations, gLocations[index], index, index_j, lafValid);
+                           lP(i, j) = rho;
                         }
-                        if( (*output)(y, x, ei) >= transform(mBoxCoxThreshold)) {
-                           vectype incrementAtObsPoints = lP * (lSRinv * (lObs - currFcst));
-                           float total = 0;
-                           float totalDiagR = 0;
-                           float lGSRG = 0;
-                           for(int s = 0; s < lS; s++) {
-                              total += (lObs[s] - currFcst[s]) * (lObs[s] - currFcst[s] - incrementAtObsPoints[s]);
-                              // CL old: totalDiagR += mEpsilon * mEpsilon * lR[s];
-                              totalDiagR += mEpsilon * mEpsilon * lR(s,s);
-                              lGSRG += lGSR[s] * lG[s];
-                           }
-                           float sigmaObs = total / lS;
-                           float meanDiagR = totalDiagR / lS;
-                           float sigmaB = sigmaObs / meanDiagR;
-                           (*sigmaTransformed)(y, x, ei) = std::max(sigmaThreshold,sigmaB * (1 - lGSRG));
-                           if(x == mX && y == mY) {
-                              std::cout << "sigmaObs: " << sigmaObs << std::endl;
-                              std::cout << "meanDiagR: " << meanDiagR << std::endl;
-                              std::cout << "sigmaB: " << sigmaB << std::endl;
-                              std::cout << "sigmaTransformed: " << (*sigmaTransformed)(y, x, ei) << std::endl;
-                           }
+                     }
+                     // TODO: This will be different for precipitation
+                     mattype lSR;
+                     if(useBias)
+                        lSR = lP + 1 / (1 + mGamma) * mEpsilon * mEpsilon * lR;
+                     else
+                        lSR = lP + mEpsilon * mEpsilon * lR;
+
+                     batchLocIndices.clear();
+                     if(!cholFactor(batchU, lSR)) {
+                        std::stringstream ss;
+                        ss << "Station covariance matrix is not positive definite. Using raw values";
+                        tLog.warning(ss.str());
+                        for(int e = 0; e < nEns; e++) {
+                           (*output)(y, x, e) = (*field)(y, x, e);
                         }
+                        continue;
                      }
-                     if(x == mX && y == mY) {
-                        std::cout << "Lat: " << lat << std::endl;
-                        std::cout << "Lon: " << lon << " " << lat << " " << std::endl;
-                        std::cout << "Elev: " << elev << std::endl;
-                        std::cout << "P:" << std::endl;
-                        print_matrix<mattype>(lP);
-                        std::cout << "R:" << std::endl;
-                        print_matrix<mattype>(lR);
-                        std::cout << "GSR:" << std::endl;
-                        print_matrix<mattype>(lGSR);
-                        std::cout << "Obs:" << std::endl;
-                        print_matrix<mattype>(lObs);
-                        std::cout << "Current forecast: " << std::endl;
-                        print_matrix<mattype>(currFcst);
-                        std::cout << "Increment" << std::endl;
-                        print_matrix<mattype>(lObs - currFcst);
-                        std::cout << "Yhat" << std::endl;
-                        print_matrix<mattype>(lYhat);
-                        std::cout << "dx: " << dx[0] << std::endl;
+
+                     // Solve for the innovations of all members at once
+                     mattype lInnov(lS, nValidEns);
+                     for(int i = 0; i < lS; i++) {
+                        for(int e = 0; e < nValidEns; e++) {
+                           lInnov(i, e) = lObs(i) - (lY(i, e) + lYhat(i));
+                        }
                      }
+                     batchZ = cholSolve(batchU, lInnov);
+                     batchP = lP;
+                     batchR = lR;
+                     batchLocIndices = lLocIndices;
+                     batchLafValid = lafValid;
                   }
-               }
+                  const mattype& lP = batchP;
+                  const mattype& lR = batchR;
 
-               // Update bias
-               if(useBias) {
-                  float biasTotal = 0;
-                  (*newbias)(y, x, 0) = (*bias)(y, x, 0) - mGamma / (1 + mGamma) * biasTotal;
-               }
-            }
-            ////////////////////////////////////////////////////////////////////////////////////////
-            // Ensemble-member mode:                                                              //
-            // Use ensemble covariance structure                                                  //
-            ////////////////////////////////////////////////////////////////////////////////////////
-            else {
-               // Compute Rinv
-               mattype Rinv(lS, lS, arma::fill::zeros);
-               if(numParameters == 2) {
-                  for(int i = 0; i < lS; i++) {
-                     int index = lLocIndices[i];
-                     Rinv(i, i) = lRhos[i] / (mSigma * mSigma * gCi[index]);
-                     if(x == mX && y == mY) {
-                        std::cout << "R(" << i << ") " << Rinv(i, i) << std::endl;
+                  // Kalman gain
+                  mattype lGSR = cholSolve(batchU, lG.t()).t();
+
+                  // This should loop over nValidEns. And use ei.
+                  for(int e = 0; e < nValidEns; e++) {
+                     int ei = validEns[e];
+                     if (Util::isValid((*field)(y, x, ei))) {
+                        vectype currFcst = lY.col(e) + lYhat;
+                        vectype dx = lG * batchZ.col(e);
+
+                        // Store sigma in transformed space
+                        (*output)(y, x, ei) = (*field)(y, x, ei) + dx[0];
+                        if(mTransformType != TransformTypeNone) {
+                           if( (*output)(y, x, ei)< -1.0 / mLambda) {
+                              (*output)(y, x, ei) = -1.0 / mLambda;
+                           }
+                           if( (*output)(y, x, ei) >= transform(mBoxCoxThreshold)) {
+                              vectype incrementAtObsPoints = lP * batchZ.col(e);
+                              float total = 0;
+                              float totalDiagR = 0;
+                              float lGSRG = 0;
+                              for(int s = 0; s < lS; s++) {
+                                 total += (lObs[s] - currFcst[s]) * (lObs[s] - currFcst[s] - incrementAtObsPoints[s]);
+                                 // CL old: totalDiagR += mEpsilon * mEpsilon * lR[s];
+                                 totalDiagR += mEpsilon * mEpsilon * lR(s,s);
+                                 lGSRG += lGSR[s] * lG[s];
+                              }
+                              float sigmaObs = total / lS;
+                              float meanDiagR = totalDiagR / lS;
+                              float sigmaB = sigmaObs / meanDiagR;
+                              (*sigmaTransformed)(y, x, ei) = std::max(sigmaThreshold,sigmaB * (1 - lGSRG));
+                              if(x == mX && y == mY) {
+                                 tLog.out() << "sigmaObs: " << sigmaObs << std::endl;
+                                 tLog.out() << "meanDiagR: " << meanDiagR << std::endl;
+                                 tLog.out() << "sigmaB: " << sigmaB << std::endl;
+                                 tLog.out() << "sigmaTransformed: " << (*sigmaTransformed)(y, x, ei) << std::endl;
+                              }
+                           }
+                        }
+                        if(x == mX && y == mY) {
+                           tLog.out() << "Lat: " << lat << std::endl;
+                           tLog.out() << "Lon: " << lon << " " << lat << " " << std::endl;
+                           tLog.out() << "Elev: " << elev << std::endl;
+                           tLog.out() << "P:" << std::endl;
+                           print_matrix<mattype>(lP, tLog.out());
+                           tLog.out() << "R:" << std::endl;
+                           print_matrix<mattype>(lR, tLog.out());
+                           tLog.out() << "GSR:" << std::endl;
+                           print_matrix<mattype>(lGSR, tLog.out());
+                           tLog.out() << "Obs:" << std::endl;
+                           print_matrix<mattype>(lObs, tLog.out());
+                           tLog.out() << "Current forecast: " << std::endl;
+                           print_matrix<mattype>(currFcst, tLog.out());
+                           tLog.out() << "Increment" << std::endl;
+                           print_matrix<mattype>(lObs - currFcst, tLog.out());
+                           tLog.out() << "Yhat" << std::endl;
+                           print_matrix<mattype>(lYhat, tLog.out());
+                           tLog.out() << "dx: " << dx[0] << std::endl;
+                        }
                      }
                   }
+
+                  // Update bias
+                  if(useBias) {
+                     float biasTotal = 0;
+                     (*newbias)(y, x, 0) = (*bias)(y, x, 0) - mGamma / (1 + mGamma) * biasTotal;
+                  }
                }
-               else if(numParameters == 3) {
-                  // Inverting the matrix is more complicated, since the radar observations
-                  // have covariances. Therefore invert the covariance matrix for the radar part and
-                  // insert the values into the big inverse matrix.
-                  // std::cout << "Computing R matrix" << std::endl;
-                  // R = get_precipitation_r(gRadarL, gCi, lLocIndices, lRhos);
-                  // Compute little R
-                  std::vector<int> gRadarIndices;
-                  gRadarIndices.reserve(lS);
-                  std::vector<int> lRadarIndices;
-                  lRadarIndices.reserve(lS);
-                  for(int i = 0; i < lS; i++) {
-                     int index = lLocIndices[i];
-                     if(gRadarL[index] > 0) {
-                        gRadarIndices.push_back(index);
-                        lRadarIndices.push_back(i);
+               ////////////////////////////////////////////////////////////////////////////////////////
+               // Ensemble-member mode:                                                              //
+               // Use ensemble covariance structure                                                  //
+               ////////////////////////////////////////////////////////////////////////////////////////
+               else {
+                  // Compute C matrix (C = Y' * Rinv)
+                  // k x gS * gS x gS
+                  // Rinv is diagonal, except for the block of radar observations
+                  mattype C(nValidEns, lS);
+                  if(numParameters == 2 || numParameters == 3) {
+                     for(int i = 0; i < lS; i++) {
+                        int index = lLocIndices[i];
+                        float Rinv = lRhos[i] / (mSigma * mSigma * gCi[index]);
+                        if(x == mX && y == mY) {
+                           tLog.out() << "R(" << i << ") " << Rinv << std::endl;
+                        }
+                        for(int e = 0; e < nValidEns; e++) {
+                           C(e, i) = lY(i, e) * Rinv;
+                        }
                      }
                   }
-                  int lNumRadar = gRadarIndices.size();
-
-                  // Compute R tilde r
-                  mattype radarR(lNumRadar, lNumRadar, arma::fill::zeros);
-                  for(int i = 0; i < lNumRadar; i++) {
-                     for(int j = 0; j < lNumRadar; j++) {
-                        int gIndex_i = gRadarIndices[i];
-                        int gIndex_j = gRadarIndices[j];
-                        int lIndex_i = lRadarIndices[i];
-                        int lIndex_j = lRadarIndices[j];
-                        if(i == j) {
-                           radarR(i, i) = 1;
+                  else {
+                     abort();
+                  }
+                  if(numParameters == 3) {
+                     // The radar observations have covariances. The radar block of Rinv is
+                     // D * inv(radarR) * D / sigmaC^2, where D = diag(sqrt(rho)). Instead of inverting
+                     // radarR, solve for the radar columns of C using its Cholesky factor.
+                     // tLog.out() << "Computing R matrix" << std::endl;
+                     // R = get_precipitation_r(gRadarL, gCi, lLocIndices, lRhos);
+                     // Compute little R
+                     std::vector<int> gRadarIndices;
+                     gRadarIndices.reserve(lS);
+                     std::vector<int> lRadarIndices;
+                     lRadarIndices.reserve(lS);
+                     for(int i = 0; i < lS; i++) {
+                        int index = lLocIndices[i];
+                        if(gRadarL[index] > 0) {
+                           gRadarIndices.push_back(index);
+                           lRadarIndices.push_back(i);
                         }
-                        else {
-                           // Equation 5
-                           float dist = Util::getDistance(gLocations[gIndex_i].lat(), gLocations[gIndex_i].lon(), gLocations[gIndex_j].lat(), gLocations[gIndex_j].lon(), true);
-                           float h = dist / mHLengthC;
-                           float rho = (1 + h) * exp(-h);
-                           radarR(i, j) = rho;
+                     }
+                     int lNumRadar = gRadarIndices.size();
+
+                     // Compute R tilde r
+                     mattype radarR(lNumRadar, lNumRadar, arma::fill::zeros);
+                     for(int i = 0; i < lNumRadar; i++) {
+                        for(int j = 0; j < lNumRadar; j++) {
+                           int gIndex_i = gRadarIndices[i];
+                           int gIndex_j = gRadarIndices[j];
+                           if(i == j) {
+                              radarR(i, i) = 1;
+                           }
+                           else {
+                              // Equation 5
+                              float dist = Util::getDistance(gLocations[gIndex_i].lat(), gLocations[gIndex_i].lon(), gLocations[gIndex_j].lat(), gLocations[gIndex_j].lon(), true);
+                              float h = dist / mHLengthC;
+                              float rho = (1 + h) * exp(-h);
+                              radarR(i, j) = rho;
+                           }
                         }
                      }
-                  }
-                  if(x == mX && y == mY) {
-                     std::cout << "Number of radar points: " << " " << lNumRadar << std::endl;
+                     if(x == mX && y == mY) {
+                        tLog.out() << "Number of radar points: " << " " << lNumRadar << std::endl;
+                        if(lNumRadar > 0) {
+                           print_matrix<mattype>(radarR, tLog.out());
+                        }
+                     }
+
                      if(lNumRadar > 0) {
-                        print_matrix<mattype>(radarR);
+                        arma::mat radarU;
+                        if(!cholFactor(radarU, radarR)) {
+                           std::stringstream ss;
+                           ss << "Radar covariance matrix is not positive definite. Using raw values";
+                           tLog.warning(ss.str());
+                           for(int e = 0; e < nEns; e++) {
+                              (*output)(y, x, e) = (*field)(y, x, e); // Util::MV;
+                           }
+                           continue;
+                        }
+
+                        mattype radarY(lNumRadar, nValidEns);
+                        for(int i = 0; i < lNumRadar; i++) {
+                           int ii = lRadarIndices[i];
+                           for(int e = 0; e < nValidEns; e++) {
+                              radarY(i, e) = sqrt(lRhos[ii]) * lY(ii, e);
+                           }
+                        }
+                        mattype radarZ = cholSolve(radarU, radarY);
+
+                        // Overwrite where we have radar pixels
+                        for(int i = 0; i < lNumRadar; i++) {
+                           int ii = lRadarIndices[i];
+                           for(int e = 0; e < nValidEns; e++) {
+                              C(e, ii) = sqrt(lRhos[ii]) / (mSigmaC * mSigmaC) * radarZ(i, e);
+                           }
+                        }
                      }
                   }
 
-                  float cond = arma::rcond(radarR);
-                  if(cond <= 0) {
+                  mattype Pinv(nValidEns, nValidEns);
+                  float currDelta = 1;
+                  if(useDelta)
+                     currDelta = (*delta)(y, x, 0);
+                  else
+                     currDelta = mDelta;
+                  float diag = 1 / currDelta * (nValidEns - 1);
+                  if(useBias)
+                     diag = 1 / currDelta / (1 + mGamma) * (nValidEns - 1);
+
+                  Pinv = C * lY + diag * arma::eye<mattype>(nValidEns, nValidEns);
+                  arma::mat PinvU;
+                  if(!cholFactor(PinvU, Pinv)) {
                      std::stringstream ss;
-                     ss << "Condition number of " << cond << " for radar values. Using raw values";
-                     Util::warning(ss.str());
+                     ss << "Pinv is not positive definite. Using raw values";
+                     tLog.warning(ss.str());
                      for(int e = 0; e < nEns; e++) {
                         (*output)(y, x, e) = (*field)(y, x, e); // Util::MV;
                      }
                      continue;
                   }
 
-                  mattype radarRinv(lNumRadar, lNumRadar, arma::fill::zeros); 
-                  radarRinv = arma::inv(radarR);
-
-                  for(int i = 0; i < lS; i++) {
-                     int index = lLocIndices[i];
-                     Rinv(i, i) = lRhos[i] / (mSigma * mSigma * gCi[index]);
-                  }
-                  // Overwrite where we have radar pixels
-                  for(int i = 0; i < lNumRadar; i++) {
-                     int ii = lRadarIndices[i];
-                     for(int j = 0; j < lNumRadar; j++) {
-                        int jj = lRadarIndices[j];
-                        Rinv(ii, jj) = sqrt(lRhos[ii] * lRhos[jj]) / (mSigmaC * mSigmaC) * radarRinv(i, j);
-                     }
+                  // Compute sqrt of matrix. Armadillo 6.6 has this function, but on many systems this
+                  // is not available. Therefore, compute sqrt using the method found in 6.6
+                  // cxtype Wcx(nValidEns, nValidEns);
+                  // status = arma::sqrtmat(Wcx, (nValidEns - 1) * P);
+                  // mattype W = arma::real(Wcx);
+
+                  // P = inv(Pinv) has the same eigenvectors as Pinv and inverse eigenvalues. Like the
+                  // factorizations, this is done in double precision.
+                  arma::vec eigval;
+                  arma::mat eigvec;
+                  bool status = arma::eig_sym(eigval, eigvec, arma::conv_to<arma::mat>::from(Pinv));
+                  if(!status) {
+                     tLog.out() << "Cannot find eigenvector:" << std::endl;
+                     tLog.out() << "Lat: " << lat << std::endl;
+                     tLog.out() << "Lon: " << lon << std::endl;
+                     tLog.out() << "Elev: " << elev << std::endl;
+                     tLog.out() << "Laf: " << laf << std::endl;
+                     tLog.out() << "Pinv" << std::endl;
+                     print_matrix<mattype>(Pinv, tLog.out());
+                     tLog.out() << "Y:" << std::endl;
+                     print_matrix<mattype>(lY, tLog.out());
+                     tLog.out() << "lObs:" << std::endl;
+                     print_matrix<mattype>(lObs, tLog.out());
+                     tLog.out() << "Yhat" << std::endl;
+                     print_matrix<mattype>(lYhat, tLog.out());
                   }
-               }
-               else {
-                  abort();
-               }
-
-               // Compute C matrix
-               // k x gS * gS x gS
-               mattype C(nValidEns, lS);
-               C = lY.t() * Rinv;
-
-               mattype Pinv(nValidEns, nValidEns);
-               float currDelta = 1;
-               if(useDelta)
-                  currDelta = (*delta)(y, x, 0);
-               else
-                  currDelta = mDelta;
-               float diag = 1 / currDelta * (nValidEns - 1);
-               if(useBias)
-                  diag = 1 / currDelta / (1 + mGamma) * (nValidEns - 1);
-
-               Pinv = C * lY + diag * arma::eye<mattype>(nValidEns, nValidEns);
-               float cond = arma::rcond(Pinv);
-               if(cond <= 0) {
-                  std::stringstream ss;
-                  ss << "Condition number of " << cond << ". Using raw values";
-                  Util::warning(ss.str());
-                  for(int e = 0; e < nEns; e++) {
-                     (*output)(y, x, e) = (*field)(y, x, e); // Util::MV;
+                  for(int e = 0; e < eigval.n_elem; e++) {
+                     eigval(e) = sqrt((nValidEns - 1) / eigval(e));
                   }
-                  continue;
-               }
+                  mattype W = arma::conv_to<mattype>::from(eigvec * arma::diagmat(eigval) * eigvec.t());
 
-               // Compute sqrt of matrix. Armadillo 6.6 has this function, but on many systems this
-               // is not available. Therefore, compute sqrt using the method found in 6.6
-               // cxtype Wcx(nValidEns, nValidEns);
-               // status = arma::sqrtmat(Wcx, (nValidEns - 1) * P);
-               // mattype W = arma::real(Wcx);
-
-               mattype P = arma::inv(Pinv);
-               vectype eigval;
-               mattype eigvec;
-               bool status = arma::eig_sym(eigval, eigvec, (nValidEns - 1) * P);
-               if(!status) {
-                  std::cout << "Cannot find eigenvector:" << std::endl;
-                  std::cout << "Lat: " << lat << std::endl;
-                  std::cout << "Lon: " << lon << std::endl;
-                  std::cout << "Elev: " << elev << std::endl;
-                  std::cout << "Laf: " << laf << std::endl;
-                  std::cout << "Pinv" << std::endl;
-                  print_matrix<mattype>(Pinv);
-                  std::cout << "P" << std::endl;
-                  print_matrix<mattype>(P);
-                  std::cout << "Y:" << std::endl;
-                  print_matrix<mattype>(lY);
-                  std::cout << "lObs:" << std::endl;
-                  print_matrix<mattype>(lObs);
-                  std::cout << "Yhat" << std::endl;
-                  print_matrix<mattype>(lYhat);
-               }
-               eigval = sqrt(eigval);
-               mattype Wcx = eigvec * arma::diagmat(eigval) * eigvec.t();
-               mattype W = arma::real(Wcx);
-
-               if(W.n_rows == 0) {
-                  std::stringstream ss;
-                  ss << "Could not find the real part of W. Using raw values.";
-                  Util::warning(ss.str());
-                  for(int e = 0; e < nEns; e++) {
-                     (*output)(y, x, e) = (*field)(y, x, e);
+                  if(W.n_rows == 0) {
+                     std::stringstream ss;
+                     ss << "Could not find the real part of W. Using raw values.";
+                     tLog.warning(ss.str());
+                     for(int e = 0; e < nEns; e++) {
+                        (*output)(y, x, e) = (*field)(y, x, e);
+                     }
+                     continue;
                   }
-                  continue;
-               }
 
-               // Compute PC
-               mattype PC(nValidEns, lS);
-               PC = P * C;
+                  // Compute PC
+                  mattype PC(nValidEns, lS);
+                  PC = cholSolve(PinvU, C);
 
-               // Compute w
-               vectype w(nValidEns);
-               if(mDiagnose)
-                  w = PC * (arma::ones<vectype>(lS));
-               else
-                  w = PC * (lObs - lYhat);
+                  // Compute w
+                  vectype w(nValidEns);
+                  if(mDiagnose)
+                     w = PC * (arma::ones<vectype>(lS));
+                  else
+                     w = PC * (lObs - lYhat);
 
-               // Add w to W
-               for(int e = 0; e < nValidEns; e++) {
-                  for(int e2 = 0; e2 < nValidEns; e2 ++) {
-                     W(e, e2) = W(e, e2) + w(e) ;
+                  // Add w to W
+                  for(int e = 0; e < nValidEns; e++) {
+                     for(int e2 = 0; e2 < nValidEns; e2 ++) {
+                        W(e, e2) = W(e, e2) + w(e) ;
+                     }
                   }
-               }
 
-               // Compute X (perturbations about model mean)
-               vectype X(nValidEns);
-               float total = 0;
-               int count = 0;
-               for(int e = 0; e < nValidEns; e++) {
-                  int ei = validEns[e];
-                  float value = (*field)(y, x, ei);
-                  if(Util::isValid(value)) {
-                     X(e) = value;
-                     total += value;
-                     count++;
+                  // Compute X (perturbations about model mean)
+                  vectype X(nValidEns);
+                  float total = 0;
+                  int count = 0;
+                  for(int e = 0; e < nValidEns; e++) {
+                     int ei = validEns[e];
+                     float value = (*field)(y, x, ei);
+                     if(Util::isValid(value)) {
+                        X(e) = value;
+                        total += value;
+                        count++;
+                     }
+                     else {
+                        tLog.out() << "Invalid value " << y << " " << x << " " << e << std::endl;
+                     }
                   }
-                  else {
-                     std::cout << "Invalid value " << y << " " << x << " " << e << std::endl;
+                  float ensMean = total / count;
+                  for(int e = 0; e < nValidEns; e++) {
+                     X(e) -= ensMean;
                   }
-               }
-               float ensMean = total / count;
-               for(int e = 0; e < nValidEns; e++) {
-                  X(e) -= ensMean;
-               }
-
-               // Write debugging information
-               if(x == mX && y == mY) {
-                  std::cout << "Lat: " << lat << std::endl;
-                  std::cout << "Lon: " << lon << " " << lat << " " << std::endl;
-                  std::cout << "Elev: " << elev << std::endl;
-                  std::cout << "Laf: " << laf << std::endl;
-                  std::cout << "Num obs: " << lS << std::endl;
-                  std::cout << "Num ens: " << nValidEns << std::endl;
-                  std::cout << "rhos" << std::endl;
-                  print_matrix<mattype>(lRhos);
-                  std::cout << "P" << std::endl;
-                  print_matrix<mattype>(P);
-                  std::cout << "C" << std::endl;
-                  print_matrix<mattype>(C);
-                  std::cout << "C * lY" << std::endl;
-                  print_matrix<mattype>(C * lY);
-                  std::cout << "PC" << std::endl;
-                  print_matrix<mattype>(PC);
-                  std::cout << "W" << std::endl;
-                  print_matrix<mattype>(W);
-                  std::cout << "w" << std::endl;
-                  print_matrix<mattype>(w);
-                  std::cout << "Y:" << std::endl;
-                  print_matrix<mattype>(lY);
-                  std::cout << "Yhat" << std::endl;
-                  print_matrix<mattype>(lYhat);
-                  std::cout << "lObs" << std::endl;
-                  print_matrix<mattype>(lObs);
-                  std::cout << "lObs - Yhat" << std::endl;
-                  print_matrix<mattype>(lObs - lYhat);
-                  std::cout << "X" << std::endl;
-                  print_matrix<mattype>(X);
-                  std::cout << "elevs" << std::endl;
-                  print_matrix<mattype>(lElevs);
-                  std::cout << "lafs" << std::endl;
-                  print_matrix<mattype>(lLafs);
-                  std::cout << "Analysis increment:" << std::endl;
-                  print_matrix<mattype>(X.t() * W);
-                  std::cout << "My: " << arma::mean(arma::dot(lObs - lYhat, lRhos) / lS) << std::endl;
-               }
 
-               // Compute analysis
-               for(int e = 0; e < nValidEns; e++) {
-                  int ei = validEns[e];
-                  float total = 0;
-                  for(int k = 0; k < nValidEns; k++) {
-                     total += X(k) * W(k, e);
+                  // Write debugging information
+                  if(x == mX && y == mY) {
+                     tLog.out() << "Lat: " << lat << std::endl;
+                     tLog.out() << "Lon: " << lon << " " << lat << " " << std::endl;
+                     tLog.out() << "Elev: " << elev << std::endl;
+                     tLog.out() << "Laf: " << laf << std::endl;
+                     tLog.out() << "Num obs: " << lS << std::endl;
+                     tLog.out() << "Num ens: " << nValidEns << std::endl;
+                     tLog.out() << "rhos" << std::endl;
+                     print_matrix<mattype>(lRhos, tLog.out());
+                     tLog.out() << "P" << std::endl;
+                     print_matrix<mattype>(cholSolve(PinvU, arma::eye<mattype>(nValidEns, nValidEns)), tLog.out());
+                     tLog.out() << "C" << std::endl;
+                     print_matrix<mattype>(C, tLog.out());
+                     tLog.out() << "C * lY" << std::endl;
+                     print_matrix<mattype>(C * lY, tLog.out());
+                     tLog.out() << "PC" << std::endl;
+                     print_matrix<mattype>(PC, tLog.out());
+                     tLog.out() << "W" << std::endl;
+                     print_matrix<mattype>(W, tLog.out());
+                     tLog.out() << "w" << std::endl;
+                     print_matrix<mattype>(w, tLog.out());
+                     tLog.out() << "Y:" << std::endl;
+                     print_matrix<mattype>(lY, tLog.out());
+                     tLog.out() << "Yhat" << std::endl;
+                     print_matrix<mattype>(lYhat, tLog.out());
+                     tLog.out() << "lObs" << std::endl;
+                     print_matrix<mattype>(lObs, tLog.out());
+                     tLog.out() << "lObs - Yhat" << std::endl;
+                     print_matrix<mattype>(lObs - lYhat, tLog.out());
+                     tLog.out() << "X" << std::endl;
+                     print_matrix<mattype>(X, tLog.out());
+                     tLog.out() << "elevs" << std::endl;
+                     print_matrix<mattype>(lElevs, tLog.out());
+                     tLog.out() << "lafs" << std::endl;
+                     print_matrix<mattype>(lLafs, tLog.out());
+                     tLog.out() << "Analysis increment:" << std::endl;
+                     print_matrix<mattype>(X.t() * W, tLog.out());
+                     tLog.out() << "My: " << arma::mean(arma::dot(lObs - lYhat, lRhos) / lS) << std::endl;
                   }
 
-                  float currIncrement = total;
-
-                  if(mSaveDiff)
-                     (*output)(y, x, ei) = currIncrement;
-                  else {
-                     float raw = ensMean;
-                     if(useBias) {
-                        raw -= (*bias)(y, x, 0);
+                  // Compute analysis
+                  for(int e = 0; e < nValidEns; e++) {
+                     int ei = validEns[e];
+                     float total = 0;
+                     for(int k = 0; k < nValidEns; k++) {
+                        total += X(k) * W(k, e);
                      }
 
-                     ///////////////////////////////
-                     // Anti-extrapolation filter //
-                     ///////////////////////////////
-                     if(!mExtrapolate) {
-                        // Don't allow a final increment that is larger than any increment
-                        // at station points
-                        float maxInc = arma::max(lObs - (lY[e] + lYhat));
-                        float minInc = arma::min(lObs - (lY[e] + lYhat));
-                        if(x == mX && y == mY) {
-                           std::cout << "Increments: " << maxInc << " " << minInc << " " << currIncrement << std::endl;
-                        }
+                     float currIncrement = total;
 
-                        // The increment for this member. currIncrement is the increment relative to
-                        // ensemble mean
-                        float memberIncrement = currIncrement - X(e);
-                        // Adjust increment if it gives a member increment that is outside the range
-                        // of the observation increments
-                        if(x == mX && y == mY) {
-                           std::cout << "Analysis increment: " << memberIncrement << " " << ensMean << " " << currIncrement << " " << X(e) << std::endl;
-                        }
-                        if(maxInc > 0 && memberIncrement > maxInc) {
-                           currIncrement = maxInc + X(e);
-                        }
-                        else if(maxInc < 0 && memberIncrement > 0) {
-                           currIncrement = 0 + X(e);
-                        }
-                        else if(minInc < 0 && memberIncrement < minInc) {
-                           currIncrement = minInc + X(e);
+                     if(mSaveDiff)
+                        (*output)(y, x, ei) = currIncrement;
+                     else {
+                        float raw = ensMean;
+                        if(useBias) {
+                           raw -= (*bias)(y, x, 0);
                         }
-                        else if(minInc > 0 && memberIncrement < 0) {
-                           currIncrement = 0 + X(e);
-                        }
-                        if(x == mX && y == mY) {
-                           std::cout << "Final increment: " << currIncrement << " " << currIncrement - X(e) << std::endl;
+
+                        ///////////////////////////////
+                        // Anti-extrapolation filter //
+                        ///////////////////////////////
+                        if(!mExtrapolate) {
+                           // Don't allow a final increment that is larger than any increment
+                           // at station points
+                           float maxInc = arma::max(lObs - (lY[e] + lYhat));
+                           float minInc = arma::min(lObs - (lY[e] + lYhat));
+                           if(x == mX && y == mY) {
+                              tLog.out() << "Increments: " << maxInc << " " << minInc << " " << currIncrement << std::endl;
+                           }
+
+                           // The increment for this member. currIncrement is the increment relative to
+                           // ensemble mean
+                           float memberIncrement = currIncrement - X(e);
+                           // Adjust increment if it gives a member increment that is outside the range
+                           // of the observation increments
+                           if(x == mX && y == mY) {
+                              tLog.out() << "Analysis increment: " << memberIncrement << " " << ensMean << " " << currIncrement << " " << X(e) << std::endl;
+                           }
+                           if(maxInc > 0 && memberIncrement > maxInc) {
+                              currIncrement = maxInc + X(e);
+                           }
+                           else if(maxInc < 0 && memberIncrement > 0) {
+                              currIncrement = 0 + X(e);
+                           }
+                           else if(minInc < 0 && memberIncrement < minInc) {
+                              currIncrement = minInc + X(e);
+                           }
+                           else if(minInc > 0 && memberIncrement < 0) {
+                              currIncrement = 0 + X(e);
+                           }
+                           if(x == mX && y == mY) {
+                              tLog.out() << "Final increment: " << currIncrement << " " << currIncrement - X(e) << std::endl;
+                           }
                         }
+                        (*output)(y, x, ei) = ensMean + currIncrement;
                      }
-                     (*output)(y, x, ei) = ensMean + currIncrement;
-                  }
 
-                  if(mNumVariable != "") {
-                     (*num)(y, x, ei) = lS;
+                     if(mNumVariable != "") {
+                        (*num)(y, x, ei) = lS;
+                     }
                   }
-               }
 
-               // Update bias
-               if(useBias) {
-                  float biasTotal = 0;
-                  for(int e = 0; e < nValidEns; e++) {
-                     int ei = validEns[e];
-                     biasTotal += (*field)(y, x, ei) * w(e);
+                  // Update bias
+                  if(useBias) {
+                     float biasTotal = 0;
+                     for(int e = 0; e < nValidEns; e++) {
+                        int ei = validEns[e];
+                        biasTotal += (*field)(y, x, ei) * w(e);
+                     }
+                     (*newbias)(y, x, 0) = (*bias)(y, x, 0) - mGamma / (1 + mGamma) * biasTotal;
                   }
-                  (*newbias)(y, x, 0) = (*bias)(y, x, 0) - mGamma / (1 + mGamma) * biasTotal;
-               }
 
-               // Update delta
-               /*
-               float deltaVar = mC - 1;
-               float trace = arma::trace(lY * lY.t());
-               float numerator = mSigma * mSigma / mEpsilon / mEpsilon;
-               float denomenator = 1.0 / lS / (nValidEns - 1) * trace;
-               float currDeltaEvidence = numerator / denomenator;
-               float weightOld = deltaVar;
-               float weightNew = mNewDeltaVar;
-               (*newdelta)(y, x, 0) = ((*delta)(y, x, 0) * weightNew + currDeltaEvidence * weightOld) / (weightOld + weightNew);
-               */
+                  // Update delta
+                  /*
+                  float deltaVar = mC - 1;
+                  float trace = arma::trace(lY * lY.t());
+                  float numerator = mSigma * mSigma / mEpsilon / mEpsilon;
+                  float denomenator = 1.0 / lS / (nValidEns - 1) * trace;
+                  float currDeltaEvidence = numerator / denomenator;
+                  float weightOld = deltaVar;
+                  float weightNew = mNewDeltaVar;
+                  (*newdelta)(y, x, 0) = ((*delta)(y, x, 0) * weightNew + currDeltaEvidence * weightOld) / (weightOld + weightNew);
+                  */
+               }
             }
          }
+         tLog.release(tileMessages[tile]);
       }
+      for(int tile = 0; tile < tileMessages.size(); tile++)
+         OiTileLog::write(tileMessages[tile]);
 
       // Back-transform
       Util::info("Back transform");
@@ -1087,6 +1565,9 @@ bool CalibratorOi::calibrateCore(File& iFile, const ParameterFile* iParameterFil
    if(mDiaFile != "") {
      diaFile.close();
    }
+   if(mLooFile != "") {
+      looFile.close();
+   }
    return true;
 }
 
@@ -1120,6 +1601,119 @@ float CalibratorOi::calcDelta(float iOldDelta, const vec2& iY) const {
    return (iOldDelta * weightNew + currDeltaEvidence * weightOld) / (weightOld + weightNew);
 }
 
+void CalibratorOi::setStations(const std::vector<Location>& iLocations, const std::vector<float>& iLafs, Stations& iStations) {
+   int S = iLocations.size();
+   iStations.x.resize(S);
+   iStations.y.resize(S);
+   iStations.z.resize(S);
+   iStations.elevs.resize(S);
+   iStations.lafs = iLafs;
+   for(int i = 0; i < S; i++) {
+      double lat = iLocations[i].lat() * Util::pi / 180;
+      double lon = iLocations[i].lon() * Util::pi / 180;
+      iStations.x[i] = cos(lat) * cos(lon);
+      iStations.y[i] = cos(lat) * sin(lon);
+      iStations.z[i] = sin(lat);
+      iStations.elevs[i] = iLocations[i].elev();
+   }
+}
+
+void CalibratorOi::calcRhos(const Stations& iStations, float iLat, float iLon, float iElev, float iLaf,
+      const std::vector<int>& iIndices, std::vector<float>& iRhos) const {
+   int N = iIndices.size();
+   iRhos.resize(N);
+   if(N == 0)
+      return;
+
+   double lat = iLat * Util::pi / 180;
+   double lon = iLon * Util::pi / 180;
+   float x0 = cos(lat) * cos(lon);
+   float y0 = cos(lat) * sin(lon);
+   float z0 = sin(lat);
+   // Multiplying the chord length on the unit sphere by this gives distance / hlength
+   float hScale = Util::radiusEarth / mHLength;
+   bool useVLength = Util::isValid(mVLength);
+   bool useLaf = Util::isValid(iLaf);
+   bool useWMin = Util::isValid(mWMin);
+   bool useWLength = Util::isValid(mWLength);
+   float elev = Util::isValid(iElev) ? iElev : 0;
+
+   // Collect the exponents of all terms, so that exp is only computed once per station. Terms that
+   // are not part of the exponent are kept in factors.
+   std::vector<float> factors(N, 1);
+   for(int i = 0; i < N; i++) {
+      int index = iIndices[i];
+      float dx = iStations.x[index] - x0;
+      float dy = iStations.y[index] - y0;
+      float dz = iStations.z[index] - z0;
+      float h2 = (dx * dx + dy * dy + dz * dz) * hScale * hScale;
+      float exponent;
+      float factor = 1;
+      if(mRhoType == RhoTypeGaussian) {
+         exponent = -0.5f * h2;
+      }
+      else {
+         float h = sqrt(h2);
+         exponent = -h;
+         factor = 1 + h;
+      }
+      if(useVLength) {
+         float v = (iStations.elevs[index] - elev) / mVLength;
+         exponent -= 0.5f * v * v;
+         if(!Util::isValid(iElev) || !Util::isValid(iStations.elevs[index]))
+            factor = 0;
+      }
+      float lafdist = 0;
+      if(useLaf && Util::isValid(iStations.lafs[index]))
+         lafdist = iStations.lafs[index] - iLaf;
+      if(useWMin)
+         factor *= 1 - (1 - mWMin) * fabs(lafdist);
+      if(useWLength)
+         exponent -= 0.5f * lafdist * lafdist / (mWLength * mWLength);
+      iRhos[i] = exponent;
+      factors[i] = factor;
+   }
+   Util::fastExp(&iRhos[0], &iRhos[0], N);
+   for(int i = 0; i < N; i++)
+      iRhos[i] *= factors[i];
+}
+
+float CalibratorOi::calcStationRho(const Stations& iStations, const Location& iLocation1, int iIndex1, int iIndex2, bool iUseLaf) const {
+   float laf = iUseLaf ? iStations.lafs[iIndex1] : Util::MV;
+   std::vector<int> indices(1, iIndex2);
+   std::vector<float> rhos;
+   calcRhos(iStations, iLocation1.lat(), iLocation1.lon(), iLocation1.elev(), laf, indices, rhos);
+   return rhos[0];
+}
+
+void CalibratorOi::calcStationRhos(const std::vector<Location>& iLocations, const Stations& iStations, const std::vector<int>& iValidIndices,
+      const KDTree& iTree, float iRadius, SparseMatrix& iRhos, SparseMatrix& iRhosLaf) const {
+   int S = iLocations.size();
+   std::vector<std::vector<int> > columns(S);
+   std::vector<std::vector<float> > rhos(S);
+   std::vector<std::vector<float> > rhosLaf(S);
+   #pragma omp parallel for
+   for(int k = 0; k < iValidIndices.size(); k++) {
+      int index = iValidIndices[k];
+      const Location& location = iLocations[index];
+      std::vector<int> I, J;
+      std::vector<float> dists;
+      iTree.getWithinRadius(location.lat(), location.lon(), iRadius, I, J, dists);
+      columns[index].resize(J.size());
+      for(int i = 0; i < J.size(); i++)
+         columns[index][i] = iValidIndices[J[i]];
+      std::sort(columns[index].begin(), columns[index].end());
+      calcRhos(iStations, location.lat(), location.lon(), location.elev(), Util::MV, columns[index], rhos[index]);
+      calcRhos(iStations, location.lat(), location.lon(), location.elev(), iStations.lafs[index], columns[index], rhosLaf[index]);
+   }
+   iRhos = SparseMatrix(S);
+   iRhosLaf = SparseMatrix(S);
+   for(int i = 0; i < S; i++) {
+      iRhos.addRow(columns[i], rhos[i]);
+      iRhosLaf.addRow(columns[i], rhosLaf[i]);
+   }
+}
+
 float CalibratorOi::calcRho(float iHDist, float iVDist, float iLDist, RhoType iType) const {
    float h = (iHDist/mHLength);
    float rho = 1;
@@ -1196,20 +1790,27 @@ std::string CalibratorOi::description(bool full) {
       ss << Util::formatDescription("   y=undef","Turn on debug info for this y-coordinate") << std::endl;
       ss << Util::formatDescription("   extrapolate=0","Allow OI to extrapolate increments. If 0, then increments are bounded by the increments at the observation sites.") << std::endl;
       ss << Util::formatDescription("   minRho=0.0013","Perform localization by requiring this minimum rho value") << std::endl;
-      ss << Util::formatDescription("   maxBytes=6442450944","Don't allocate more than this many bytes when creating the localization information") << std::endl;
+      ss << Util::formatDescription("   localization=box","One of 'box', 'radius'. 'box' spreads each observation to all gridpoints in a box around it, which uses memory proportional to the number of observations times the box area. 'radius' searches a tree of the observations for each gridpoint, and uses memory proportional to the number of observations. With several timesteps, the stations selected for each gridpoint are kept between timesteps for both localizations, which uses 4 bytes per gridpoint plus 8 bytes per selected station (at most maxLocations per gridpoint).") << std::endl;
+      ss << Util::formatDescription("   maxBytes=6442450944","Don't allocate more than this many bytes when creating the localization information (localization=box only)") << std::endl;
       ss << Util::formatDescription("   minEns=5","Switch to single-member mode if fewer than this number of members available") << std::endl;
       ss << Util::formatDescription("   elevGradient=0","Elevation gradient when downscaling background to obs. Use -0.0065 for temperature.") << std::endl;
       ss << Util::formatDescription("   useEns=1","Enable ensemble-mode. If 0, use single-member mode.") << std::endl;
+      ss << Util::formatDescription("   tileSize=1","In single-member mode, use the same stations for all gridpoints in tiles of this many by this many gridpoints, so that the station covariance matrix is only factorized once per tile. The stations are those with the highest rho for any gridpoint in the tile. Use 1 to select stations for each gridpoint.") << std::endl;
+      ss << Util::formatDescription("   precision=double","One of 'double', 'float'. Store the small dense matrices of the analysis in this precision. The Cholesky factorizations and eigendecompositions are always done in double precision.") << std::endl;
+      ss << Util::formatDescription("   batch=0","In single-member mode, let neighbouring gridpoints that use the same set of stations share the factorization of the station covariance matrix and the solution for all members.") << std::endl;
       ss << Util::formatDescription("   wmin=0.5","") << std::endl;
       ss << Util::formatDescription("   epsilon=0.5","") << std::endl;
       ss << Util::formatDescription("   epsilonC=0.2916","") << std::endl;
       ss << Util::formatDescription("   lambda=0.5","") << std::endl;
       ss << Util::formatDescription("   boxCoxThreshold=undef","") << std::endl;
+      ss << Util::formatDescription("   sigmaRadii=25,5,3","With transform=boxcox in single-member mode, smooth the analysis variance with neighbourhood means of these radii (in gridpoints), one after the other.") << std::endl;
+      ss << Util::formatDescription("   outputRadius=3","With transform=boxcox in single-member mode, smooth the back-transformed analysis with a neighbourhood mean of this radius (in gridpoints).") << std::endl;
       ss << Util::formatDescription("   rhoType=gaussian","One of 'gaussian', 'soar'") << std::endl;
       ss << Util::formatDescription("   diagnose=0","") << std::endl;
       ss << Util::formatDescription("   maxElevDiff=200","Remove stations that are further away from the background elevation than this (in meters)") << std::endl;
       ss << Util::formatDescription("   landOnly=0","Remove stations that are not on land (laf > 0)") << std::endl;
       ss << Util::formatDescription("   diaFile=undef","If defined, write information about removed stations to this filename") << std::endl;
+      ss << Util::formatDescription("   looFile=undef","If defined, compute the leave-one-out analysis at each station (single-member mode only), i.e. the analysis at the station when the station itself is withheld, and write it with the residual (obs - analysis) to this filename. Uses one factorization per station, instead of rerunning the analysis.") << std::endl;
       ss << Util::formatDescription("   crossValidate=0","If 1, then don't use the nearest point in the kriging. The end result is a field that can be verified against observations at the kriging points.") << std::endl;
    }
    else
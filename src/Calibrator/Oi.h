@@ -6,6 +6,7 @@
 class Obs;
 class Forecast;
 class Parameters;
+class SparseMatrix;
 
 class CalibratorOi : public Calibrator {
    public:
@@ -18,8 +19,14 @@ class CalibratorOi : public Calibrator {
       std::string name() const {return "oi";};
    private:
       bool calibrateCore(File& iFile, const ParameterFile* iParameterFile) const;
+      //! The analysis, with the small dense matrices stored with elements of type T (float or
+      //! double). Cholesky factorizations are always done in double precision.
+      template<class T> bool calibrateCoreT(File& iFile, const ParameterFile* iParameterFile) const;
       enum Type {TypeTemperature, TypePrecipitation};
       enum TransformType {TransformTypeNone, TransformTypeBoxCox};
+      //! How to find the observations near each gridpoint. Box: Spread each observation to the
+      //! gridpoints in a box around it. Radius: Search a tree of the observations for each gridpoint.
+      enum LocalizationType {LocalizationTypeBox, LocalizationTypeRadius};
       float mVLength;
       float mHLength;
       float mHLengthC;
@@ -50,7 +57,18 @@ class CalibratorOi : public Calibrator {
       bool mDiagnose;
       bool mLandOnly;
       std::string mDiaFile;
+      //! Write leave-one-out cross-validation results at the stations to this file
+      std::string mLooFile;
       bool mUseEns;
+      bool mBatch;
+      int mTileSize;
+      //! Store the small dense matrices in single precision
+      bool mSinglePrecision;
+      //! Radii (in gridpoints) of the neighbourhood means that smooth the analysis variance in
+      //! single-member mode with a transform, applied in this order
+      std::vector<int> mSigmaRadii;
+      //! Radius (in gridpoints) of the neighbourhood mean that smooths the back-transformed output
+      int mOutputRadius;
       typedef arma::mat mattype;
       typedef arma::vec vectype;
       typedef arma::cx_mat cxtype;
@@ -59,9 +77,47 @@ class CalibratorOi : public Calibrator {
       Type mType;
       TransformType mTransformType;
       float calcDelta(float iOldDelta, const vec2& iY) const;
+      //! Station coordinates stored as separate arrays, so that the correlations between a point and
+      //! many stations can be computed in one vectorizable loop
+      struct Stations {
+         //! Unit vector from the center of the earth to the station
+         std::vector<float> x;
+         std::vector<float> y;
+         std::vector<float> z;
+         std::vector<float> elevs;
+         std::vector<float> lafs;
+      };
+      static void setStations(const std::vector<Location>& iLocations, const std::vector<float>& iLafs, Stations& iStations);
+      //! Compute the correlation between a point and each of the stations in iIndices. Gives the same
+      //! as calcRho, except that the horizontal distance is the chord distance through the earth.
+      //! Use a missing iLaf to leave out the land area fraction term.
+      //! @param iIndices Indices into iStations
+      //! @param iRhos Output correlations, one for each index
+      void calcRhos(const Stations& iStations, float iLat, float iLon, float iElev, float iLaf,
+            const std::vector<int>& iIndices, std::vector<float>& iRhos) const;
+      //! Correlation between two stations. The land area fraction term is only used if iUseLaf is true.
+      //! @param iLocation1 Location of the station with index iIndex1
+      float calcStationRho(const Stations& iStations, const Location& iLocation1, int iIndex1, int iIndex2, bool iUseLaf) const;
+      //! Compute the correlation between all pairs of valid stations that are closer than iRadius,
+      //! with (iRhosLaf) and without (iRhos) the land area fraction term. Row and column indices are
+      //! indices into iLocations.
+      //! @param iValidIndices Indices into iLocations of the valid stations
+      //! @param iTree Search tree of the valid stations, where the J-index is the index into iValidIndices
+      void calcStationRhos(const std::vector<Location>& iLocations, const Stations& iStations, const std::vector<int>& iValidIndices,
+            const KDTree& iTree, float iRadius, SparseMatrix& iRhos, SparseMatrix& iRhosLaf) const;
       float transform(float iValue) const;
       float invTransform(float iValue) const;
+      //! Compute the upper Cholesky factor U of A (A = U' * U). Single precision matrices are
+      //! factorized in double precision. Returns false if A is not positive definite.
+      static bool cholFactor(mattype& iU, const mattype& iA);
+      static bool cholFactor(mattype& iU, const arma::fmat& iA);
+      //! Solve A * X = B where A is symmetric positive definite, given the upper Cholesky factor
+      //! U of A (A = U' * U). Uses two triangular solves instead of inverting A.
+      static mattype cholSolve(const mattype& iU, const mattype& iB);
+      //! Same as above, for a single precision B. The solves are done in double precision.
+      static arma::fmat cholSolve(const mattype& iU, const arma::fmat& iB);
       RhoType mRhoType;
+      LocalizationType mLocalizationType;
       float mBoxCoxThreshold;
 };
 #endif
@@ -1,6 +1,9 @@
 #include "Window.h"
 #include "../Util.h"
 #include "../File/File.h"
+#include <algorithm>
+#include <limits>
+#include <math.h>
 CalibratorWindow::CalibratorWindow(const Variable& iVariable, const Options& iOptions) :
       Calibrator(iVariable, iOptions),
       mLength(7),
@@ -61,38 +64,58 @@ bool CalibratorWindow::calibrateCore(File& iFile, const ParameterFile* iParamete
       fields[t] = iFile.getEmptyField();
    }
 
-   for(int t = 0; t < nTime; t++) {
-      #pragma omp parallel for
+   if(nTime == 0)
+      return true;
+
+   int before = (mLength-1) / 2;
+   int after = mLength - before - 1;
+   if(mBefore) {
+      before = mLength - 1;
+      after = 0;
+   }
+
+   // Process the time series of one gridpoint at a time. Since consecutive windows overlap in
+   // all but one timestep, the statistics are updated as the window slides forward, instead of
+   // being recomputed for each window.
+   #pragma omp parallel
+   {
+      std::vector<float> series(nTime);
+      std::vector<float> output(nTime);
+      std::vector<double> sumsWork;
+      std::vector<int> extremeWork;
+      std::vector<float> quantileWork;
+      #pragma omp for
       for(int i = 0; i < nLat; i++) {
          for(int j = 0; j < nLon; j++) {
             for(int e = 0; e < nEns; e++) {
-               std::vector<float> window;
-               window.resize(mLength, Util::MV);
-               int index = 0;
-               int before = (mLength-1) / 2;
-               int after = mLength - before - 1;
-               int start = std::max(0, t - before);
-               int end = std::min(nTime-1, t + after);
-               if(mBefore) {
-                  start = std::max(0, t - (mLength - 1));
-                  end = std::min(nTime-1, t);
-               }
-               assert(end - start + 1 <= mLength);
-               if(mEdgePolicy == EdgePolicyMissing && (end - start + 1 != mLength)) {
-                  (*fields[t])(i,j,e) = Util::MV;
-               }
+               for(int t = 0; t < nTime; t++)
+                  series[t] = (*fieldsOrig[t])(i,j,e);
+
+               if(mStatType == Util::StatTypeMean || mStatType == Util::StatTypeSum || mStatType == Util::StatTypeStd)
+                  calcSums(&series[0], nTime, before, after, &output[0], sumsWork);
+               else if(mStatType == Util::StatTypeMin || mStatType == Util::StatTypeMax)
+                  calcExtreme(&series[0], nTime, before, after, mStatType == Util::StatTypeMax, &output[0], extremeWork);
                else {
-                  bool numMissing = 0;
-                  for(int tt = start; tt <= end; tt++) {
-                     float curr = (*fieldsOrig[tt])(i,j,e);
-                     numMissing += !Util::isValid(curr);
-                     window[index] = curr;
-                     index++;
-                  }
-                  if(mKeepMissing && numMissing > 0)
-                     (*fields[t])(i,j,e) = Util::MV;
-                  else
-                     (*fields[t])(i,j,e) = Util::calculateStat(window, mStatType, mQuantile);
+                  float quantile = mStatType == Util::StatTypeMedian ? 0.5 : mQuantile;
+                  calcQuantile(&series[0], nTime, before, after, quantile, &output[0], quantileWork);
+               }
+
+               // Number of missing values in the current window
+               int numMissing = 0;
+               for(int t = 0; t < std::min(nTime, after); t++)
+                  numMissing += !Util::isValid(series[t]);
+               for(int t = 0; t < nTime; t++) {
+                  if(t + after < nTime)
+                     numMissing += !Util::isValid(series[t + after]);
+                  if(t - before - 1 >= 0)
+                     numMissing -= !Util::isValid(series[t - before - 1]);
+                  int start = std::max(0, t - before);
+                  int end = std::min(nTime-1, t + after);
+                  if(mEdgePolicy == EdgePolicyMissing && (end - start + 1 != mLength))
+                     output[t] = Util::MV;
+                  else if(mKeepMissing && numMissing > 0)
+                     output[t] = Util::MV;
+                  (*fields[t])(i,j,e) = output[t];
                }
             }
          }
@@ -104,6 +127,133 @@ bool CalibratorWindow::calibrateCore(File& iFile, const ParameterFile* iParamete
    return true;
 }
 
+void CalibratorWindow::calcSums(const float* iSeries, int iNum, int iBefore, int iAfter, float* iOutput, std::vector<double>& iWork) const {
+   // The sums over a window are differences of sums accumulated from the start of the series. To
+   // reduce round-off errors, accumulate the differences from the mean K of the series. The
+   // standard deviation is then computed using VAR(X) = VAR(X - K), as in Util::calculateStat.
+   double shift = 0;
+   int count = 0;
+   for(int t = 0; t < iNum; t++) {
+      if(Util::isValid(iSeries[t])) {
+         shift += iSeries[t];
+         count++;
+      }
+   }
+   if(count > 0)
+      shift /= count;
+
+   // The sums of the first t values are at index t
+   iWork.resize(3 * (iNum + 1));
+   double* values = &iWork[0];
+   double* squares = values + iNum + 1;
+   double* counts = squares + iNum + 1;
+   values[0] = 0;
+   squares[0] = 0;
+   counts[0] = 0;
+   for(int t = 0; t < iNum; t++) {
+      double value = 0;
+      bool isValid = Util::isValid(iSeries[t]);
+      if(isValid)
+         value = iSeries[t] - shift;
+      values[t + 1] = values[t] + value;
+      squares[t + 1] = squares[t] + value * value;
+      counts[t + 1] = counts[t] + isValid;
+   }
+
+   for(int t = 0; t < iNum; t++) {
+      int start = std::max(0, t - iBefore);
+      int end = std::min(iNum, t + iAfter + 1);
+      double count = counts[end] - counts[start];
+      if(count == 0) {
+         iOutput[t] = Util::MV;
+         continue;
+      }
+      double total = values[end] - values[start];
+      if(mStatType == Util::StatTypeMean) {
+         iOutput[t] = total / count + shift;
+      }
+      else if(mStatType == Util::StatTypeSum) {
+         iOutput[t] = total + shift * count;
+      }
+      else {
+         double mean = total / count;
+         double variance = (squares[end] - squares[start]) / count - mean * mean;
+         // Variances below the round-off error of the accumulated squares are set to 0, so that
+         // windows with constant values get 0
+         double tolerance = 8 * std::numeric_limits<double>::epsilon() * squares[end] / count;
+         iOutput[t] = variance > tolerance ? sqrt(variance) : 0;
+      }
+   }
+}
+
+void CalibratorWindow::calcExtreme(const float* iSeries, int iNum, int iBefore, int iAfter, bool iMax, float* iOutput, std::vector<int>& iWork) const {
+   // Each index enters the deque once, so the deque can be stored in a plain array. A new value
+   // removes all values at the back of the deque that it beats, since these leave the window
+   // before it does. The front of the deque is then the extreme of the window.
+   iWork.resize(iNum);
+   int* deque = iWork.empty() ? NULL : &iWork[0];
+   float sign = iMax ? -1 : 1;
+   int front = 0;
+   int back = 0;
+   int next = 0;
+   for(int t = 0; t < iNum; t++) {
+      int start = std::max(0, t - iBefore);
+      int end = std::min(iNum - 1, t + iAfter);
+      for(; next <= end; next++) {
+         float value = iSeries[next];
+         if(!Util::isValid(value))
+            continue;
+         while(back > front && sign * iSeries[deque[back - 1]] >= sign * value)
+            back--;
+         deque[back] = next;
+         back++;
+      }
+      while(back > front && deque[front] < start)
+         front++;
+      iOutput[t] = back > front ? iSeries[deque[front]] : Util::MV;
+   }
+}
+
+void CalibratorWindow::calcQuantile(const float* iSeries, int iNum, int iBefore, int iAfter, float iQuantile, float* iOutput, std::vector<float>& iWork) const {
+   // Each value is inserted into and later removed from the sorted array once. This costs one
+   // shift of the array per timestep, instead of sorting the window for each timestep.
+   iWork.clear();
+   int first = 0;
+   int next = 0;
+   for(int t = 0; t < iNum; t++) {
+      int start = std::max(0, t - iBefore);
+      int end = std::min(iNum - 1, t + iAfter);
+      for(; next <= end; next++) {
+         if(Util::isValid(iSeries[next]))
+            iWork.insert(std::upper_bound(iWork.begin(), iWork.end(), iSeries[next]), iSeries[next]);
+      }
+      for(; first < start; first++) {
+         if(Util::isValid(iSeries[first]))
+            iWork.erase(std::lower_bound(iWork.begin(), iWork.end(), iSeries[first]));
+      }
+
+      // Interpolate between the two nearest values, in the same way as Util::calculateStat
+      int N = iWork.size();
+      if(N == 0) {
+         iOutput[t] = Util::MV;
+         continue;
+      }
+      int lowerIndex = floor(iQuantile * (N-1));
+      int upperIndex = ceil(iQuantile * (N-1));
+      float lowerValue = iWork[lowerIndex];
+      float upperValue = iWork[upperIndex];
+      if(lowerIndex == upperIndex) {
+         iOutput[t] = lowerValue;
+      }
+      else {
+         float lowerQuantile = (float) lowerIndex / (N-1);
+         float upperQuantile = (float) upperIndex / (N-1);
+         float f = (iQuantile - lowerQuantile)/(upperQuantile - lowerQuantile);
+         iOutput[t] = lowerValue + (upperValue - lowerValue) * f;
+      }
+   }
+}
+
 std::string CalibratorWindow::description(bool full) {
    std::stringstream ss;
    ss << Util::formatDescription("-c window","Applies a statistical operator to values within a temporal window. Any missing values are ignored when computing the statistic.") << std::endl;
@@ -23,5 +23,19 @@ class CalibratorWindow : public Calibrator {
          EdgePolicyMissing = 10
       };
       EdgePolicy mEdgePolicy;
+      // The statistics for each timestep are computed over the window of timesteps from
+      // t - iBefore to t + iAfter, truncated at the ends of the time series. Missing values
+      // are ignored, and windows with only missing values give missing.
+
+      //! Compute the mean, sum, or standard deviation in each window, using accumulated sums
+      //! @param iWork Work buffer, resized as needed
+      void calcSums(const float* iSeries, int iNum, int iBefore, int iAfter, float* iOutput, std::vector<double>& iWork) const;
+      //! Compute the min or max in each window, using a deque of the indices of the values that can
+      //! still become the extreme. The values in the deque are kept sorted.
+      //! @param iWork Work buffer, resized as needed
+      void calcExtreme(const float* iSeries, int iNum, int iBefore, int iAfter, bool iMax, float* iOutput, std::vector<int>& iWork) const;
+      //! Compute a quantile in each window, by keeping the values in the window sorted
+      //! @param iWork Work buffer, resized as needed
+      void calcQuantile(const float* iSeries, int iNum, int iBefore, int iAfter, float iQuantile, float* iOutput, std::vector<float>& iWork) const;
 };
 #endif
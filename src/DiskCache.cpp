@@ -0,0 +1,163 @@
+#include "DiskCache.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Util.h"
+
+std::string DiskCache::mDirectory = "";
+const int DiskCache::mVersion = 1;
+
+namespace {
+   const char magic[8] = {'G','R','I','D','P','P','C','\0'};
+}
+
+void DiskCache::setDirectory(std::string iDirectory) {
+   if(iDirectory != "") {
+      struct stat info;
+      if(stat(iDirectory.c_str(), &info) != 0) {
+         if(mkdir(iDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+            Util::error("Could not create cache directory '" + iDirectory + "'");
+         }
+      }
+      else if(!S_ISDIR(info.st_mode)) {
+         Util::error("Cache directory '" + iDirectory + "' is not a directory");
+      }
+   }
+   mDirectory = iDirectory;
+}
+
+std::string DiskCache::getDirectory() {
+   return mDirectory;
+}
+
+bool DiskCache::isEnabled() {
+   return mDirectory != "";
+}
+
+std::string DiskCache::getKey(std::string iName, const std::vector<uint64_t>& iHashes) {
+   std::stringstream ss;
+   ss << iName;
+   for(int i = 0; i < iHashes.size(); i++) {
+      ss << "_" << std::hex << std::setw(16) << std::setfill('0') << iHashes[i];
+   }
+   return ss.str();
+}
+
+std::string DiskCache::getFilename(std::string iKey) {
+   return mDirectory + "/" + iKey + ".bin";
+}
+
+bool DiskCache::read(std::string iKey, std::vector<std::vector<int> >& iInts, std::vector<std::vector<float> >& iFloats) {
+   if(!isEnabled())
+      return false;
+
+   std::string filename = getFilename(iKey);
+   std::ifstream ifs(filename.c_str(), std::ios::binary);
+   if(!ifs.good())
+      return false;
+
+   // Header
+   char fileMagic[8];
+   int32_t header[4];
+   ifs.read(fileMagic, sizeof(fileMagic));
+   ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+   if(!ifs.good() || memcmp(fileMagic, magic, sizeof(magic)) != 0 || header[0] != mVersion || header[1] < 0 || header[2] < 0) {
+      Util::warning("Ignoring invalid cache file '" + filename + "'");
+      return false;
+   }
+   int numInts = header[1];
+   int numFloats = header[2];
+   std::vector<int64_t> sizes(numInts + numFloats);
+   if(sizes.size() > 0)
+      ifs.read(reinterpret_cast<char*>(&sizes[0]), sizes.size() * sizeof(int64_t));
+   if(!ifs.good()) {
+      Util::warning("Ignoring invalid cache file '" + filename + "'");
+      return false;
+   }
+
+   // Check that the file is large enough before allocating memory
+   std::streampos dataStart = ifs.tellg();
+   ifs.seekg(0, std::ios::end);
+   std::streampos end = ifs.tellg();
+   ifs.seekg(dataStart);
+   int64_t total = 0;
+   for(int i = 0; i < sizes.size(); i++) {
+      if(sizes[i] < 0) {
+         Util::warning("Ignoring invalid cache file '" + filename + "'");
+         return false;
+      }
+      total += sizes[i];
+   }
+   if(total * 4 != end - dataStart) {
+      Util::warning("Ignoring truncated cache file '" + filename + "'");
+      return false;
+   }
+
+   // Data
+   iInts.resize(numInts);
+   for(int i = 0; i < numInts; i++) {
+      iInts[i].resize(sizes[i]);
+      if(sizes[i] > 0)
+         ifs.read(reinterpret_cast<char*>(&iInts[i][0]), sizes[i] * sizeof(int));
+   }
+   iFloats.resize(numFloats);
+   for(int i = 0; i < numFloats; i++) {
+      iFloats[i].resize(sizes[numInts + i]);
+      if(sizes[numInts + i] > 0)
+         ifs.read(reinterpret_cast<char*>(&iFloats[i][0]), sizes[numInts + i] * sizeof(float));
+   }
+   if(!ifs.good()) {
+      Util::warning("Could not read cache file '" + filename + "'");
+      return false;
+   }
+   return true;
+}
+
+bool DiskCache::write(std::string iKey, const std::vector<std::vector<int> >& iInts, const std::vector<std::vector<float> >& iFloats) {
+   if(!isEnabled())
+      return false;
+
+   std::string filename = getFilename(iKey);
+   std::stringstream ss;
+   ss << filename << ".tmp" << getpid();
+   std::string tempFilename = ss.str();
+
+   std::ofstream ofs(tempFilename.c_str(), std::ios::binary);
+   if(!ofs.good()) {
+      Util::warning("Could not write cache file '" + filename + "'");
+      return false;
+   }
+
+   int32_t header[4] = {mVersion, (int32_t) iInts.size(), (int32_t) iFloats.size(), 0};
+   ofs.write(magic, sizeof(magic));
+   ofs.write(reinterpret_cast<const char*>(header), sizeof(header));
+   for(int i = 0; i < iInts.size(); i++) {
+      int64_t size = iInts[i].size();
+      ofs.write(reinterpret_cast<const char*>(&size), sizeof(size));
+   }
+   for(int i = 0; i < iFloats.size(); i++) {
+      int64_t size = iFloats[i].size();
+      ofs.write(reinterpret_cast<const char*>(&size), sizeof(size));
+   }
+   for(int i = 0; i < iInts.size(); i++) {
+      if(iInts[i].size() > 0)
+         ofs.write(reinterpret_cast<const char*>(&iInts[i][0]), iInts[i].size() * sizeof(int));
+   }
+   for(int i = 0; i < iFloats.size(); i++) {
+      if(iFloats[i].size() > 0)
+         ofs.write(reinterpret_cast<const char*>(&iFloats[i][0]), iFloats[i].size() * sizeof(float));
+   }
+   ofs.close();
+
+   if(ofs.fail() || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+      Util::warning("Could not write cache file '" + filename + "'");
+      std::remove(tempFilename.c_str());
+      return false;
+   }
+   return true;
+}
@@ -0,0 +1,38 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+//! Stores precomputed arrays (such as nearest neighbour indices) on disk, so that later runs on the
+//! same grids can reuse them. Each entry is a binary file in the cache directory, with a fixed-size
+//! header followed by the arrays stored contiguously in native byte order. Since all arrays are
+//! 4-byte aligned, the file can be memory-mapped.
+//!
+//! Layout: magic (8 bytes), version, number of int arrays, number of float arrays, padding (int32),
+//! the length of each array (int64), then the int arrays followed by the float arrays.
+class DiskCache {
+   public:
+      //! Enable caching in this directory. Use an empty string to disable caching. The directory is
+      //! created if it does not exist.
+      static void setDirectory(std::string iDirectory);
+      static std::string getDirectory();
+      //! Is a cache directory set?
+      static bool isEnabled();
+
+      //! Creates a key for an entry. The key is used as the filename of the entry.
+      //! @param iName Describes the kind of data (e.g. nearest)
+      //! @param iHashes Hashes of the inputs the data depend on (e.g. hashes of the grids)
+      static std::string getKey(std::string iName, const std::vector<uint64_t>& iHashes);
+
+      //! Read an entry. Returns false if the entry does not exist or cannot be read.
+      static bool read(std::string iKey, std::vector<std::vector<int> >& iInts, std::vector<std::vector<float> >& iFloats);
+      //! Write an entry. The file is written under a temporary name and then renamed, so that
+      //! concurrent runs never see partially written entries. Returns false on failure.
+      static bool write(std::string iKey, const std::vector<std::vector<int> >& iInts, const std::vector<std::vector<float> >& iFloats);
+   private:
+      static std::string getFilename(std::string iKey);
+      static std::string mDirectory;
+      static const int mVersion;
+};
+#endif
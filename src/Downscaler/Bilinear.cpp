@@ -1,9 +1,13 @@
 #include "Bilinear.h"
 #include "../File/File.h"
 #include "../Util.h"
+#include "../DiskCache.h"
+#include "../Projection.h"
 #include <math.h>
+#include <algorithm>
 
 float DownscalerBilinear::bilinearLimit = 0.05;
+std::map<std::pair<Uuid, Uuid>, SparseMatrix> DownscalerBilinear::mOperatorCache;
 
 DownscalerBilinear::DownscalerBilinear(const Variable& iInputVariable, const Variable& iOutputVariable, const Options& iOptions) :
       Downscaler(iInputVariable, iOutputVariable, iOptions) {
@@ -12,36 +16,220 @@ DownscalerBilinear::DownscalerBilinear(const Variable& iInputVariable, const Var
 
 void DownscalerBilinear::downscaleCore(const File& iInput, File& iOutput) const {
    int nTime = iInput.getNumTime();
-   vec2 ilats = iInput.getLats();
-   vec2 ilons = iInput.getLons();
-   vec2 olats = iOutput.getLats();
-   vec2 olons = iOutput.getLons();
 
    // Get nearest neighbour
    vec2Int nearestI, nearestJ;
    Downscaler::getNearestNeighbour(iInput, iOutput, nearestI, nearestJ);
 
+   // The weights are the same for all times
+   SparseMatrix op;
+   getOperator(iInput, iOutput, nearestI, nearestJ, op);
+
    for(int t = 0; t < nTime; t++) {
       Field& ifield = *iInput.getField(mInputVariable, t);
       Field& ofield = *iOutput.getField(mOutputVariable, t, true);
-      downscaleField(ifield, ofield, ilats, ilons, olats, olons, nearestI, nearestJ);
+      downscaleField(ifield, ofield, op);
    }
 }
 
-float DownscalerBilinear::bilinear(float x, float y, float x0, float x1, float x2, float x3, float y0, float y1, float y2, float y3, float v0, float v1, float v2, float v3) {
-   float Y1 = y1;
-   float Y2 = y3;
-   float Y3 = y0;
-   float Y4 = y2;
-   float X1 = x1;
-   float X2 = x3;
-   float X3 = x0;
-   float X4 = x2;
-   float P1 = v1;
-   float P2 = v3;
-   float P3 = v0;
-   float P4 = v2;
+void DownscalerBilinear::getOperator(const File& iFrom, const File& iTo,
+      const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator) {
+   std::pair<Uuid, Uuid> tags(iFrom.getUniqueTag(), iTo.getUniqueTag());
+   std::map<std::pair<Uuid, Uuid>, SparseMatrix>::const_iterator it = mOperatorCache.find(tags);
+   if(it != mOperatorCache.end()) {
+      iOperator = it->second;
+      return;
+   }
+
+   int nRows = iTo.getNumY() * iTo.getNumX();
+   int nCols = iFrom.getNumY() * iFrom.getNumX();
+   std::string key;
+   bool found = false;
+   if(DiskCache::isEnabled()) {
+      std::vector<uint64_t> hashes;
+      hashes.push_back(tags.first);
+      hashes.push_back(tags.second);
+      // Weights computed from a projection differ slightly from those computed from lats/lons
+      key = DiskCache::getKey(iFrom.getProjection() != NULL ? "bilinearProjected" : "bilinear", hashes);
+      std::vector<std::vector<int> > ints;
+      std::vector<std::vector<float> > floats;
+      if(DiskCache::read(key, ints, floats) && ints.size() == 2 && floats.size() == 1 &&
+            ints[0].size() == nRows + 1 && iOperator.set(nCols, ints[0], ints[1], floats[0])) {
+         Util::info("Bilinear weights read from cache");
+         found = true;
+      }
+   }
+
+   if(!found) {
+      const Projection* projection = iFrom.getProjection();
+      if(projection != NULL)
+         calcOperator(*projection, iTo.getLats(), iTo.getLons(), nearestI, nearestJ, iOperator);
+      else
+         calcOperator(iFrom.getLats(), iFrom.getLons(), iTo.getLats(), iTo.getLons(), nearestI, nearestJ, iOperator);
+      if(DiskCache::isEnabled()) {
+         std::vector<std::vector<int> > ints;
+         ints.push_back(iOperator.getRowStarts());
+         ints.push_back(iOperator.getColumns());
+         std::vector<std::vector<float> > floats;
+         floats.push_back(iOperator.getWeights());
+         DiskCache::write(key, ints, floats);
+      }
+   }
+   mOperatorCache[tags] = iOperator;
+}
+
+void DownscalerBilinear::calcOperator(const vec2& iInputLats, const vec2& iInputLons,
+      const vec2& iOutputLats, const vec2& iOutputLons,
+      const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator) {
+   int nLat = iOutputLats.size();
+   int nLon = nLat > 0 ? iOutputLats[0].size() : 0;
+   int nInputLon = iInputLats.size() > 0 ? iInputLats[0].size() : 0;
+   int nCols = iInputLats.size() * nInputLon;
+
+   // Compute the weights in parallel, then assemble the rows in order. Outside points have
+   // missing indices, and so do points where the input grid is too distorted for bilinear
+   // interpolation. Both use the nearest neighbour.
+   int numDistorted = 0;
+   vec2Int I1, J1, I2, J2;
+   std::vector<vec2> weights(nLat);
+   I1.resize(nLat);
+   J1.resize(nLat);
+   I2.resize(nLat);
+   J2.resize(nLat);
+   #pragma omp parallel for reduction(+:numDistorted)
+   for(int i = 0; i < nLat; i++) {
+      I1[i].assign(nLon, Util::MV);
+      J1[i].assign(nLon, Util::MV);
+      I2[i].assign(nLon, Util::MV);
+      J2[i].assign(nLon, Util::MV);
+      weights[i].resize(nLon);
+      for(int j = 0; j < nLon; j++) {
+         int I = nearestI[i][j];
+         int J = nearestJ[i][j];
+         if(!Util::isValid(I) || !Util::isValid(J))
+            continue;
+         float lat = iOutputLats[i][j];
+         float lon = iOutputLons[i][j];
+         int currI1, currJ1, currI2, currJ2;
+         bool inside = findCoords(lat, lon, iInputLats, iInputLons, I, J, currI1, currJ1, currI2, currJ2);
+         if(inside) {
+            float x0 = iInputLons[currI1][currJ1];
+            float x1 = iInputLons[currI2][currJ1];
+            float x2 = iInputLons[currI1][currJ2];
+            float x3 = iInputLons[currI2][currJ2];
+            float y0 = iInputLats[currI1][currJ1];
+            float y1 = iInputLats[currI2][currJ1];
+            float y2 = iInputLats[currI1][currJ2];
+            float y3 = iInputLats[currI2][currJ2];
+            weights[i][j].resize(4);
+            if(calcWeights(lon, lat, x0, x1, x2, x3, y0, y1, y2, y3, weights[i][j][0], weights[i][j][1], weights[i][j][2], weights[i][j][3])) {
+               I1[i][j] = currI1;
+               J1[i][j] = currJ1;
+               I2[i][j] = currI2;
+               J2[i][j] = currJ2;
+            }
+            else {
+               numDistorted++;
+            }
+         }
+      }
+   }
+   if(numDistorted > 0) {
+      std::stringstream ss;
+      ss << "Bilinear interpolation: The input grid is rotated/distorted in a way that is not supported at "
+         << numDistorted << " output points. Using the nearest neighbour for these.";
+      Util::warning(ss.str());
+   }
+
+   iOperator = SparseMatrix(nCols);
+   std::vector<int> columns(4);
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         if(Util::isValid(I1[i][j])) {
+            columns[0] = I1[i][j] * nInputLon + J1[i][j];
+            columns[1] = I2[i][j] * nInputLon + J1[i][j];
+            columns[2] = I1[i][j] * nInputLon + J2[i][j];
+            columns[3] = I2[i][j] * nInputLon + J2[i][j];
+            iOperator.addRow(columns, weights[i][j]);
+         }
+         else if(Util::isValid(nearestI[i][j]) && Util::isValid(nearestJ[i][j])) {
+            // The point is outside the input domain, or the grid is too distorted. Revert to
+            // nearest neighbour
+            iOperator.addRow(nearestI[i][j] * nInputLon + nearestJ[i][j], 1);
+         }
+         else {
+            iOperator.addRow(std::vector<int>(), std::vector<float>());
+         }
+      }
+   }
+}
+
+void DownscalerBilinear::calcOperator(const Projection& iProjection,
+      const vec2& iOutputLats, const vec2& iOutputLons,
+      const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator) {
+   int nY = iProjection.getNumY();
+   int nX = iProjection.getNumX();
+   int nLat = iOutputLats.size();
+   int nLon = nLat > 0 ? iOutputLats[0].size() : 0;
+
+   // Fractional indices of each output point in the input grid
+   vec2 fI(nLat), fJ(nLat);
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      fI[i].assign(nLon, Util::MV);
+      fJ[i].assign(nLon, Util::MV);
+      for(int j = 0; j < nLon; j++) {
+         float currI, currJ;
+         if(iProjection.getIndex(iOutputLats[i][j], iOutputLons[i][j], currI, currJ)) {
+            fI[i][j] = currI;
+            fJ[i][j] = currJ;
+         }
+      }
+   }
+
+   iOperator = SparseMatrix(nY * nX);
+   std::vector<int> columns(4);
+   std::vector<float> weights(4);
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         float currI = fI[i][j];
+         float currJ = fJ[i][j];
+         bool inside = Util::isValid(currI) && Util::isValid(currJ) && nY > 1 && nX > 1 &&
+               currI >= 0 && currI <= nY - 1 && currJ >= 0 && currJ <= nX - 1;
+         if(inside) {
+            // Interpolate linearly in the projected coordinates
+            int I1 = std::min((int) currI, nY - 2);
+            int J1 = std::min((int) currJ, nX - 2);
+            int I2 = I1 + 1;
+            int J2 = J1 + 1;
+            float t = currI - I1;
+            float s = currJ - J1;
+            columns[0] = I1 * nX + J1;
+            columns[1] = I2 * nX + J1;
+            columns[2] = I1 * nX + J2;
+            columns[3] = I2 * nX + J2;
+            weights[0] = (1 - t) * (1 - s);
+            weights[1] = t * (1 - s);
+            weights[2] = (1 - t) * s;
+            weights[3] = t * s;
+            iOperator.addRow(columns, weights);
+         }
+         else if(Util::isValid(nearestI[i][j]) && Util::isValid(nearestJ[i][j])) {
+            // The point is outside the input domain. Revert to nearest neighbour
+            iOperator.addRow(nearestI[i][j] * nX + nearestJ[i][j], 1);
+         }
+         else {
+            iOperator.addRow(std::vector<int>(), std::vector<float>());
+         }
+      }
+   }
+}
 
+void DownscalerBilinear::clearCache() {
+   mOperatorCache.clear();
+}
+
+bool DownscalerBilinear::calcWeights(float x, float y, float x0, float x1, float x2, float x3, float y0, float y1, float y2, float y3, float& w0, float& w1, float& w2, float& w3) {
    // General method based on: https://stackoverflow.com/questions/23920976/bilinear-interpolation-with-non-aligned-input-points
    // Parallelogram method based on: http://www.ahinson.com/algorithms_general/Sections/InterpolationRegression/InterpolationIrregularBilinear.pdf
 
@@ -59,16 +247,25 @@ float DownscalerBilinear::bilinear(float x, float y, float x0, float x1, float x
    if(s <= 0 && s >= lowerLimit)
       s = 0;
    if(!(s >= 0 && s <= 1 && t >= 0 && t <= 1)) {
+      return false;
+   }
+   w0 = (1 - s) * t;
+   w1 = (1 - s) * (1 - t);
+   w2 = s * t;
+   w3 = s * (1 - t);
+   return true;
+}
+
+float DownscalerBilinear::bilinear(float x, float y, float x0, float x1, float x2, float x3, float y0, float y1, float y2, float y3, float v0, float v1, float v2, float v3) {
+   float w0, w1, w2, w3;
+   if(!calcWeights(x, y, x0, x1, x2, x3, y0, y1, y2, y3, w0, w1, w2, w3)) {
       std::stringstream ss;
-      ss << "Problem with bilinear interpolation. Grid is rotated/distorted in a way that is not supported. s=" << s << " and t=" << t << " are outside ["
-         << lowerLimit << "," << upperLimit << "].";
+      ss << "Problem with bilinear interpolation. Grid is rotated/distorted in a way that is not supported.";
       ss << std::endl << x << " " << y << " " << x0 << " " << x1 << " " << x2 << " " << x3 << std::endl;
       ss << y0 << " " << y1 << " " << y2 << " " << y3 << std::endl;
-      ss << v0 << " " << v1 << " " << v2 << " " << v3 << std::endl;
       Util::error(ss.str());
    }
-   assert(s >= 0 && s <= 1 && t >= 0 && t <= 1);
-   float value = P1 * (1 - s) * ( 1 - t) + P2 * s * (1 - t) + P3 * (1 - s) * t + P4 * s * t;
+   float value = w0 * v0 + w1 * v1 + w2 * v2 + w3 * v3;
 
    return value;
 }
@@ -77,56 +274,34 @@ vec2 DownscalerBilinear::downscaleVec(const vec2& iInput,
             const vec2& iInputLats, const vec2& iInputLons,
             const vec2& iOutputLats, const vec2& iOutputLons,
             const vec2Int& nearestI, const vec2Int& nearestJ) {
+   SparseMatrix op;
+   calcOperator(iInputLats, iInputLons, iOutputLats, iOutputLons, nearestI, nearestJ, op);
+   return downscaleVec(iInput, op, nearestI, nearestJ);
+}
 
-   int nLat = iOutputLats.size();
-   int nLon = iOutputLats[0].size();
+vec2 DownscalerBilinear::downscaleVec(const vec2& iInput, const SparseMatrix& iOperator, const vec2Int& nearestI, const vec2Int& nearestJ) {
+   int nLat = nearestI.size();
+   int nLon = nLat > 0 ? nearestI[0].size() : 0;
+   assert(nLat * nLon == iOperator.getNumRows());
+
+   std::vector<float> input;
+   input.reserve(iOperator.getNumCols());
+   for(int i = 0; i < iInput.size(); i++)
+      input.insert(input.end(), iInput[i].begin(), iInput[i].end());
+   std::vector<float> values;
+   iOperator.multiply(input, values);
 
    vec2 output;
    output.resize(nLat);
-   for(int i = 0; i < nLat; i++)
-      output[i].resize(nLon);
-
-   // Algorithm from here:
    #pragma omp parallel for
    for(int i = 0; i < nLat; i++) {
+      output[i].assign(values.begin() + i * nLon, values.begin() + (i + 1) * nLon);
       for(int j = 0; j < nLon; j++) {
-         // Use the four points surrounding the lookup point. Use the nearest neighbour
-         // and then figure out what side of this point the other there points are.
+         // Revert to the nearest neighbour if any of the surrounding values are missing
          int I = nearestI[i][j];
          int J = nearestJ[i][j];
-         float lat = iOutputLats[i][j];
-         float lon = iOutputLons[i][j];
-         int I1 = Util::MV;
-         int I2 = Util::MV;
-         int J1 = Util::MV;
-         int J2 = Util::MV;
-         bool inside = findCoords(lat, lon, iInputLats, iInputLons, I, J, I1, J1, I2, J2);
-         if(inside) {
-            float x0 = iInputLons[I1][J1];
-            float x1 = iInputLons[I2][J1];
-            float x2 = iInputLons[I1][J2];
-            float x3 = iInputLons[I2][J2];
-            float y0 = iInputLats[I1][J1];
-            float y1 = iInputLats[I2][J1];
-            float y2 = iInputLats[I1][J2];
-            float y3 = iInputLats[I2][J2];
-
-            float v0 = iInput[I1][J1];
-            float v1 = iInput[I2][J1];
-            float v2 = iInput[I1][J2];
-            float v3 = iInput[I2][J2];
-            if(Util::isValid(v0) && Util::isValid(v1) &&Util::isValid(v2) &&Util::isValid(v3)) {
-               float value = bilinear(lon, lat, x0, x1, x2, x3, y0, y1, y2, y3, v0, v1, v2, v3);
-               output[i][j] = value;
-            }
-            else
-               output[i][j] = iInput[I][J];
-         }
-         else {
-            // The point is outside the input domain. Revert to nearest neighbour
-            // Util::warning("Point is outside domain, cannot bilinearly interpolate");
+         if(!Util::isValid(output[i][j]) && Util::isValid(I) && Util::isValid(J))
             output[i][j] = iInput[I][J];
-         }
       }
    }
    return output;
@@ -136,56 +311,21 @@ void DownscalerBilinear::downscaleField(const Field& iInput, Field& iOutput,
             const vec2& iInputLats, const vec2& iInputLons,
             const vec2& iOutputLats, const vec2& iOutputLons,
             const vec2Int& nearestI, const vec2Int& nearestJ) {
+   SparseMatrix op;
+   calcOperator(iInputLats, iInputLons, iOutputLats, iOutputLons, nearestI, nearestJ, op);
+   downscaleField(iInput, iOutput, op);
+}
 
-   int nLat = iOutput.getNumY();
-   int nLon = iOutput.getNumX();
+void DownscalerBilinear::downscaleField(const Field& iInput, Field& iOutput, const SparseMatrix& iOperator) {
    int nEns = iOutput.getNumEns();
-
-   #pragma omp parallel for
-   for(int i = 0; i < nLat; i++) {
-      for(int j = 0; j < nLon; j++) {
-         int I = nearestI[i][j];
-         int J = nearestJ[i][j];
-         float lat = iOutputLats[i][j];
-         float lon = iOutputLons[i][j];
-         // Find out if current lookup point is right/above the nearest neighbour
-         int I1 = Util::MV;
-         int I2 = Util::MV;
-         int J1 = Util::MV;
-         int J2 = Util::MV;
-         bool inside = findCoords(lat, lon, iInputLats, iInputLons, I, J, I1, J1, I2, J2);
-         if(inside) {
-            float x0 = iInputLons[I1][J1];
-            float x1 = iInputLons[I2][J1];
-            float x2 = iInputLons[I1][J2];
-            float x3 = iInputLons[I2][J2];
-            float y0 = iInputLats[I1][J1];
-            float y1 = iInputLats[I2][J1];
-            float y2 = iInputLats[I1][J2];
-            float y3 = iInputLats[I2][J2];
-
-            for(int ee = 0; ee < nEns; ee++) {
-               float v0 = iInput(I1, J1, ee);
-               float v1 = iInput(I2, J1, ee);
-               float v2 = iInput(I1, J2, ee);
-               float v3 = iInput(I2, J2, ee);
-               if(Util::isValid(v0) && Util::isValid(v1) &&Util::isValid(v2) &&Util::isValid(v3)) {
-                  float value = bilinear(lon, lat, x0, x1, x2, x3, y0, y1, y2, y3, v0, v1, v2, v3);
-                  iOutput(i,j,ee) = value;
-               }
-               else
-                  iOutput(i,j,ee) = Util::MV;
-            }
-         }
-         else {
-            // The point is outside the input domain. Revert to nearest neighbour
-            // Util::warning("Point is outside domain, cannot bilinearly interpolate");
-            for(int ee = 0; ee < nEns; ee++) {
-               iOutput(i,j,ee) = iInput(I, J, ee);
-            }
-         }
-      }
-   }
+   assert(iOutput.getNumY() * iOutput.getNumX() == iOperator.getNumRows());
+   assert(iInput.getNumY() * iInput.getNumX() == iOperator.getNumCols());
+   assert(iInput.getNumEns() >= nEns);
+   if(iOperator.getNumRows() == 0 || nEns == 0)
+      return;
+
+   // Apply the operator to all members at once. Members are stored contiguously in a Field.
+   iOperator.multiply(&iInput(0, 0, 0), &iOutput(0, 0, 0), nEns, iInput.getNumEns(), nEns);
 }
 
 bool DownscalerBilinear::findCoords(float iLat, float iLon, const vec2& iLats, const vec2& iLons, int I, int J, int& I1, int& J1, int& I2, int& J2) {
@@ -474,6 +614,7 @@ bool DownscalerBilinear::getI(int I, bool isAbove, bool Iinc, int& I1, int& I2)
          I2 = I + 1;
       }
    }
+   return true;
 }
 
 bool DownscalerBilinear::getJ(int J, bool isRight, bool Jinc, int& J1, int& J2) {
@@ -498,6 +639,7 @@ bool DownscalerBilinear::getJ(int J, bool isRight, bool Jinc, int& J1, int& J2)
          J2 = J + 1;
       }
    }
+   return true;
 }
 std::string DownscalerBilinear::description(bool full) {
    std::stringstream ss;
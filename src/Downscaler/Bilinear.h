@@ -5,6 +5,7 @@
 #include "../Variable.h"
 #include "../Util.h"
 #include "../Field.h"
+#include "../SparseMatrix.h"
 class File;
 class DownscalerBilinear : public Downscaler {
    public:
@@ -24,12 +25,39 @@ class DownscalerBilinear : public Downscaler {
             const vec2& iInputLats, const vec2& iInputLons,
             const vec2& iOutputLats, const vec2& iOutputLons,
             const vec2Int& nearestI, const vec2Int& nearestJ);
+      //! Interpolate a whole field using an operator from getOperator. Output values are missing
+      //! if any of the surrounding input values are missing.
+      static void downscaleField(const Field& iInput, Field& iOutput, const SparseMatrix& iOperator);
 
       // Interpolate a whole vec2
       static vec2 downscaleVec(const vec2& iInput,
             const vec2& iInputLats, const vec2& iInputLons,
             const vec2& iOutputLats, const vec2& iOutputLons,
             const vec2Int& nearestI, const vec2Int& nearestJ);
+      //! Interpolate a whole vec2 using an operator from getOperator. Uses the nearest neighbour
+      //! if any of the surrounding input values are missing.
+      static vec2 downscaleVec(const vec2& iInput, const SparseMatrix& iOperator, const vec2Int& nearestI, const vec2Int& nearestJ);
+
+      //! Get the interpolation operator that maps values on the iFrom grid to the iTo grid. Each
+      //! row (output gridpoint) contains the four surrounding input gridpoints (see findCoords)
+      //! and their bilinear weights, or the nearest neighbour for output gridpoints outside the
+      //! input domain. Rows and columns are flattened gridpoint indices (i * nX + j). If the input
+      //! grid has a known projection, the stencils are computed directly from the projection. The
+      //! operator is cached in memory and in the disk cache, if enabled.
+      static void getOperator(const File& iFrom, const File& iTo,
+            const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator);
+      //! Compute the operator described in getOperator from the lats/lons of the grids, without
+      //! using any caches
+      static void calcOperator(const vec2& iInputLats, const vec2& iInputLons,
+            const vec2& iOutputLats, const vec2& iOutputLons,
+            const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator);
+      //! Compute the operator using the projection of the input grid. The weights are bilinear
+      //! in the projected coordinates.
+      static void calcOperator(const Projection& iProjection,
+            const vec2& iOutputLats, const vec2& iOutputLons,
+            const vec2Int& nearestI, const vec2Int& nearestJ, SparseMatrix& iOperator);
+      //! Clears the in-memory operator cache
+      static void clearCache();
 
       //! Find which I/J coordinates surround a lookup point
       //! Returns false if the lookup point is outside the grid. In this case, I1, I2, J1, J2 values
@@ -46,6 +74,10 @@ class DownscalerBilinear : public Downscaler {
       static bool getJ(int J, bool isAbove, bool Jinc, int& J1, int& J2);
    private:
       void downscaleCore(const File& iInput, File& iOutput) const;
+      //! Compute the weights of v0, v1, v2, v3 used by bilinear. Returns false if the point is too
+      //! far outside the four points.
+      static bool calcWeights(float x, float y, float x0, float x1, float x2, float x3, float y0, float y1, float y2, float y3, float& w0, float& w1, float& w2, float& w3);
       static float bilinearLimit;
+      static std::map<std::pair<Uuid, Uuid>, SparseMatrix> mOperatorCache;
 };
 #endif
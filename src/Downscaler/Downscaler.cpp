@@ -1,9 +1,12 @@
 #include <boost/scoped_ptr.hpp>
 #include <cmath>
+#include <algorithm>
 
 #include "Downscaler.h"
 #include "../File/File.h"
 #include "../KDTree.h"
+#include "../DiskCache.h"
+#include "../Projection.h"
 
 std::map<Uuid, std::map<Uuid, std::pair<vec2Int, vec2Int> > > Downscaler::mNeighbourCache;
 
@@ -102,6 +105,24 @@ void Downscaler::getNearestNeighbour(const File& iFrom, const File& iTo, vec2Int
        return;
    }
 
+   // Check if a previous run has stored the nearest neighbours on disk
+   std::string key;
+   if(DiskCache::isEnabled()) {
+      std::vector<uint64_t> hashes;
+      hashes.push_back(iFrom.getUniqueTag());
+      hashes.push_back(iTo.getUniqueTag());
+      key = DiskCache::getKey("nearest", hashes);
+      std::vector<std::vector<int> > ints;
+      std::vector<std::vector<float> > floats;
+      if(DiskCache::read(key, ints, floats) && ints.size() == 2 &&
+            unflatten(ints[0], iTo.getNumY(), iTo.getNumX(), iI) &&
+            unflatten(ints[1], iTo.getNumY(), iTo.getNumX(), iJ)) {
+         Util::info("Nearest neighbours read from cache");
+         addToCache(iFrom, iTo, iI, iJ);
+         return;
+      }
+   }
+
    vec2 ilats = iFrom.getLats();
    vec2 ilons = iFrom.getLons();
    vec2 olats = iTo.getLats();
@@ -129,79 +150,49 @@ void Downscaler::getNearestNeighbour(const File& iFrom, const File& iTo, vec2Int
          return;
       }
    }
-   // Check if the grid is regular lat/lon
-   bool checkRegular = false;
-   if(checkRegular) {
-      bool isRegular = true;
-      for(int y = 0; y < iFrom.getNumY(); y++) {
-         for(int x = 0; x < iFrom.getNumX(); x++) {
-            if(ilats[y][x] != ilats[y][0])
-               isRegular = false;
-            if(ilons[y][x] != ilons[0][x])
-               isRegular = false;
-         }
-         if(!isRegular)
-            break;
-      }
-      if(isRegular) {
-         Util::info("Input grid is regular lat/lon, short cut in finding nearest neighbours");
-         iI.resize(nLat);
-         iJ.resize(nLat);
-
-         std::vector<float> lats;
-         std::vector<float> lons;
-         lats.resize(iFrom.getNumY());
-         lons.resize(iFrom.getNumX());
-         for(int i = 0; i < iFrom.getNumY(); i++) {
-            lats[i] = ilats[i][0];
-         }
-         for(int j = 0; j < iFrom.getNumX(); j++) {
-            lons[j] = ilons[0][j];
-         }
+   // Compute the indices directly if the input grid has a known projection. Only points outside
+   // the input grid need to be searched for.
+   const Projection* projection = iFrom.getProjection();
+   if(projection != NULL) {
+      Util::info("Input grid has a known projection, short cut in finding nearest neighbours");
+      getNearestNeighbourFromProjection(*projection, ilats, ilons, olats, olons, iI, iJ);
 
-         for(int i = 0; i < nLat; i++) {
-            iI[i].resize(nLon, Util::MV);
-            iJ[i].resize(nLon, Util::MV);
-            for(int j = 0; j < nLon; j++) {
-               if(Util::isValid(olats[i][j]) && Util::isValid(olons[i][j])) {
-                  int iNearest = Util::MV;
-                  int jNearest = Util::MV;
-                  float iMinDist = 1e9;
-                  for(int ii = 0; ii < lats.size(); ii++) {
-                     if(Util::isValid(lats[ii])) {
-                        float dist = fabs(lats[ii] - olats[i][j]);
-                        if(dist < iMinDist) {
-                           iMinDist = dist;
-                           iNearest = ii;
-                        }
-                     }
-                  }
-                  float jMinDist = 1e9;
-                  for(int jj = 0; jj < lons.size(); jj++) {
-                     if(Util::isValid(lons[jj])) {
-                        float dist = fabs(lons[jj] - olons[i][j]);
-                        if(dist < jMinDist) {
-                           jMinDist = dist;
-                           jNearest = jj;
-                        }
-                     }
-                  }
-                  if(Util::isValid(iNearest) && Util::isValid(jNearest)) {
-                     iI[i][j] = iNearest;
-                     iJ[i][j] = jNearest;
-                  }
-               }
+      std::vector<float> outsideLats, outsideLons;
+      std::vector<int> outsideIndices;
+      for(int i = 0; i < nLat; i++) {
+         for(int j = 0; j < nLon; j++) {
+            if(!Util::isValid(iI[i][j]) && Util::isValid(olats[i][j]) && Util::isValid(olons[i][j])) {
+               outsideLats.push_back(olats[i][j]);
+               outsideLons.push_back(olons[i][j]);
+               outsideIndices.push_back(i * nLon + j);
             }
          }
-         addToCache(iFrom, iTo, iI, iJ);
-         return;
       }
+      if(outsideIndices.size() > 0) {
+         KDTree searchTree(ilats, ilons, KDTree::TypeCartesian);
+         std::vector<int> I, J;
+         searchTree.getNearestNeighbour(outsideLats, outsideLons, I, J);
+         for(int k = 0; k < outsideIndices.size(); k++) {
+            int i = outsideIndices[k] / nLon;
+            int j = outsideIndices[k] % nLon;
+            iI[i][j] = I[k];
+            iJ[i][j] = J[k];
+         }
+      }
+      addToCache(iFrom, iTo, iI, iJ);
+      return;
    }
 
-   KDTree searchTree(iFrom.getLats(), iFrom.getLons());
+   KDTree searchTree(iFrom.getLats(), iFrom.getLons(), KDTree::TypeCartesian);
    searchTree.getNearestNeighbour(iTo, iI, iJ);
 
    addToCache(iFrom, iTo, iI, iJ);
+   if(DiskCache::isEnabled()) {
+      std::vector<std::vector<int> > ints;
+      ints.push_back(flatten(iI));
+      ints.push_back(flatten(iJ));
+      DiskCache::write(key, ints, std::vector<std::vector<float> >());
+   }
 }
 
 bool Downscaler::isCached(const File& iFrom, const File& iTo) {
@@ -266,4 +257,88 @@ std::string Downscaler::getDescriptions(bool full) {
 
 void Downscaler::clearCache() {
    mNeighbourCache.clear();
+   DownscalerBilinear::clearCache();
+}
+
+void Downscaler::getNearestNeighbourFromProjection(const Projection& iProjection, const vec2& iInputLats, const vec2& iInputLons,
+      const vec2& iOutputLats, const vec2& iOutputLons, vec2Int& iI, vec2Int& iJ) {
+   int nY = iProjection.getNumY();
+   int nX = iProjection.getNumX();
+   int nLat = iOutputLats.size();
+   int nLon = nLat > 0 ? iOutputLats[0].size() : 0;
+   iI.resize(nLat);
+   iJ.resize(nLat);
+
+   #pragma omp parallel for
+   for(int i = 0; i < nLat; i++) {
+      iI[i].assign(nLon, Util::MV);
+      iJ[i].assign(nLon, Util::MV);
+      for(int j = 0; j < nLon; j++) {
+         float lat = iOutputLats[i][j];
+         float lon = iOutputLons[i][j];
+         float fI, fJ;
+         if(!iProjection.getIndex(lat, lon, fI, fJ))
+            continue;
+         if(fI < -0.5 || fI > nY - 0.5 || fJ < -0.5 || fJ > nX - 0.5)
+            continue;
+         int I = std::min(std::max((int) floor(fI + 0.5), 0), nY - 1);
+         int J = std::min(std::max((int) floor(fJ + 0.5), 0), nX - 1);
+
+         // The closest point in projected coordinates is not always the closest on the sphere, so
+         // move to any closer neighbour until none are closer
+         float coslat = cos(Util::deg2rad(lat));
+         float minDist = getApproxDistance(lat, lon, coslat, iInputLats[I][J], iInputLons[I][J]);
+         for(int iter = 0; iter < nY + nX; iter++) {
+            int bestI = I;
+            int bestJ = J;
+            for(int ii = std::max(I - 1, 0); ii <= std::min(I + 1, nY - 1); ii++) {
+               for(int jj = std::max(J - 1, 0); jj <= std::min(J + 1, nX - 1); jj++) {
+                  float dist = getApproxDistance(lat, lon, coslat, iInputLats[ii][jj], iInputLons[ii][jj]);
+                  if(dist < minDist) {
+                     minDist = dist;
+                     bestI = ii;
+                     bestJ = jj;
+                  }
+               }
+            }
+            if(bestI == I && bestJ == J)
+               break;
+            I = bestI;
+            J = bestJ;
+         }
+         iI[i][j] = I;
+         iJ[i][j] = J;
+      }
+   }
+}
+
+float Downscaler::getApproxDistance(float iLat, float iLon, float iCosLat, float iOtherLat, float iOtherLon) {
+   if(!Util::isValid(iOtherLat) || !Util::isValid(iOtherLon))
+      return 1e30;
+   float dlat = iOtherLat - iLat;
+   float dlon = iOtherLon - iLon;
+   if(dlon > 180)
+      dlon -= 360;
+   else if(dlon < -180)
+      dlon += 360;
+   dlon *= iCosLat;
+   return dlat * dlat + dlon * dlon;
+}
+
+std::vector<int> Downscaler::flatten(const vec2Int& iArray) {
+   std::vector<int> array;
+   for(int i = 0; i < iArray.size(); i++) {
+      array.insert(array.end(), iArray[i].begin(), iArray[i].end());
+   }
+   return array;
+}
+
+bool Downscaler::unflatten(const std::vector<int>& iArray, int iNumY, int iNumX, vec2Int& iOutput) {
+   if(iArray.size() != iNumY * iNumX)
+      return false;
+   iOutput.resize(iNumY);
+   for(int i = 0; i < iNumY; i++) {
+      iOutput[i].assign(iArray.begin() + i * iNumX, iArray.begin() + (i + 1) * iNumX);
+   }
+   return true;
 }
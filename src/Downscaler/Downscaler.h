@@ -7,6 +7,7 @@
 #include "../Scheme.h"
 #include "../Uuid.h"
 class File;
+class Projection;
 typedef std::vector<std::vector<int> > vec2Int;
 
 //! Converts fields from one grid to another
@@ -37,10 +38,21 @@ class Downscaler : public Scheme {
       // @param full Give full descriptions, including options
       static std::string getDescriptions(bool full=true);
 
-      //! Clears nearest neighbour cache
+      //! Clears nearest neighbour and interpolation weight caches
       static void clearCache();
    protected:
       virtual void downscaleCore(const File& iInput, File& iOutput) const = 0;
+
+      //! Compute the nearest neighbours using the projection of the input grid. Points outside
+      //! the input grid (by more than half a gridcell) get missing indices.
+      static void getNearestNeighbourFromProjection(const Projection& iProjection, const vec2& iInputLats, const vec2& iInputLons,
+            const vec2& iOutputLats, const vec2& iOutputLons, vec2Int& iI, vec2Int& iJ);
+      //! Squared distance in degrees, with longitudes scaled by iCosLat. Only valid for nearby points.
+      static float getApproxDistance(float iLat, float iLon, float iCosLat, float iOtherLat, float iOtherLon);
+      //! Convert a 2D index array to a flat array, for storage in the disk cache
+      static std::vector<int> flatten(const vec2Int& iArray);
+      //! Convert a flat array back to a 2D index array. Returns false if the size does not match.
+      static bool unflatten(const std::vector<int>& iArray, int iNumY, int iNumX, vec2Int& iOutput);
       Variable mInputVariable;
       Variable mOutputVariable;
    private:
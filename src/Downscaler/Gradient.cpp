@@ -86,22 +86,30 @@ void DownscalerGradient::downscaleCore(const File& iInput, File& iOutput) const
    vec2Int nearestI, nearestJ;
    getNearestNeighbour(iInput, iOutput, nearestI, nearestJ);
 
+   // Elevations and land fractions are the same for all times
+   vec2 elevsInterp;
+   vec2 lafsInterp;
+   SparseMatrix bilinearOperator;
+   if(mDownscalerName == "nearestNeighbour") {
+      elevsInterp = DownscalerNearestNeighbour::downscaleVec(ielevs, ilats, ilons, olats, olons, nearestI, nearestJ);
+      lafsInterp = DownscalerNearestNeighbour::downscaleVec(ilafs, ilats, ilons, olats, olons, nearestI, nearestJ);
+   }
+   else if (mDownscalerName == "bilinear") {
+      DownscalerBilinear::getOperator(iInput, iOutput, nearestI, nearestJ, bilinearOperator);
+      elevsInterp = DownscalerBilinear::downscaleVec(ielevs, bilinearOperator, nearestI, nearestJ);
+      lafsInterp = DownscalerBilinear::downscaleVec(ilafs, bilinearOperator, nearestI, nearestJ);
+   }
+
    for(int t = 0; t < nTime; t++) {
       Field& ifield = *iInput.getField(mInputVariable, t);
       Field& ofield = *iOutput.getField(mOutputVariable, t, true);
       Field& gfield = *iInput.getField(mElevGradientVariableName, t);
 
-      vec2 elevsInterp;
-      vec2 lafsInterp;
       if(mDownscalerName == "nearestNeighbour") {
-         elevsInterp = DownscalerNearestNeighbour::downscaleVec(ielevs, ilats, ilons, olats, olons, nearestI, nearestJ);
-         lafsInterp = DownscalerNearestNeighbour::downscaleVec(ilafs, ilats, ilons, olats, olons, nearestI, nearestJ);
          DownscalerNearestNeighbour::downscaleField(ifield, ofield, ilats, ilons, olats, olons, nearestI, nearestJ);
       }
       else if (mDownscalerName == "bilinear") {
-         elevsInterp = DownscalerBilinear::downscaleVec(ielevs, ilats, ilons, olats, olons, nearestI, nearestJ);
-         lafsInterp = DownscalerBilinear::downscaleVec(ilafs, ilats, ilons, olats, olons, nearestI, nearestJ);
-         DownscalerBilinear::downscaleField(ifield, ofield, ilats, ilons, olats, olons, nearestI, nearestJ);
+         DownscalerBilinear::downscaleField(ifield, ofield, bilinearOperator);
       }
 
       #pragma omp parallel for
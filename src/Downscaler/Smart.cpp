@@ -1,7 +1,9 @@
 #include "Smart.h"
 #include "../File/File.h"
 #include "../Util.h"
+#include "../DiskCache.h"
 #include <math.h>
+#include <iomanip>
 
 DownscalerSmart::DownscalerSmart(const Variable& iInputVariable, const Variable& iOutputVariable, const Options& iOptions) :
       Downscaler(iInputVariable, iOutputVariable, iOptions),
@@ -69,6 +71,23 @@ void DownscalerSmart::getSmartNeighbours(const File& iFrom, const File& iTo, vec
    int nLat    = iTo.getNumY();
    int numSearch = getNumSearchPoints(mRadius);
 
+   // The neighbours depend on the elevations and the settings, in addition to the grids
+   std::string key;
+   if(DiskCache::isEnabled()) {
+      std::vector<uint64_t> hashes;
+      hashes.push_back(Util::hash(ielevs, iFrom.getUniqueTag()));
+      hashes.push_back(Util::hash(oelevs, iTo.getUniqueTag()));
+      std::stringstream ss;
+      // Write the elevation difference at full float precision so that nearby settings get
+      // different keys
+      ss << "smart_" << mRadius << "_" << mNum << "_" << std::setprecision(9) << mMinElevDiff;
+      key = DiskCache::getKey(ss.str(), hashes);
+      if(readFromCache(key, nLat, nLon, iI, iJ)) {
+         Util::info("Smart neighbours read from cache");
+         return;
+      }
+   }
+
    vec2Int Icenter, Jcenter;
    getNearestNeighbour(iFrom, iTo, Icenter, Jcenter);
 
@@ -144,6 +163,51 @@ void DownscalerSmart::getSmartNeighbours(const File& iFrom, const File& iTo, vec
          }
       }
    }
+
+   if(DiskCache::isEnabled()) {
+      writeToCache(key, iI, iJ);
+   }
+}
+
+bool DownscalerSmart::readFromCache(std::string iKey, int iNumY, int iNumX, vec3Int& iI, vec3Int& iJ) {
+   // Stored as the number of neighbours for each point, followed by the I and J of all neighbours
+   std::vector<std::vector<int> > ints;
+   std::vector<std::vector<float> > floats;
+   if(!DiskCache::read(iKey, ints, floats) || ints.size() != 3 || ints[0].size() != iNumY * iNumX)
+      return false;
+   const std::vector<int>& counts = ints[0];
+   int total = 0;
+   for(int n = 0; n < counts.size(); n++)
+      total += counts[n];
+   if(ints[1].size() != total || ints[2].size() != total)
+      return false;
+
+   iI.resize(iNumY);
+   iJ.resize(iNumY);
+   int index = 0;
+   for(int i = 0; i < iNumY; i++) {
+      iI[i].resize(iNumX);
+      iJ[i].resize(iNumX);
+      for(int j = 0; j < iNumX; j++) {
+         int count = counts[i * iNumX + j];
+         iI[i][j].assign(ints[1].begin() + index, ints[1].begin() + index + count);
+         iJ[i][j].assign(ints[2].begin() + index, ints[2].begin() + index + count);
+         index += count;
+      }
+   }
+   return true;
+}
+
+void DownscalerSmart::writeToCache(std::string iKey, const vec3Int& iI, const vec3Int& iJ) {
+   std::vector<std::vector<int> > ints(3);
+   for(int i = 0; i < iI.size(); i++) {
+      for(int j = 0; j < iI[i].size(); j++) {
+         ints[0].push_back(iI[i][j].size());
+         ints[1].insert(ints[1].end(), iI[i][j].begin(), iI[i][j].end());
+         ints[2].insert(ints[2].end(), iJ[i][j].begin(), iJ[i][j].end());
+      }
+   }
+   DiskCache::write(iKey, ints, std::vector<std::vector<float> >());
 }
 
 int DownscalerSmart::getNumSearchPoints() const {
@@ -20,6 +20,8 @@ class DownscalerSmart : public Downscaler {
              int getNumSearchPoints() const;
    private:
       void downscaleCore(const File& iInput, File& iOutput) const;
+      static bool readFromCache(std::string iKey, int iNumY, int iNumX, vec3Int& iI, vec3Int& iJ);
+      static void writeToCache(std::string iKey, const vec3Int& iI, const vec3Int& iJ);
       int mRadius;
       int mNum;
       float mMinElevDiff;
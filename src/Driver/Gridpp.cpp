@@ -8,11 +8,12 @@
 #include "../Util.h"
 #include "../Options.h"
 #include "../Setup.h"
+#include "../DiskCache.h"
 
 void writeUsage(bool full) {
    std::cout << "Post-processes gridded forecasts. For more information see https://github.com/metno/gridpp." << std::endl;
    std::cout << std::endl;
-   std::cout << "usage:  gridpp inputs [options] outputs [options] [-v var [options] [-d downscaler [options] [-p parameters [options]]] [-c calibrator [options] [-p parameters [options]]]*]+ [--debug <level>]" << std::endl;
+   std::cout << "usage:  gridpp inputs [options] outputs [options] [-v var [options] [-d downscaler [options] [-p parameters [options]]] [-c calibrator [options] [-p parameters [options]]]*]+ [--debug <level>] [--cache-dir <dir>]" << std::endl;
    std::cout << "        gridpp [--version]" << std::endl;
    std::cout << "        gridpp [--help]" << std::endl;
    std::cout << std::endl;
@@ -29,6 +30,8 @@ void writeUsage(bool full) {
    std::cout << "   options       Options of the form key=value" << std::endl;
    std::cout << "   --version     Print the program's version" << std::endl;
    std::cout << "   --debug lvl   Set debug level: quiet, error, warn (default), info" << std::endl;
+   std::cout << "   --cache-dir d Store nearest neighbours and interpolation weights in this directory" << std::endl;
+   std::cout << "                 and reuse them in later runs with the same grids." << std::endl;
    std::cout << "   --help        Print usage information including all options" << std::endl;
    std::cout << std::endl;
    std::cout << "Inputs/Outputs:" << std::endl;
@@ -81,6 +84,7 @@ int main(int argc, const char *argv[]) {
    // Retrieve setup
    std::vector<std::string> args;
    std::string debugMode = "warn";
+   std::string cacheDir = "";
    Util::setShowError(true);
    for(int i = 1; i < argc; i++) {
       if(std::string(argv[i]) == "--debug") {
@@ -90,6 +94,13 @@ int main(int argc, const char *argv[]) {
          }
          debugMode = std::string(argv[i]);
       }
+      else if(std::string(argv[i]) == "--cache-dir") {
+         i++;
+         if(argc <= i) {
+            Util::error("Missing cache directory");
+         }
+         cacheDir = std::string(argv[i]);
+      }
       else {
          args.push_back(std::string(argv[i]));
       }
@@ -116,6 +127,8 @@ int main(int argc, const char *argv[]) {
    else if(debugMode == "info") {
    }
 
+   DiskCache::setDirectory(cacheDir);
+
 #ifdef _OPENMP
    std::cout << "Number of OMP threads: " << omp_get_max_threads() << std::endl;
 #endif
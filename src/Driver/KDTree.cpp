@@ -49,5 +49,43 @@ int main(int argc, const char *argv[]) {
    e = Util::clock();
    std::cout << (e - s) / nRepeat << " seconds for points outside domain" << std::endl;
 
+   // Test the 10 nearest points
+   s = Util::clock();
+   for(int i = 0; i < nRepeat; i++) {
+      std::vector<int> I, J;
+      std::vector<float> dist;
+      tree.getKNearest(50, 50, 10, I, J, dist);
+   }
+   e = Util::clock();
+   std::cout << (e - s) / nRepeat << " seconds for 10 nearest points" << std::endl;
+
+   // Test all points within 10 km
+   s = Util::clock();
+   for(int i = 0; i < nRepeat; i++) {
+      std::vector<int> I, J;
+      std::vector<float> dist;
+      tree.getWithinRadius(50, 50, 10000, I, J, dist);
+   }
+   e = Util::clock();
+   std::cout << (e - s) / nRepeat << " seconds for points within 10 km" << std::endl;
+
+   // Test a batch of points covering the domain, with both types of trees
+   std::vector<float> qlats, qlons;
+   for(int i = 0; i < nLat; i++) {
+      for(int j = 0; j < nLon; j++) {
+         qlats.push_back(lats[i][j] + 0.01);
+         qlons.push_back(lons[i][j] + 0.01);
+      }
+   }
+   for(int t = 0; t < 2; t++) {
+      KDTree::Type type = t == 0 ? KDTree::TypeLatLon : KDTree::TypeCartesian;
+      s = Util::clock();
+      KDTree batchTree(lats, lons, type);
+      std::vector<int> I, J;
+      batchTree.getNearestNeighbour(qlats, qlons, I, J);
+      e = Util::clock();
+      std::cout << (e - s) << " seconds for building tree and finding " << qlats.size() << " points (" << (t == 0 ? "latlon" : "cartesian") << ")" << std::endl;
+   }
+
    return 0;
 }
@@ -6,13 +6,15 @@
 #include <cmath>
 #include "../Util.h"
 #include "../Options.h"
-Uuid File::mNextTag = 0;
+#include "../Projection.h"
 
 File::File(std::string iFilename, const Options& iOptions) :
       mFilename(iFilename),
       mHasElevs(false),
-      mReferenceTime(Util::MV) {
-   createNewTag();
+      mReferenceTime(Util::MV),
+      mTag(0),
+      mTagValid(false),
+      mProjectionValid(false) {
 
 }
 
@@ -217,14 +219,17 @@ long File::getCacheSize() const {
 }
 
 Uuid File::getUniqueTag() const {
+   if(!mTagValid) {
+      // Use the normalized longitudes, so that e.g. 350 and -10 give the same tag
+      mTag = Util::hash(mLons, Util::hash(mLats));
+      mTagValid = true;
+   }
    return mTag;
 }
 bool File::setLats(vec2 iLats) {
    bool uninitialized = mLats.size() == 0;
    if(!uninitialized && (iLats.size() != getNumY() || iLats[0].size() != getNumX()))
       return false;
-   if(mLats != iLats)
-      createNewTag();
    mLats = iLats;
 
    // Check that latitudes are valid
@@ -237,14 +242,13 @@ bool File::setLats(vec2 iLats) {
          }
       }
    }
+   invalidateGrid();
    return true;
 }
 bool File::setLons(vec2 iLons) {
    bool uninitialized = mLons.size() == 0;
    if(!uninitialized && (iLons.size() != getNumY() || iLons[0].size() != getNumX()))
       return false;
-   if(mLons != iLons)
-      createNewTag();
    mLons = iLons;
 
    // Check that longitudes are valid
@@ -276,6 +280,7 @@ bool File::setLons(vec2 iLons) {
          }
       }
    }
+   invalidateGrid();
 
    return true;
 }
@@ -332,9 +337,21 @@ int File::getNumEns() const {
 int File::getNumTime() const {
    return mTimes.size();
 }
-void File::createNewTag() const {
-   mTag = mNextTag; //boost::uuids::random_generator()();
-   mNextTag++;
+void File::invalidateGrid() {
+   mTagValid = false;
+   mProjectionValid = false;
+   mProjection.reset();
+}
+const Projection* File::getProjection() const {
+   if(!mProjectionValid) {
+      mProjection.reset(ProjectionLatLon::detect(mLats, mLons));
+      mProjectionValid = true;
+   }
+   return mProjection.get();
+}
+void File::setProjection(Projection* iProjection) {
+   mProjection.reset(iProjection);
+   mProjectionValid = true;
 }
 void File::setReferenceTime(double iTime) {
    mReferenceTime = iTime;
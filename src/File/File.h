@@ -8,6 +8,7 @@
 #include "../Field.h"
 
 class Options;
+class Projection;
 
 // 3D array of data: [y][x][ensemble_member]
 typedef std::vector<std::vector<float> > vec2; // Y, X
@@ -71,11 +72,16 @@ class File {
       //! @return Number of bytes
       long getCacheSize() const;
 
-      //! Returns a tag that uniquely identifies the latitude/longitude grid
-      //! If the grid changes, a new tag is issued. Two files with the same grid
-      //! will not have the same unique tag.
+      //! Returns a tag that identifies the latitude/longitude grid. The tag is a hash of the
+      //! coordinates, computed on first use after the grid is set, so two files with the same
+      //! grid have the same tag. If the grid changes, the tag changes.
       Uuid getUniqueTag() const;
 
+      //! Returns the map projection of the grid, or NULL if not known. With a projection, grid
+      //! indices can be computed directly from lat/lon. Regular lat/lon grids are detected
+      //! automatically. Other projections can be set by subclasses, e.g. from file metadata.
+      const Projection* getProjection() const;
+
       //! Set the time that the file is issued
       //! @ param iTime The number of seconds since 1970-01-01 00:00:00 +00:00
       void setReferenceTime(double iTime);
@@ -95,6 +101,10 @@ class File {
       //! Does the subclass provide this variable without deriving it?
       virtual bool hasVariableCore(const Variable& iVariable) const = 0;
 
+      //! Set the projection of the current lat/lon grid. Takes ownership of iProjection. The
+      //! projection is removed if the grid changes.
+      void setProjection(Projection* iProjection);
+
       // Subclasses must fill these fields in the constructor:
       vec2 mLandFractions;
       int mNEns;
@@ -105,12 +115,17 @@ class File {
    private:
       std::string mFilename;
       mutable std::map<Variable, std::vector<FieldPtr> > mFields;  // Variable, offset
+      //! The tag and projection are computed lazily, since the grid is set in several steps
       mutable Uuid mTag;
-      void createNewTag() const;
+      mutable bool mTagValid;
+      //! Mark the tag and projection as outdated after the lat/lon grid changed. The projection is
+      //! then detected again (regular lat/lon grids only) on next access.
+      void invalidateGrid();
+      mutable boost::shared_ptr<Projection> mProjection;
+      mutable bool mProjectionValid;
       FieldPtr getEmptyField(int nY, int nX, int nEns, float iFillValue=Util::MV) const;
       double mReferenceTime;
       std::vector<double> mTimes;
-      static Uuid mNextTag;
       vec2 mElevs;
       bool mHasElevs;
       vec2 mLats;
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include "../Util.h"
+#include "../Projection.h"
 
 FileNetcdf::FileNetcdf(std::string iFilename, const Options& iOptions, bool iReadOnly) : File(iFilename, iOptions),
       mInDataMode(true)
@@ -113,6 +114,10 @@ FileNetcdf::FileNetcdf(std::string iFilename, const Options& iOptions, bool iRea
       Util::error(ss.str());
    }
 
+   Projection* projection = readProjection();
+   if(projection != NULL)
+      setProjection(projection);
+
    if(Util::isValid(mElevVar)) {
       vec2 elevs = getLatLonVariable(mElevVar);
       for(int i = 0; i < getNumY(); i++) {
@@ -1294,6 +1299,106 @@ vec2 FileNetcdf::getLatLonVariable(int iVar) const {
    return grid;
 }
 
+Projection* FileNetcdf::readProjection() {
+   // Find the grid mapping used by the data variables
+   int numVars = Util::MV;
+   int status = nc_inq_nvars(mFile, &numVars);
+   handleNetcdfError(status, "could not get number of variables");
+   std::string gridMapping = "";
+   for(int v = 0; v < numVars && gridMapping == ""; v++) {
+      gridMapping = getAttribute(v, "grid_mapping");
+   }
+   if(gridMapping == "" || !hasVar(gridMapping))
+      return NULL;
+
+   int var = getVar(gridMapping);
+   std::string name = getAttribute(var, "grid_mapping_name");
+   Projection* projection = NULL;
+   if(name == "lambert_conformal_conic") {
+      std::vector<double> parallels, centralLon, originLat, radius, falseEasting, falseNorthing;
+      if(!getNumericAttribute(var, "standard_parallel", parallels) || parallels.size() < 1 ||
+            !getNumericAttribute(var, "longitude_of_central_meridian", centralLon) ||
+            !getNumericAttribute(var, "latitude_of_projection_origin", originLat)) {
+         Util::warning("Incomplete lambert_conformal_conic grid mapping in " + getFilename());
+         return NULL;
+      }
+      if(parallels.size() == 1)
+         parallels.push_back(parallels[0]);
+      if(!getNumericAttribute(var, "earth_radius", radius) && !getNumericAttribute(var, "semi_major_axis", radius))
+         radius.push_back(Util::radiusEarth);
+      if(!getNumericAttribute(var, "false_easting", falseEasting))
+         falseEasting.push_back(0);
+      if(!getNumericAttribute(var, "false_northing", falseNorthing))
+         falseNorthing.push_back(0);
+      projection = new ProjectionLambert(parallels[0], parallels[1], centralLon[0], originLat[0], radius[0], falseEasting[0], falseNorthing[0]);
+   }
+   else {
+      // Regular lat/lon grids are detected from the lats/lons
+      return NULL;
+   }
+
+   double x0, dx, y0, dy;
+   if(!Util::isValid(mXDim) || !Util::isValid(mYDim) || !getEvenlySpacedAxis(mXDim, x0, dx) || !getEvenlySpacedAxis(mYDim, y0, dy)) {
+      delete projection;
+      return NULL;
+   }
+   projection->setAxes(getNumY(), y0, dy, getNumX(), x0, dx);
+
+   // Only use the projection if it reproduces the lats/lons in the file
+   if(!projection->isConsistent(getLats(), getLons())) {
+      Util::warning("Grid mapping '" + name + "' in " + getFilename() + " does not match the latitudes and longitudes. Not used.");
+      delete projection;
+      return NULL;
+   }
+   return projection;
+}
+
+bool FileNetcdf::getNumericAttribute(int iVar, std::string iName, std::vector<double>& iValues) const {
+   nc_type type;
+   size_t len;
+   int status = nc_inq_att(mFile, iVar, iName.c_str(), &type, &len);
+   if(status != NC_NOERR || type == NC_CHAR || len == 0)
+      return false;
+   iValues.resize(len);
+   status = nc_get_att_double(mFile, iVar, iName.c_str(), &iValues[0]);
+   return status == NC_NOERR;
+}
+
+bool FileNetcdf::getEvenlySpacedAxis(int iDim, double& iStart, double& iSpacing) {
+   std::string name = getDimName(iDim);
+   if(!hasVar(name))
+      return false;
+   int var = getVar(name);
+   std::vector<int> dims = getDims(var);
+   if(dims.size() != 1 || dims[0] != iDim)
+      return false;
+   int size = getDimSize(iDim);
+   if(size < 2)
+      return false;
+   std::vector<double> values(size);
+   int status = nc_get_var_double(mFile, var, &values[0]);
+   if(status != NC_NOERR)
+      return false;
+
+   // Projected coordinates are used in meters
+   std::string units = getAttribute(var, "units");
+   double scale = 1;
+   if(units == "km")
+      scale = 1000;
+   else if(units != "m" && units != "metre" && units != "meter" && units != "meters" && units != "")
+      return false;
+
+   iStart = values[0] * scale;
+   iSpacing = (values[size-1] - values[0]) / (size - 1) * scale;
+   if(iSpacing == 0)
+      return false;
+   for(int i = 0; i < size; i++) {
+      if(fabs(values[i] * scale - (iStart + i * iSpacing)) > 0.01 * fabs(iSpacing))
+         return false;
+   }
+   return true;
+}
+
 int FileNetcdf::getDim(std::string iDim) const {
    int dim;
    int status = nc_inq_dimid(mFile, iDim.c_str(), &dim);
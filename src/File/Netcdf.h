@@ -6,6 +6,7 @@
 #include "File.h"
 #include "../Variable.h"
 #include "../Options.h"
+class Projection;
 
 //! Represents an ensemble Netcdf data file from ECMWF
 //! Must have:
@@ -104,6 +105,14 @@ class FileNetcdf : public File {
       void writeReferenceTime();
       bool hasDim(std::string iDim) const;
       vec2 getLatLonVariable(int iVariable) const;
+      //! Create a projection from the CF grid_mapping attributes and the x/y coordinate variables.
+      //! Returns NULL if the file does not have a supported grid mapping.
+      Projection* readProjection();
+      //! Get a numeric attribute. Returns false if the attribute does not exist or is not numeric.
+      bool getNumericAttribute(int iVar, std::string iName, std::vector<double>& iValues) const;
+      //! Get the values of the coordinate variable for a dimension, if it is evenly spaced.
+      //! Returns false if the dimension does not have such a variable.
+      bool getEvenlySpacedAxis(int iDim, double& iStart, double& iSpacing);
       static bool hasDim(int iFile, std::string iDim);
       const static int mMaxAttributeLength = 100000000;
 
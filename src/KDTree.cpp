@@ -1,34 +1,22 @@
 #include "KDTree.h"
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
-KDTree::KDTree() : mRoot(NULL) {
+KDTree::KDTree(Type iType) :
+      mType(iType),
+      mNumDims(iType == TypeCartesian ? 3 : 2) {
 }
 
-KDTree::KDTree(const vec2& iLats, const vec2& iLons) {
+KDTree::KDTree(const vec2& iLats, const vec2& iLons, Type iType) :
+      mType(iType),
+      mNumDims(iType == TypeCartesian ? 3 : 2) {
    build(iLats, iLons);
 }
 
-KDTree& KDTree::operator=(KDTree other) {
-   std::swap(mLats, other.mLats);
-   std::swap(mLons, other.mLons);
-
-   mRoot.swap(other.mRoot);
-
-   return *this;
-}
-
-KDTree::KDTree(const KDTree& other) {
-   if(other.mRoot != NULL) {
-      mLats = other.mLats;
-      mLons = other.mLons;
-      mRoot.reset(new KDTree::TreeNode(*other.mRoot));
-   }
-}
-
 void KDTree::build(const vec2& iLats, const vec2& iLons) {
-   mLats = iLats;
-   mLons = iLons;
+   mNodes.clear();
    if(iLats.size() != iLons.size())
       Util::error("Cannot initialize KDTree, lats and lons not the same size");
 
@@ -40,153 +28,215 @@ void KDTree::build(const vec2& iLats, const vec2& iLons) {
    if(nLon == 0)
       Util::error("Cannot initialize KDTree, no valid locations");
 
-   indexdVec lons(nLon*nLat);
-
-   indexdVec::iterator currLon = lons.begin();
-   size_t to = -1;
+   mNodes.reserve(nLon*nLat);
    for(size_t i = 0; i < iLats.size(); ++i) {
      for(size_t j = 0; j < iLats[0].size(); ++j) {
         if(Util::isValid(iLons[i][j]) && Util::isValid(iLats[i][j])) {
-           *(currLon++) = Indexed(iLons[i][j], iLats[i][j], i, j);
-           ++to;
+           TreeNode node;
+           setCoord(iLats[i][j], iLons[i][j], node.coord);
+           node.ipos = i;
+           node.jpos = j;
+           mNodes.push_back(node);
         }
      }
    }
 
-   if(to == -1) {
+   if(mNodes.size() == 0) {
       Util::error("Cannot initialize KDTree, no valid locations");
    }
-   if(to >= 0) subTree(lons, 0, to, true, NULL, mRoot);
+   subTree(0, mNodes.size() - 1, 0);
 }
 
-bool compareLons (const KDTree::Indexed& l, const KDTree::Indexed& r){ return (l.lon < r.lon); }
-bool compareLats (const KDTree::Indexed& l, const KDTree::Indexed& r){ return (l.lat < r.lat); }
-
-void KDTree::subTree(indexdVec& iLonLat,
-                     const size_t from,
-                     const size_t to,
-                     const bool xsection,
-                     const TreeNode* parent,
-                     unode& root) {
+void KDTree::subTree(const int from, const int to, const int dim) {
+   // Small ranges are left unsorted and searched linearly
+   if(to - from < mLeafSize)
+      return;
 
-   root.reset(new KDTree::TreeNode());
+   // Place the median at its sorted position, with smaller-or-equal values before it and
+   // larger-or-equal values after it. A partial sort is sufficient for this.
+   int med = from + (to - from + 1)/2;
+   std::nth_element(mNodes.begin() + from, mNodes.begin() + med, mNodes.begin() + to + 1, CompareCoord(dim));
 
-   root->parent = parent;
-   root->xsection = xsection;
+   int next = (dim + 1) % mNumDims;
+   subTree(from, med - 1, next);
+   subTree(med + 1, to, next);
+}
 
-   size_t len = to - from + 1;
+void KDTree::setCoord(float iLat, float iLon, float iCoord[3]) const {
+   if(mType == TypeCartesian) {
+      double latr = Util::deg2rad(iLat);
+      double lonr = Util::deg2rad(iLon);
+      iCoord[0] = cos(latr) * cos(lonr);
+      iCoord[1] = cos(latr) * sin(lonr);
+      iCoord[2] = sin(latr);
+   }
+   else {
+      iCoord[0] = iLon;
+      iCoord[1] = iLat;
+      iCoord[2] = 0;
+   }
+}
 
-   if(len == 1) {
-      root->lon = iLonLat[from].lon;
-      root->lat = iLonLat[from].lat;
-      root->ipos = iLonLat[from].index1;
-      root->jpos = iLonLat[from].index2;
-      return;
+float KDTree::distanceKey(const TreeNode& iNode, const float iCoord[3]) const {
+   if(mType == TypeCartesian) {
+      float dx = iNode.coord[0] - iCoord[0];
+      float dy = iNode.coord[1] - iCoord[1];
+      float dz = iNode.coord[2] - iCoord[2];
+      return dx*dx + dy*dy + dz*dz;
    }
+   return Util::getDistance(iCoord[1], iCoord[0], iNode.coord[1], iNode.coord[0]);
+}
 
-   size_t med = from + len/2;
-   if(xsection) {
-      std::sort(iLonLat.begin() + from, iLonLat.begin() + to + 1, compareLons);
-      while(med < to && iLonLat[med].lon == iLonLat[med+1].lon) {
-         assert(iLonLat.size() > med+1);
-         ++med;
-      }
+float KDTree::splitKey(const TreeNode& iNode, int iDim, const float iCoord[3]) const {
+   if(mType == TypeCartesian) {
+      // Points on the other side of the plane are at least this far away along one axis
+      float d = iNode.coord[iDim] - iCoord[iDim];
+      return d*d;
+   }
+   else if(iDim == 0) {
+      // Shortest distance to the meridian through the node
+      float dlon = std::fabs(iCoord[0] - iNode.coord[0]);
+      if(dlon >= 90)
+         return 0;
+      float ratio = cos(Util::deg2rad(iCoord[1])) * sin(Util::deg2rad(dlon));
+      return Util::radiusEarth * asin(std::min(1.0f, std::fabs(ratio)));
    }
    else {
-      std::sort(iLonLat.begin() + from, iLonLat.begin() + to + 1, compareLats);
-      while(med < to && iLonLat[med].lat == iLonLat[med+1].lat) {
-         assert(iLonLat.size() > med+1);
-         ++med;
-      }
+      // Shortest distance to the latitude circle through the node is along the meridian
+      return Util::radiusEarth * Util::deg2rad(std::fabs(iCoord[1] - iNode.coord[1]));
    }
-
-   root->lon = iLonLat[med].lon;
-   root->lat = iLonLat[med].lat;
-   root->ipos = iLonLat[med].index1;
-   root->jpos = iLonLat[med].index2;
-
-   if(med > from) subTree(iLonLat, from, med - 1, !xsection, root.get(), root->left);
-   if(med < to) subTree(iLonLat, med + 1, to, !xsection, root.get(), root->right);
-
 }
 
-const KDTree::TreeNode* KDTree::firstGuess(const unode& root, const float lon, const float lat) {
-   if(root->xsection){
-      if(lon <= root->lon) {
-         if(root->left) return firstGuess(root->left, lon, lat);
-      } else {
-         if(root->right) return firstGuess(root->right, lon, lat);
-      }
-   } else {
-      if(lat <= root->lat) {
-         if(root->left) return firstGuess(root->left, lon, lat);
-      } else {
-         if(root->right) return firstGuess(root->right, lon, lat);
-      }
+float KDTree::keyToDistance(float iKey) const {
+   if(mType == TypeCartesian) {
+      // Convert the chord length to an arc length
+      float chord = sqrt(iKey);
+      return 2 * Util::radiusEarth * asin(std::min(1.0f, chord / 2));
    }
-   return root.get();
+   return iKey;
 }
 
-const KDTree::queryRes KDTree::nearestNeighbour(const unode& root, const float lon, const float lat, const float oldBest) {
-
-   const TreeNode * nearLeaf = firstGuess(root, lon, lat);
-
-   float currBest = oldBest;
-   float refinedBest = oldBest;
-
-   const TreeNode * currentLeaf = nearLeaf;
-   const TreeNode * nearestLeaf = nearLeaf;
-
-   while (currentLeaf) {
-      float dist = Util::getDistance(lat, lon, currentLeaf->lat, currentLeaf->lon);
+float KDTree::distanceToKey(float iDistance) const {
+   if(mType == TypeCartesian) {
+      // Covers the whole sphere, including antipodal points
+      if(iDistance >= Util::pi * Util::radiusEarth)
+         return 5;
+      float chord = 2 * sin(iDistance / Util::radiusEarth / 2);
+      return chord * chord;
+   }
+   return iDistance;
+}
 
-      if(dist < currBest) {
-         currBest = dist;
-         nearestLeaf = currentLeaf;
+void KDTree::nearestNeighbour(const int from, const int to, const int dim, const float coord[3], queryRes& iBest) const {
+   if(to - from < mLeafSize) {
+      for(int n = from; n <= to; n++) {
+         float dist = distanceKey(mNodes[n], coord);
+         if(dist < iBest.first) {
+            iBest.first = dist;
+            iBest.second = n;
+         }
       }
+      return;
+   }
+   int med = from + (to - from + 1)/2;
+   const TreeNode& node = mNodes[med];
 
-      bool cross;
-      if(currentLeaf->xsection) {
-         cross = Util::getDistance(lat, lon, lat, currentLeaf->lon) < currBest;
-      } else {
-         cross = Util::getDistance(lat, lon, currentLeaf->lat, lon) < currBest;
-      }
+   float dist = distanceKey(node, coord);
+   if(dist < iBest.first) {
+      iBest.first = dist;
+      iBest.second = med;
+   }
 
-      if(cross) {
-         queryRes refineRes;
-         if(currentLeaf->left.get() == nearLeaf) {
-            nearLeaf = NULL;
-            if(currentLeaf->right) {
-               refineRes = nearestNeighbour( currentLeaf->right, lon, lat, currBest);
-               nearLeaf = refineRes.first;
-               refinedBest = refineRes.second;
-            }
-         } else {
-            nearLeaf = NULL;
-            if(currentLeaf->left) {
-               refineRes = nearestNeighbour(currentLeaf->left, lon, lat, currBest);
-               nearLeaf = refineRes.first;
-               refinedBest = refineRes.second;
-            }
-         }
+   int next = (dim + 1) % mNumDims;
+   bool goLeft = coord[dim] <= node.coord[dim];
+   if(goLeft) {
+      nearestNeighbour(from, med - 1, next, coord, iBest);
+      if(med < to && splitKey(node, dim, coord) < iBest.first)
+         nearestNeighbour(med + 1, to, next, coord, iBest);
+   }
+   else {
+      nearestNeighbour(med + 1, to, next, coord, iBest);
+      if(med > from && splitKey(node, dim, coord) < iBest.first)
+         nearestNeighbour(from, med - 1, next, coord, iBest);
+   }
+}
 
-         if(nearLeaf) {
-            if(refinedBest < currBest) {
-               currBest = refinedBest;
-               nearestLeaf = nearLeaf;
-            }
-         }
+void KDTree::kNearest(const int from, const int to, const int dim, const float coord[3], const int k, std::vector<queryRes>& iHeap) const {
+   if(to - from < mLeafSize) {
+      for(int n = from; n <= to; n++) {
+         addToHeap(queryRes(distanceKey(mNodes[n], coord), n), k, iHeap);
       }
+      return;
+   }
+   int med = from + (to - from + 1)/2;
+   const TreeNode& node = mNodes[med];
+   addToHeap(queryRes(distanceKey(node, coord), med), k, iHeap);
+
+   int next = (dim + 1) % mNumDims;
+   bool goLeft = coord[dim] <= node.coord[dim];
+   if(goLeft)
+      kNearest(from, med - 1, next, coord, k, iHeap);
+   else
+      kNearest(med + 1, to, next, coord, k, iHeap);
+
+   if((int) iHeap.size() < k || splitKey(node, dim, coord) < iHeap.front().first) {
+      if(goLeft)
+         kNearest(med + 1, to, next, coord, k, iHeap);
+      else
+         kNearest(from, med - 1, next, coord, k, iHeap);
+   }
+}
 
-      nearLeaf = currentLeaf;
-      if(currentLeaf == root.get()) {
-         currentLeaf = NULL;
-      } else {
-         currentLeaf = currentLeaf->parent;
+void KDTree::addToHeap(const queryRes& iCandidate, const int k, std::vector<queryRes>& iHeap) {
+   // iHeap is a max-heap on distance, holding the best k candidates found so far
+   if((int) iHeap.size() < k) {
+      iHeap.push_back(iCandidate);
+      std::push_heap(iHeap.begin(), iHeap.end());
+   }
+   else if(iCandidate.first < iHeap.front().first) {
+      std::pop_heap(iHeap.begin(), iHeap.end());
+      iHeap.back() = iCandidate;
+      std::push_heap(iHeap.begin(), iHeap.end());
+   }
+}
+
+void KDTree::withinRadius(const int from, const int to, const int dim, const float coord[3], const float radius, std::vector<queryRes>& iResults) const {
+   if(to - from < mLeafSize) {
+      for(int n = from; n <= to; n++) {
+         float dist = distanceKey(mNodes[n], coord);
+         if(dist <= radius)
+            iResults.push_back(queryRes(dist, n));
       }
+      return;
    }
+   int med = from + (to - from + 1)/2;
+   const TreeNode& node = mNodes[med];
+
+   float dist = distanceKey(node, coord);
+   if(dist <= radius)
+      iResults.push_back(queryRes(dist, med));
+
+   int next = (dim + 1) % mNumDims;
+   bool goLeft = coord[dim] <= node.coord[dim];
+   bool cross = splitKey(node, dim, coord) <= radius;
+   if(goLeft || cross)
+      withinRadius(from, med - 1, next, coord, radius, iResults);
+   if(!goLeft || cross)
+      withinRadius(med + 1, to, next, coord, radius, iResults);
+}
 
-   return std::make_pair(nearestLeaf, currBest);
+void KDTree::unpack(std::vector<queryRes>& iResults, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const {
+   std::sort(iResults.begin(), iResults.end());
+   int N = iResults.size();
+   iI.resize(N);
+   iJ.resize(N);
+   iDistances.resize(N);
+   for(int n = 0; n < N; n++) {
+      const TreeNode& node = mNodes[iResults[n].second];
+      iI[n] = node.ipos;
+      iJ[n] = node.jpos;
+      iDistances[n] = keyToDistance(iResults[n].first);
+   }
 }
 
 void KDTree::getNearestNeighbour(const File& iTo, vec2Int& iI, vec2Int& iJ) const {
@@ -196,39 +246,137 @@ void KDTree::getNearestNeighbour(const File& iTo, vec2Int& iI, vec2Int& iJ) cons
    size_t nLon = iTo.getNumX();
    size_t nLat = iTo.getNumY();
 
+   // Flatten the output grid and search for all points in one batch
+   std::vector<float> lats(nLat * nLon);
+   std::vector<float> lons(nLat * nLon);
+   for(size_t i = 0; i < nLat; ++i) {
+      for(size_t j = 0; j < nLon; ++j) {
+         lats[i * nLon + j] = olats[i][j];
+         lons[i * nLon + j] = olons[i][j];
+      }
+   }
+   std::vector<int> I, J;
+   getNearestNeighbour(lats, lons, I, J);
+
    iI.resize(nLat);
    iJ.resize(nLat);
+   for(size_t i = 0; i < nLat; ++i) {
+      iI[i].assign(I.begin() + i * nLon, I.begin() + (i + 1) * nLon);
+      iJ[i].assign(J.begin() + i * nLon, J.begin() + (i + 1) * nLon);
+   }
+}
 
-   if(!mRoot) {
-      for(size_t i = 0; i < nLat; ++i) {
-         iI[i].resize(nLon, Util::MV);
-         iJ[i].resize(nLon, Util::MV);
-      }
+void KDTree::getNearestNeighbour(const std::vector<float>& iLats, const std::vector<float>& iLons, std::vector<int>& iI, std::vector<int>& iJ) const {
+   if(iLats.size() != iLons.size())
+      Util::error("Cannot find nearest neighbours, lats and lons not the same size");
+
+   int N = iLats.size();
+   iI.clear();
+   iJ.clear();
+   iI.resize(N, Util::MV);
+   iJ.resize(N, Util::MV);
+   if(mNodes.size() == 0)
       return;
-   }
 
-   const TreeNode * nearest;
+   // Bounding box of the valid query points
+   float minLat = std::numeric_limits<float>::max();
+   float maxLat = -std::numeric_limits<float>::max();
+   float minLon = std::numeric_limits<float>::max();
+   float maxLon = -std::numeric_limits<float>::max();
+   for(int n = 0; n < N; n++) {
+      if(Util::isValid(iLats[n]) && Util::isValid(iLons[n])) {
+         minLat = std::min(minLat, iLats[n]);
+         maxLat = std::max(maxLat, iLats[n]);
+         minLon = std::min(minLon, iLons[n]);
+         maxLon = std::max(maxLon, iLons[n]);
+      }
+   }
 
-   for(size_t i = 0; i < nLat; ++i) {
-      iI[i].resize(nLon, Util::MV);
-      iJ[i].resize(nLon, Util::MV);
+   // Order the points along a Morton curve so that consecutive searches are for nearby points
+   float latScale = maxLat > minLat ? 65535 / (maxLat - minLat) : 0;
+   float lonScale = maxLon > minLon ? 65535 / (maxLon - minLon) : 0;
+   std::vector<std::pair<unsigned int, int> > order;
+   order.reserve(N);
+   for(int n = 0; n < N; n++) {
+      if(Util::isValid(iLats[n]) && Util::isValid(iLons[n])) {
+         unsigned int x = (iLons[n] - minLon) * lonScale;
+         unsigned int y = (iLats[n] - minLat) * latScale;
+         order.push_back(std::pair<unsigned int, int>(getMortonCode(x, y), n));
+      }
    }
-   #pragma omp parallel for private(nearest)
-   for(size_t i = 0; i < nLat; ++i) {
-      for(size_t j = 0; j < nLon; ++j) {
-         if(Util::isValid(olats[i][j]) && Util::isValid(olons[i][j])) {
-            // Find the nearest neighbour from input grid (ii, jj)
-            nearest = nearestNeighbour(mRoot, olons[i][j], olats[i][j], std::numeric_limits<float>::infinity()).first;
-            iI[i][j] = nearest->ipos;
-            iJ[i][j] = nearest->jpos;
-         }
+   std::sort(order.begin(), order.end());
+
+   int M = order.size();
+   #pragma omp parallel
+   {
+      // The nearest node found for the previous point searched by this thread
+      int prev = Util::MV;
+      #pragma omp for schedule(static)
+      for(int m = 0; m < M; m++) {
+         int n = order[m].second;
+         float coord[3];
+         setCoord(iLats[n], iLons[n], coord);
+
+         // Any node is an upper bound on the distance. The previous result is usually close.
+         queryRes nearest(std::numeric_limits<float>::infinity(), 0);
+         if(Util::isValid(prev))
+            nearest = queryRes(distanceKey(mNodes[prev], coord), prev);
+         nearestNeighbour(0, mNodes.size() - 1, 0, coord, nearest);
+
+         iI[n] = mNodes[nearest.second].ipos;
+         iJ[n] = mNodes[nearest.second].jpos;
+         prev = nearest.second;
       }
    }
 }
 
+unsigned int KDTree::getMortonCode(unsigned int iX, unsigned int iY) {
+   unsigned int code = 0;
+   for(int b = 0; b < 16; b++) {
+      code |= ((iX >> b) & 1u) << (2 * b);
+      code |= ((iY >> b) & 1u) << (2 * b + 1);
+   }
+   return code;
+}
+
 void KDTree::getNearestNeighbour(float iLat, float iLon, int& iI, int& iJ) const {
-   const TreeNode * nearest = nearestNeighbour(mRoot, iLon, iLat, std::numeric_limits<float>::infinity()).first;
-   iI = nearest->ipos;
-   iJ = nearest->jpos;
-   return;
+   iI = Util::MV;
+   iJ = Util::MV;
+   if(mNodes.size() == 0 || !Util::isValid(iLat) || !Util::isValid(iLon))
+      return;
+   float coord[3];
+   setCoord(iLat, iLon, coord);
+   queryRes nearest(std::numeric_limits<float>::infinity(), 0);
+   nearestNeighbour(0, mNodes.size() - 1, 0, coord, nearest);
+   iI = mNodes[nearest.second].ipos;
+   iJ = mNodes[nearest.second].jpos;
+}
+
+void KDTree::getKNearest(float iLat, float iLon, int iK, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const {
+   std::vector<queryRes> heap;
+   if(mNodes.size() > 0 && iK > 0 && Util::isValid(iLat) && Util::isValid(iLon)) {
+      float coord[3];
+      setCoord(iLat, iLon, coord);
+      heap.reserve(std::min(iK, size()));
+      kNearest(0, mNodes.size() - 1, 0, coord, iK, heap);
+   }
+   unpack(heap, iI, iJ, iDistances);
+}
+
+void KDTree::getWithinRadius(float iLat, float iLon, float iRadius, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const {
+   std::vector<queryRes> results;
+   if(mNodes.size() > 0 && iRadius >= 0 && Util::isValid(iLat) && Util::isValid(iLon)) {
+      float coord[3];
+      setCoord(iLat, iLon, coord);
+      withinRadius(0, mNodes.size() - 1, 0, coord, distanceToKey(iRadius), results);
+   }
+   unpack(results, iI, iJ, iDistances);
+}
+
+int KDTree::size() const {
+   return mNodes.size();
+}
+
+KDTree::Type KDTree::getType() const {
+   return mType;
 }
@@ -1,94 +1,93 @@
 #ifndef KDTREE_H
 #define KDTREE_H
-#include <boost/scoped_ptr.hpp>
 #include <vector>
 #include <utility>
 #include "Util.h"
 #include "File/File.h"
 typedef std::vector<std::vector<int> > vec2Int;
 
+//! A search tree for finding nearby points on a lat/lon grid. The tree is stored implicitly in
+//! a single array: for each range of nodes, the median is the split point, with the left subtree
+//! stored before it and the right subtree after it. No pointers or per-node allocations are used.
 class KDTree {
    public:
-      KDTree();
+      enum Type {
+         //! Split on longitude and latitude, using great-circle distances
+         TypeLatLon = 0,
+         //! Split on x, y, z coordinates on the unit sphere, using chord distances. Correct near the
+         //! poles and across the dateline, and queries do not need any trigonometric functions.
+         TypeCartesian = 10
+      };
+      KDTree(Type iType=TypeLatLon);
       void build(const vec2& iLats, const vec2& iLons);
-      KDTree(const vec2& iLats, const vec2& iLons);
-      KDTree& operator=(KDTree other);
-      KDTree(const KDTree& other);
+      KDTree(const vec2& iLats, const vec2& iLons, Type iType=TypeLatLon);
 
       void getNearestNeighbour(const File& iTo, vec2Int& iI, vec2Int& iJ) const;
+      //! Find the nearest neighbour for a batch of points. The points are processed in the order
+      //! of a space-filling (Morton) curve, spread across threads, and each search starts with the
+      //! result of the previous point as an upper bound on the distance. Missing indices are
+      //! returned for points with missing lat/lon.
+      void getNearestNeighbour(const std::vector<float>& iLats, const std::vector<float>& iLons, std::vector<int>& iI, std::vector<int>& iJ) const;
       // I,J: The indices into the lat/lon grid with the nearest neighbour
       void getNearestNeighbour(float iLat, float iLon, int& iI, int& iJ) const;
 
-   private:
-      struct TreeNode {
-         bool xsection;
-         float lon;
-         float lat;
-         size_t ipos;
-         size_t jpos;
-
-         boost::scoped_ptr<TreeNode> left;
-         boost::scoped_ptr<TreeNode> right;
+      //! Find the iK nearest points, sorted from nearest to furthest. Fewer than iK points are
+      //! returned if the tree does not have that many points.
+      //! @param iI I-indices into the lat/lon grid
+      //! @param iJ J-indices into the lat/lon grid
+      //! @param iDistances Distances (in meters) to each point
+      void getKNearest(float iLat, float iLon, int iK, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const;
 
-         const TreeNode* parent;
+      //! Find all points within iRadius meters, sorted from nearest to furthest
+      //! @param iI I-indices into the lat/lon grid
+      //! @param iJ J-indices into the lat/lon grid
+      //! @param iDistances Distances (in meters) to each point
+      void getWithinRadius(float iLat, float iLon, float iRadius, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const;
 
-         TreeNode(): xsection(false), left(NULL), right(NULL), parent(NULL) {}
-         TreeNode(const TreeNode &other):
-            xsection(other.xsection),
-            lon(other.lon),
-            lat(other.lat),
-            ipos(other.ipos),
-            jpos(other.jpos),
-            left(NULL),
-            right(NULL),
-            parent(NULL) {
+      //! Number of points in the tree
+      int size() const;
+      Type getType() const;
 
-            if(other.left) {
-               left.reset(new TreeNode(*other.left));
-               left->parent = this;
-            }
-
-            if(other.right) {
-               right.reset(new TreeNode(*other.right));
-               right->parent = this;
-            }
-         }
+   private:
+      // Coordinates are lon, lat (and unused) for TypeLatLon and x, y, z for TypeCartesian
+      struct TreeNode {
+         float coord[3];
+         int ipos;
+         int jpos;
       };
-
-      struct Indexed {
-         float lon;
-         float lat;
-         size_t index1;
-         size_t index2;
-
-         Indexed() {}
-         Indexed(const float lon_,
-                 const float lat_,
-                 const size_t index1_,
-                 const size_t index2_):
-            lon(lon_), lat(lat_), index1(index1_), index2(index2_) {}
+      struct CompareCoord {
+         CompareCoord(int iDim) : dim(iDim) {}
+         bool operator()(const TreeNode& l, const TreeNode& r) const { return l.coord[dim] < r.coord[dim]; }
+         int dim;
       };
 
-      typedef boost::scoped_ptr<TreeNode> unode;
-      unode mRoot;
-      vec2 mLats;
-      vec2 mLons;
-
-      friend bool compareLons (const KDTree::Indexed& l, const KDTree::Indexed& r);
-      friend bool compareLats (const KDTree::Indexed& l, const KDTree::Indexed& r);
-      typedef std::vector<Indexed> indexdVec;
-      typedef std::pair<const KDTree::TreeNode*, float> queryRes;
-
-
-      static const queryRes nearestNeighbour(const unode& root, const float lon, const float lat, const float oldBest);
-      static const TreeNode* firstGuess(const unode& root, const float lon, const float lat);
-      static void subTree(indexdVec& iLonLat,
-                          const size_t from,
-                          const size_t to,
-                          const bool xsection,
-                          const TreeNode* parent,
-                          unode& root);
-
+      Type mType;
+      int mNumDims;
+      // Nodes in build order. The subtree covering [from, to] has its root at from + (to-from+1)/2.
+      // Subtrees with at most mLeafSize nodes are not split further.
+      std::vector<TreeNode> mNodes;
+      static const int mLeafSize = 8;
+
+      // Distance key and index into mNodes. The key is the distance in meters for TypeLatLon and
+      // the squared chord distance on the unit sphere for TypeCartesian. Both are monotone in the
+      // great-circle distance.
+      typedef std::pair<float, int> queryRes;
+
+      void setCoord(float iLat, float iLon, float iCoord[3]) const;
+      float distanceKey(const TreeNode& iNode, const float iCoord[3]) const;
+      //! Lower bound of the distance key from the point to any point on the other side of the split
+      float splitKey(const TreeNode& iNode, int iDim, const float iCoord[3]) const;
+      float keyToDistance(float iKey) const;
+      float distanceToKey(float iDistance) const;
+
+      void subTree(const int from, const int to, const int dim);
+      void nearestNeighbour(const int from, const int to, const int dim, const float coord[3], queryRes& iBest) const;
+      void kNearest(const int from, const int to, const int dim, const float coord[3], const int k, std::vector<queryRes>& iHeap) const;
+      static void addToHeap(const queryRes& iCandidate, const int k, std::vector<queryRes>& iHeap);
+      void withinRadius(const int from, const int to, const int dim, const float coord[3], const float radius, std::vector<queryRes>& iResults) const;
+      //! Interleave the bits of two 16-bit integers
+      static unsigned int getMortonCode(unsigned int iX, unsigned int iY);
+      void unpack(std::vector<queryRes>& iResults, std::vector<int>& iI, std::vector<int>& iJ, std::vector<float>& iDistances) const;
 };
 
 #endif
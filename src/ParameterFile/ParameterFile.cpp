@@ -12,6 +12,7 @@ ParameterFile::ParameterFile(const Options& iOptions, bool iIsNew) :
       mOptions(iOptions),
       mIsTimeDependent(false),
       mMaxTime(0),
+      mNearestNeighbourTree(KDTree::TypeCartesian),
       mAllowCycling(false),
       mIsNew(iIsNew) {
    iOptions.getValue("file", mFilename);
@@ -21,6 +22,7 @@ ParameterFile::ParameterFile(const Options& iOptions, bool iIsNew) :
 void ParameterFile::recomputeTree() const {
    if(isLocationDependent()) {
       vec2 lats, lons;
+      mLocations.clear();
       LocationParameters::const_iterator it = mParameters.begin();
       for(it = mParameters.begin(); it != mParameters.end(); it++) {
          const Location loc = it->first;
@@ -0,0 +1,189 @@
+#include "Projection.h"
+#include <cmath>
+#include <algorithm>
+#include "Util.h"
+
+Projection::Projection() :
+      mNumY(0),
+      mNumX(0),
+      mY0(0),
+      mDY(1),
+      mX0(0),
+      mDX(1) {
+}
+
+void Projection::setAxes(int iNumY, double iY0, double iDY, int iNumX, double iX0, double iDX) {
+   if(iDY == 0 || iDX == 0) {
+      Util::error("Cannot set projection axes with zero grid spacing");
+   }
+   mNumY = iNumY;
+   mY0 = iY0;
+   mDY = iDY;
+   mNumX = iNumX;
+   mX0 = iX0;
+   mDX = iDX;
+}
+
+bool Projection::getIndex(float iLat, float iLon, float& iI, float& iJ) const {
+   if(!Util::isValid(iLat) || !Util::isValid(iLon))
+      return false;
+   double x, y;
+   if(!project(iLat, iLon, x, y))
+      return false;
+   iI = (y - mY0) / mDY;
+   iJ = (x - mX0) / mDX;
+   return true;
+}
+
+bool Projection::isConsistent(const vec2& iLats, const vec2& iLons, float iTolerance) const {
+   int nY = iLats.size();
+   int nX = nY > 0 ? iLats[0].size() : 0;
+   if(nY == 0 || nX == 0 || nY != mNumY || nX != mNumX || iLons.size() != nY)
+      return false;
+
+   // Check every n'th row and column, including the last ones
+   int maxChecks = 50;
+   int strideY = std::max(1, nY / maxChecks);
+   int strideX = std::max(1, nX / maxChecks);
+   std::vector<int> rows, cols;
+   for(int i = 0; i < nY; i += strideY)
+      rows.push_back(i);
+   if(rows.back() != nY - 1)
+      rows.push_back(nY - 1);
+   for(int j = 0; j < nX; j += strideX)
+      cols.push_back(j);
+   if(cols.back() != nX - 1)
+      cols.push_back(nX - 1);
+
+   for(int r = 0; r < rows.size(); r++) {
+      for(int c = 0; c < cols.size(); c++) {
+         int ii = rows[r];
+         int jj = cols[c];
+         float lat = iLats[ii][jj];
+         float lon = iLons[ii][jj];
+         if(!Util::isValid(lat) || !Util::isValid(lon))
+            continue;
+         float I, J;
+         if(!getIndex(lat, lon, I, J))
+            return false;
+         if(fabs(I - ii) > iTolerance || fabs(J - jj) > iTolerance)
+            return false;
+      }
+   }
+   return true;
+}
+
+int Projection::getNumY() const {
+   return mNumY;
+}
+
+int Projection::getNumX() const {
+   return mNumX;
+}
+
+bool ProjectionLatLon::project(float iLat, float iLon, double& iX, double& iY) const {
+   iY = iLat;
+   // Use the longitude (modulo 360) that is closest to the center of the grid
+   double center = mX0 + mDX * (mNumX - 1) / 2;
+   double diff = fmod(iLon - center, 360.0);
+   if(diff >= 180)
+      diff -= 360;
+   else if(diff < -180)
+      diff += 360;
+   iX = center + diff;
+   return true;
+}
+
+ProjectionLatLon* ProjectionLatLon::detect(const vec2& iLats, const vec2& iLons) {
+   int nY = iLats.size();
+   if(nY < 2 || iLons.size() != nY)
+      return NULL;
+   int nX = iLats[0].size();
+   if(nX < 2)
+      return NULL;
+
+   for(int i = 0; i < nY; i++) {
+      if(iLats[i].size() != nX || iLons[i].size() != nX)
+         return NULL;
+      for(int j = 0; j < nX; j++) {
+         if(!Util::isValid(iLats[i][j]) || !Util::isValid(iLons[i][j]))
+            return NULL;
+         if(iLats[i][j] != iLats[i][0] || iLons[i][j] != iLons[0][j])
+            return NULL;
+      }
+   }
+
+   // Latitudes must be evenly spaced
+   double y0 = iLats[0][0];
+   double dy = (iLats[nY-1][0] - y0) / (nY - 1);
+   if(dy == 0)
+      return NULL;
+   for(int i = 0; i < nY; i++) {
+      if(fabs(iLats[i][0] - (y0 + i * dy)) > 0.01 * fabs(dy))
+         return NULL;
+   }
+
+   // Longitudes must be evenly spaced, allowing the grid to cross the dateline
+   std::vector<double> lons(nX);
+   lons[0] = iLons[0][0];
+   for(int j = 1; j < nX; j++) {
+      double diff = iLons[0][j] - iLons[0][j-1];
+      if(diff > 180)
+         diff -= 360;
+      else if(diff < -180)
+         diff += 360;
+      lons[j] = lons[j-1] + diff;
+   }
+   double x0 = lons[0];
+   double dx = (lons[nX-1] - x0) / (nX - 1);
+   if(dx == 0 || fabs(dx) * (nX - 1) >= 360)
+      return NULL;
+   for(int j = 0; j < nX; j++) {
+      if(fabs(lons[j] - (x0 + j * dx)) > 0.01 * fabs(dx))
+         return NULL;
+   }
+
+   ProjectionLatLon* projection = new ProjectionLatLon();
+   projection->setAxes(nY, y0, dy, nX, x0, dx);
+   return projection;
+}
+
+ProjectionLambert::ProjectionLambert(double iStandardParallel1, double iStandardParallel2, double iCentralLon, double iOriginLat,
+      double iEarthRadius, double iFalseEasting, double iFalseNorthing) :
+      mCentralLon(iCentralLon),
+      mEarthRadius(iEarthRadius),
+      mFalseEasting(iFalseEasting),
+      mFalseNorthing(iFalseNorthing) {
+   // Snyder (1987), Map projections: A working manual, equations 15-1 to 15-4
+   double pi = Util::pi;
+   double phi1 = iStandardParallel1 * pi / 180;
+   double phi2 = iStandardParallel2 * pi / 180;
+   double phi0 = iOriginLat * pi / 180;
+   if(fabs(phi1 - phi2) < 1e-10)
+      mN = sin(phi1);
+   else
+      mN = log(cos(phi1) / cos(phi2)) / log(tan(pi / 4 + phi2 / 2) / tan(pi / 4 + phi1 / 2));
+   if(mN == 0 || !Util::isValid(mN)) {
+      Util::error("Invalid standard parallels in lambert conformal conic projection");
+   }
+   mF = cos(phi1) * pow(tan(pi / 4 + phi1 / 2), mN) / mN;
+   mRho0 = mEarthRadius * mF / pow(tan(pi / 4 + phi0 / 2), mN);
+}
+
+bool ProjectionLambert::project(float iLat, float iLon, double& iX, double& iY) const {
+   double pi = Util::pi;
+   double phi = iLat * pi / 180;
+   double dlon = fmod(iLon - mCentralLon, 360.0);
+   if(dlon >= 180)
+      dlon -= 360;
+   else if(dlon < -180)
+      dlon += 360;
+   double theta = mN * dlon * pi / 180;
+   double rho = mEarthRadius * mF / pow(tan(pi / 4 + phi / 2), mN);
+   // The pole opposite the cone's apex cannot be projected
+   if(!Util::isValid(rho))
+      return false;
+   iX = mFalseEasting + rho * sin(theta);
+   iY = mFalseNorthing + mRho0 - rho * cos(theta);
+   return true;
+}
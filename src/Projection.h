@@ -0,0 +1,86 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+#include <string>
+#include <vector>
+typedef std::vector<std::vector<float> > vec2;
+
+//! Describes a grid that is regularly spaced in some map projection, so that the (fractional)
+//! grid indices of any lat/lon point can be computed directly, without searching the grid.
+//!
+//! The grid axes are defined in projected coordinates: the gridpoint at index (i,j) has
+//! projected coordinates x = x0 + j * dx and y = y0 + i * dy.
+class Projection {
+   public:
+      Projection();
+      virtual ~Projection() {};
+
+      //! Set the grid axes in projected coordinates
+      //! @param iNumY Number of gridpoints in the y direction
+      //! @param iY0 Projected y-coordinate of the first gridpoint
+      //! @param iDY Spacing between gridpoints in the y direction (can be negative)
+      void setAxes(int iNumY, double iY0, double iDY, int iNumX, double iX0, double iDX);
+
+      //! Compute the fractional grid indices of a lat/lon point. The indices may be outside the
+      //! grid. Returns false if the point cannot be projected.
+      //! @param iI Fractional index in the y direction
+      //! @param iJ Fractional index in the x direction
+      bool getIndex(float iLat, float iLon, float& iI, float& iJ) const;
+
+      //! Forward projection of a lat/lon point (in degrees) to projected coordinates. Returns false
+      //! if the point cannot be projected.
+      virtual bool project(float iLat, float iLon, double& iX, double& iY) const = 0;
+
+      virtual std::string name() const = 0;
+
+      //! Check that the projection places each gridpoint of a lat/lon grid within iTolerance
+      //! (fraction of a gridcell) of its index. Only a subset of the gridpoints are checked.
+      bool isConsistent(const vec2& iLats, const vec2& iLons, float iTolerance=0.05) const;
+
+      int getNumY() const;
+      int getNumX() const;
+   protected:
+      int mNumY;
+      int mNumX;
+      double mY0;
+      double mDY;
+      double mX0;
+      double mDX;
+};
+
+//! Regular lat/lon grid, where x is longitude and y is latitude (both in degrees)
+class ProjectionLatLon : public Projection {
+   public:
+      bool project(float iLat, float iLon, double& iX, double& iY) const;
+      std::string name() const {return "latitude_longitude";};
+
+      //! Check if a lat/lon grid is regular, i.e. latitudes only vary along the y direction and
+      //! longitudes only along the x direction, both with constant spacing. Returns a new
+      //! projection if so, otherwise NULL.
+      static ProjectionLatLon* detect(const vec2& iLats, const vec2& iLons);
+};
+
+//! Lambert conformal conic projection on a sphere, following the CF conventions for the
+//! lambert_conformal_conic grid mapping. Projected coordinates are in meters.
+class ProjectionLambert : public Projection {
+   public:
+      //! @param iStandardParallel1 First standard parallel (degrees)
+      //! @param iStandardParallel2 Second standard parallel (degrees). Use the same as the first
+      //!        for a tangent cone.
+      //! @param iCentralLon Longitude of the central meridian (degrees)
+      //! @param iOriginLat Latitude of the projection origin (degrees)
+      //! @param iEarthRadius Radius of the sphere (meters)
+      ProjectionLambert(double iStandardParallel1, double iStandardParallel2, double iCentralLon, double iOriginLat,
+            double iEarthRadius, double iFalseEasting=0, double iFalseNorthing=0);
+      bool project(float iLat, float iLon, double& iX, double& iY) const;
+      std::string name() const {return "lambert_conformal_conic";};
+   private:
+      double mCentralLon;
+      double mEarthRadius;
+      double mFalseEasting;
+      double mFalseNorthing;
+      // Cone constant, scaling factor, and radius at the origin latitude
+      double mN;
+      double mF;
+      double mRho0;
+};
+#endif
@@ -0,0 +1,208 @@
+#include "SparseCholesky.h"
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include "SparseMatrix.h"
+
+namespace {
+   //! Sort nodes by increasing degree, using the node index to break ties
+   struct CompareDegree {
+      CompareDegree(const std::vector<int>& iDegrees) : degrees(iDegrees) {}
+      bool operator()(int l, int r) const {
+         return degrees[l] < degrees[r] || (degrees[l] == degrees[r] && l < r);
+      }
+      const std::vector<int>& degrees;
+   };
+}
+
+SparseCholesky::SparseCholesky() :
+      mSize(0) {
+   mRowStarts.push_back(0);
+}
+
+bool SparseCholesky::factorize(const SparseMatrix& iMatrix, bool iPositiveDefinite) {
+   assert(iMatrix.getNumRows() == iMatrix.getNumCols());
+   int n = iMatrix.getNumRows();
+   const std::vector<int>& rowStarts = iMatrix.getRowStarts();
+   const std::vector<int>& columns = iMatrix.getColumns();
+   const std::vector<float>& weights = iMatrix.getWeights();
+
+   mSize = n;
+   computeOrdering(iMatrix, mOrder);
+   mInverseOrder.resize(n);
+   for(int k = 0; k < n; k++)
+      mInverseOrder[mOrder[k]] = k;
+
+   // Determine the envelope of the reordered matrix
+   mFirstCols.resize(n);
+   mRowStarts.resize(n+1);
+   mRowStarts[0] = 0;
+   for(int k = 0; k < n; k++) {
+      int row = mOrder[k];
+      int first = k;
+      for(int c = rowStarts[row]; c < rowStarts[row+1]; c++) {
+         first = std::min(first, mInverseOrder[columns[c]]);
+      }
+      mFirstCols[k] = first;
+      mRowStarts[k+1] = mRowStarts[k] + (k - first);
+   }
+
+   // Copy the lower triangle of the reordered matrix into the envelope
+   mL.clear();
+   mL.resize(mRowStarts[n], 0);
+   mD.clear();
+   mD.resize(n, 0);
+   for(int k = 0; k < n; k++) {
+      int row = mOrder[k];
+      for(int c = rowStarts[row]; c < rowStarts[row+1]; c++) {
+         int col = mInverseOrder[columns[c]];
+         if(col < k)
+            mL[mRowStarts[k] + col - mFirstCols[k]] = weights[c];
+         else if(col == k)
+            mD[k] = weights[c];
+      }
+   }
+
+   // Row-by-row factorization. For row i, temp[j] holds L(i,j) * D(j).
+   std::vector<double> temp(n, 0);
+   for(int i = 0; i < n; i++) {
+      int first = mFirstCols[i];
+      double* Li = &mL[0] + mRowStarts[i] - first;
+      double diagonal = mD[i];
+      for(int j = first; j < i; j++) {
+         int firstJ = mFirstCols[j];
+         const double* Lj = &mL[0] + mRowStarts[j] - firstJ;
+         double value = Li[j];
+         for(int k = std::max(first, firstJ); k < j; k++) {
+            value -= temp[k] * Lj[k];
+         }
+         temp[j] = value;
+         Li[j] = value / mD[j];
+         diagonal -= value * Li[j];
+      }
+      // The negated comparisons also reject NaN pivots
+      if(iPositiveDefinite && !(diagonal > 1e-12 * fabs(mD[i]))) {
+         return false;
+      }
+      else if(!(fabs(diagonal) > 1e-12 * fabs(mD[i]))) {
+         return false;
+      }
+      mD[i] = diagonal;
+   }
+   return true;
+}
+
+void SparseCholesky::solve(const std::vector<float>& iB, std::vector<float>& iX) const {
+   assert(iB.size() == mSize);
+   std::vector<double> y(mSize);
+   for(int k = 0; k < mSize; k++)
+      y[k] = iB[mOrder[k]];
+
+   // Forward substitution with the unit lower triangular L
+   for(int i = 0; i < mSize; i++) {
+      int first = mFirstCols[i];
+      const double* Li = &mL[0] + mRowStarts[i] - first;
+      double value = y[i];
+      for(int j = first; j < i; j++)
+         value -= Li[j] * y[j];
+      y[i] = value;
+   }
+   for(int i = 0; i < mSize; i++)
+      y[i] /= mD[i];
+
+   // Backward substitution with L', using the rows of L as columns of L'
+   for(int i = mSize - 1; i >= 0; i--) {
+      int first = mFirstCols[i];
+      const double* Li = &mL[0] + mRowStarts[i] - first;
+      double value = y[i];
+      for(int j = first; j < i; j++)
+         y[j] -= Li[j] * value;
+   }
+
+   iX.resize(mSize);
+   for(int k = 0; k < mSize; k++)
+      iX[mOrder[k]] = y[k];
+}
+
+int SparseCholesky::size() const {
+   return mSize;
+}
+
+long SparseCholesky::getNumStored() const {
+   return mL.size();
+}
+
+void SparseCholesky::computeOrdering(const SparseMatrix& iMatrix, std::vector<int>& iOrder) {
+   int n = iMatrix.getNumRows();
+   const std::vector<int>& rowStarts = iMatrix.getRowStarts();
+   const std::vector<int>& columns = iMatrix.getColumns();
+   std::vector<int> degrees(n, 0);
+   for(int i = 0; i < n; i++) {
+      for(int c = rowStarts[i]; c < rowStarts[i+1]; c++) {
+         if(columns[c] != i)
+            degrees[i]++;
+      }
+   }
+   std::vector<int> sorted(n);
+   for(int i = 0; i < n; i++)
+      sorted[i] = i;
+   std::sort(sorted.begin(), sorted.end(), CompareDegree(degrees));
+
+   // Levels are -1 for nodes that have not been visited yet
+   std::vector<int> levels(n, -1);
+   iOrder.clear();
+   iOrder.reserve(n);
+   std::vector<int> component;
+   int next = 0;
+   while(iOrder.size() < n) {
+      // Start each connected component at its node with the lowest degree
+      while(levels[sorted[next]] != -1)
+         next++;
+      int start = sorted[next];
+      component.clear();
+      int numLevels = bfs(iMatrix, start, degrees, levels, component);
+
+      // Look for a pseudo-peripheral node, by restarting from the node with the lowest degree
+      // in the last level, as long as this increases the number of levels
+      for(int iter = 0; iter < 5 && numLevels > 1; iter++) {
+         int candidate = -1;
+         for(int k = 0; k < component.size(); k++) {
+            int node = component[k];
+            if(levels[node] == numLevels - 1 && (candidate == -1 || degrees[node] < degrees[candidate]))
+               candidate = node;
+         }
+         std::vector<int> candidateComponent;
+         for(int k = 0; k < component.size(); k++)
+            levels[component[k]] = -1;
+         int candidateLevels = bfs(iMatrix, candidate, degrees, levels, candidateComponent);
+         component.swap(candidateComponent);
+         if(candidateLevels <= numLevels)
+            break;
+         numLevels = candidateLevels;
+      }
+      iOrder.insert(iOrder.end(), component.begin(), component.end());
+   }
+   std::reverse(iOrder.begin(), iOrder.end());
+}
+
+int SparseCholesky::bfs(const SparseMatrix& iMatrix, int iStart, const std::vector<int>& iDegrees,
+      std::vector<int>& iLevels, std::vector<int>& iOrder) {
+   const std::vector<int>& rowStarts = iMatrix.getRowStarts();
+   const std::vector<int>& columns = iMatrix.getColumns();
+   int first = iOrder.size();
+   iOrder.push_back(iStart);
+   iLevels[iStart] = 0;
+   for(int pos = first; pos < iOrder.size(); pos++) {
+      int node = iOrder[pos];
+      int numBefore = iOrder.size();
+      for(int c = rowStarts[node]; c < rowStarts[node+1]; c++) {
+         int neighbour = columns[c];
+         if(iLevels[neighbour] == -1) {
+            iLevels[neighbour] = iLevels[node] + 1;
+            iOrder.push_back(neighbour);
+         }
+      }
+      std::sort(iOrder.begin() + numBefore, iOrder.end(), CompareDegree(iDegrees));
+   }
+   return iLevels[iOrder.back()] + 1;
+}
@@ -0,0 +1,52 @@
+#ifndef SPARSE_CHOLESKY_H
+#define SPARSE_CHOLESKY_H
+#include <vector>
+class SparseMatrix;
+
+//! Sparse LDL' factorization (the square-root free form of the Cholesky factorization) of a
+//! symmetric matrix. Used to solve A x = b for many right hand sides without forming the inverse.
+//!
+//! The rows and columns are first reordered using the reverse Cuthill-McKee ordering, which moves
+//! the nonzeros close to the diagonal. The factor is stored in envelope (skyline) format, where
+//! row i holds the entries from its first nonzero column up to the diagonal. Fill-in can only
+//! occur inside this envelope. No pivoting is done, so the factorization is most stable for positive
+//! definite matrices.
+class SparseCholesky {
+   public:
+      SparseCholesky();
+
+      //! Factorize a square symmetric matrix. Both triangles must be stored and the columns
+      //! within each row must be in increasing order. Returns false if a pivot is (close to) zero,
+      //! in which case the matrix is (close to) singular.
+      //! @param iPositiveDefinite If true, also return false if a pivot is negative, i.e. if the
+      //!    matrix is not positive definite. Without pivoting, indefinite matrices can otherwise
+      //!    still be factorized, but less stably.
+      bool factorize(const SparseMatrix& iMatrix, bool iPositiveDefinite=true);
+
+      //! Solve A x = b using the factorization
+      void solve(const std::vector<float>& iB, std::vector<float>& iX) const;
+
+      //! Number of rows in the factorized matrix
+      int size() const;
+      //! Number of stored off-diagonal entries in the factor
+      long getNumStored() const;
+   private:
+      //! Compute the reverse Cuthill-McKee ordering of a symmetric sparsity pattern.
+      //! iOrder[k] is the original index of the k'th row in the new ordering.
+      static void computeOrdering(const SparseMatrix& iMatrix, std::vector<int>& iOrder);
+      //! Breadth-first search from iStart, visiting neighbours in order of increasing degree.
+      //! Appends the visited nodes to iOrder and returns the number of levels.
+      static int bfs(const SparseMatrix& iMatrix, int iStart, const std::vector<int>& iDegrees,
+            std::vector<int>& iLevels, std::vector<int>& iOrder);
+
+      int mSize;
+      // mOrder[k] is the original index of row k, mInverseOrder is the reverse mapping
+      std::vector<int> mOrder;
+      std::vector<int> mInverseOrder;
+      // Row k of L stores columns mFirstCols[k] to k-1 at positions mRowStarts[k] onwards
+      std::vector<int> mFirstCols;
+      std::vector<long> mRowStarts;
+      std::vector<double> mL;
+      std::vector<double> mD;
+};
+#endif
@@ -0,0 +1,127 @@
+#include "SparseMatrix.h"
+#include <assert.h>
+#include <algorithm>
+#include "Util.h"
+
+SparseMatrix::SparseMatrix(int iNumCols) :
+      mNumCols(iNumCols) {
+   mRowStarts.push_back(0);
+}
+
+void SparseMatrix::addRow(const std::vector<int>& iColumns, const std::vector<float>& iWeights) {
+   assert(iColumns.size() == iWeights.size());
+   for(int k = 0; k < iColumns.size(); k++) {
+      assert(iColumns[k] >= 0 && iColumns[k] < mNumCols);
+      mColumns.push_back(iColumns[k]);
+      mWeights.push_back(iWeights[k]);
+   }
+   mRowStarts.push_back(mColumns.size());
+}
+
+void SparseMatrix::addRow(int iColumn, float iWeight) {
+   assert(iColumn >= 0 && iColumn < mNumCols);
+   mColumns.push_back(iColumn);
+   mWeights.push_back(iWeight);
+   mRowStarts.push_back(mColumns.size());
+}
+
+void SparseMatrix::multiply(const float* iInput, float* iOutput, int iNum, int iInputStride, int iOutputStride) const {
+   int nRows = getNumRows();
+   #pragma omp parallel for
+   for(int r = 0; r < nRows; r++) {
+      float* output = iOutput + (long) r * iOutputStride;
+      int start = mRowStarts[r];
+      int end = mRowStarts[r+1];
+      if(start == end) {
+         for(int n = 0; n < iNum; n++)
+            output[n] = Util::MV;
+         continue;
+      }
+
+      // Accumulate over all vectors at once, since their values are contiguous
+      for(int n = 0; n < iNum; n++)
+         output[n] = 0;
+      for(int k = start; k < end; k++) {
+         const float* input = iInput + (long) mColumns[k] * iInputStride;
+         float weight = mWeights[k];
+         for(int n = 0; n < iNum; n++)
+            output[n] += weight * input[n];
+      }
+
+      // Missing inputs give missing outputs
+      for(int k = start; k < end; k++) {
+         const float* input = iInput + (long) mColumns[k] * iInputStride;
+         for(int n = 0; n < iNum; n++) {
+            if(!Util::isValid(input[n]))
+               output[n] = Util::MV;
+         }
+      }
+   }
+}
+
+void SparseMatrix::multiply(const std::vector<float>& iInput, std::vector<float>& iOutput) const {
+   assert(iInput.size() == mNumCols);
+   iOutput.resize(getNumRows());
+   if(iOutput.size() == 0)
+      return;
+   // Avoid indexing an empty input, which is allowed if all rows are empty
+   float dummy = Util::MV;
+   const float* input = iInput.size() > 0 ? &iInput[0] : &dummy;
+   multiply(input, &iOutput[0], 1, 1, 1);
+}
+
+bool SparseMatrix::get(int iRow, int iCol, float& iValue) const {
+   if(iRow < 0 || iRow >= getNumRows())
+      return false;
+   std::vector<int>::const_iterator start = mColumns.begin() + mRowStarts[iRow];
+   std::vector<int>::const_iterator end = mColumns.begin() + mRowStarts[iRow+1];
+   std::vector<int>::const_iterator it = std::lower_bound(start, end, iCol);
+   if(it == end || *it != iCol)
+      return false;
+   iValue = mWeights[it - mColumns.begin()];
+   return true;
+}
+
+int SparseMatrix::getNumRows() const {
+   return mRowStarts.size() - 1;
+}
+
+int SparseMatrix::getNumCols() const {
+   return mNumCols;
+}
+
+int SparseMatrix::getNumNonZeros() const {
+   return mColumns.size();
+}
+
+const std::vector<int>& SparseMatrix::getRowStarts() const {
+   return mRowStarts;
+}
+
+const std::vector<int>& SparseMatrix::getColumns() const {
+   return mColumns;
+}
+
+const std::vector<float>& SparseMatrix::getWeights() const {
+   return mWeights;
+}
+
+bool SparseMatrix::set(int iNumCols, const std::vector<int>& iRowStarts, const std::vector<int>& iColumns, const std::vector<float>& iWeights) {
+   if(iNumCols < 0 || iRowStarts.size() == 0 || iRowStarts[0] != 0 || iColumns.size() != iWeights.size())
+      return false;
+   if(iRowStarts.back() != iColumns.size())
+      return false;
+   for(int r = 1; r < iRowStarts.size(); r++) {
+      if(iRowStarts[r] < iRowStarts[r-1])
+         return false;
+   }
+   for(int k = 0; k < iColumns.size(); k++) {
+      if(iColumns[k] < 0 || iColumns[k] >= iNumCols)
+         return false;
+   }
+   mNumCols = iNumCols;
+   mRowStarts = iRowStarts;
+   mColumns = iColumns;
+   mWeights = iWeights;
+   return true;
+}
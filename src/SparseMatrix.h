@@ -0,0 +1,51 @@
+#ifndef SPARSE_MATRIX_H
+#define SPARSE_MATRIX_H
+#include <vector>
+
+//! A sparse matrix in compressed sparse row (CSR) format. Used to represent linear operators that
+//! map values on one grid to values on another (e.g. interpolation weights), so that the weights
+//! can be computed once and then applied to many fields.
+//!
+//! Rows are added in order using addRow. Columns and rows refer to flattened indices.
+class SparseMatrix {
+   public:
+      //! @param iNumCols Number of columns (i.e. size of the input vector)
+      SparseMatrix(int iNumCols=0);
+
+      //! Append a row with the given column indices and weights. The row may be empty.
+      void addRow(const std::vector<int>& iColumns, const std::vector<float>& iWeights);
+      //! Append a row with a single entry
+      void addRow(int iColumn, float iWeight);
+
+      //! Compute iOutput = M * iInput for iNum vectors at once. The vectors are interleaved, such
+      //! that element k of vector n is at position k * iInputStride + n in the input (and
+      //! k * iOutputStride + n in the output). This matches the layout of Field, where the ensemble
+      //! index changes fastest. An output value is missing if any of the input values it depends on
+      //! is missing, or if its row is empty.
+      void multiply(const float* iInput, float* iOutput, int iNum, int iInputStride, int iOutputStride) const;
+      //! Compute iOutput = M * iInput for a single vector
+      void multiply(const std::vector<float>& iInput, std::vector<float>& iOutput) const;
+
+      //! Look up the entry at row iRow and column iCol. Returns false if it is not stored. The
+      //! columns within each row must be in increasing order.
+      bool get(int iRow, int iCol, float& iValue) const;
+
+      int getNumRows() const;
+      int getNumCols() const;
+      //! Number of stored entries
+      int getNumNonZeros() const;
+
+      //! Raw CSR arrays. Entries of row r are at positions getRowStarts()[r] to
+      //! getRowStarts()[r+1]-1 in getColumns() and getWeights().
+      const std::vector<int>& getRowStarts() const;
+      const std::vector<int>& getColumns() const;
+      const std::vector<float>& getWeights() const;
+      //! Create matrix from raw CSR arrays. Returns false if the arrays are inconsistent.
+      bool set(int iNumCols, const std::vector<int>& iRowStarts, const std::vector<int>& iColumns, const std::vector<float>& iWeights);
+   private:
+      int mNumCols;
+      std::vector<int> mRowStarts;
+      std::vector<int> mColumns;
+      std::vector<float> mWeights;
+};
+#endif
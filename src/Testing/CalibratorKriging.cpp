@@ -3,6 +3,7 @@
 #include "../ParameterFile/ParameterFile.h"
 #include "../Calibrator/Kriging.h"
 #include <gtest/gtest.h>
+#include <map>
 
 namespace {
    class TestCalibratorKriging : public ::testing::Test {
@@ -16,6 +17,119 @@ namespace {
          }
          virtual void TearDown() {
          }
+         //! Invert the dense obs-to-obs matrix, optionally leaving out one point
+         vec2 getInverse(const CalibratorKriging& iCal, const std::vector<Location>& iLocations, int iExclude=Util::MV) {
+            int N = iLocations.size();
+            vec2 matrix(N, std::vector<float>(N, 0));
+            for(int ii = 0; ii < N; ii++) {
+               matrix[ii][ii] = 1;
+               if(ii == iExclude)
+                  continue;
+               for(int jj = 0; jj < N; jj++) {
+                  if(jj != ii && jj != iExclude)
+                     matrix[ii][jj] = iCal.calcCovar(iLocations[ii], iLocations[jj]) * 0.414 / 0.5;
+               }
+            }
+            return Util::inverse(matrix);
+         }
+         //! Compute the kriged bias at a gridpoint using the dense inverse from getInverse
+         float krige(const CalibratorKriging& iCal, const std::vector<Location>& iLocations, const std::vector<float>& iBias,
+               const Location& iGridPoint, const vec2& iInverse, int iExclude=Util::MV) {
+            int N = iLocations.size();
+            std::vector<float> S(N, 0);
+            bool hasCovar = false;
+            for(int ii = 0; ii < N; ii++) {
+               if(ii == iExclude)
+                  continue;
+               S[ii] = iCal.calcCovar(iLocations[ii], iGridPoint);
+               hasCovar = hasCovar || S[ii] > 0;
+            }
+            if(!hasCovar)
+               return Util::MV;
+            float total = 0;
+            for(int ii = 0; ii < N; ii++) {
+               for(int jj = 0; jj < N; jj++)
+                  total += iBias[ii] * iInverse[ii][jj] * S[jj];
+            }
+            return total;
+         }
+         //! 12 points spread over the 10x10 degree domain of FileFake
+         std::vector<Location> getSparseLocations() {
+            std::vector<Location> locations;
+            for(int k = 0; k < 12; k++)
+               locations.push_back(Location(50.5 + (k * 7 % 12) * 0.8, 0.5 + k * 0.8, 0));
+            return locations;
+         }
+         //! Points spread evenly (but not regularly) over a square of iSize meters
+         std::vector<Location> getDenseLocations(int iNum, float iSize) {
+            float lat0 = 54;
+            float lon0 = 4;
+            float dLat = iSize / Util::getDistance(lat0, lon0, lat0 + 1, lon0);
+            float dLon = iSize / Util::getDistance(lat0, lon0, lat0, lon0 + 1);
+            std::vector<Location> locations;
+            for(int k = 0; k < iNum; k++) {
+               float u = fmod(0.5 + k * 0.7548777, 1);
+               float v = fmod(0.5 + k * 0.5698403, 1);
+               locations.push_back(Location(lat0 + u * dLat, lon0 + v * dLon, 0));
+            }
+            return locations;
+         }
+         //! Check that kriging on an iGridSize x iGridSize grid matches the dense computation
+         //! @param iTolerance Allowed difference. The dense inverse is computed in single precision,
+         //!    which is inaccurate for ill-conditioned matrices.
+         void compareDense(const std::string& iOptions, const std::vector<Location>& iLocations, int iGridSize=10, float iTolerance=1e-4) {
+            std::stringstream ss;
+            ss << "nLat=" << iGridSize << " nLon=" << iGridSize << " nTime=1 nEns=1";
+            FileFake file(Options(ss.str()));
+            FieldPtr field = file.getEmptyField(0);
+            file.addField(field, mVariable, 0);
+            ParameterFile* parFile = ParameterFile::getScheme("text", Options("file=testing/files/temp_kriging.txt"));
+            for(int k = 0; k < iLocations.size(); k++) {
+               parFile->setParameters(Parameters(2 * sin(k + 1.0)), 0, iLocations[k]);
+            }
+            parFile->recomputeTree();
+            std::vector<Location> locations = parFile->getLocations();
+            std::vector<float> bias(locations.size());
+            for(int k = 0; k < locations.size(); k++)
+               bias[k] = parFile->getParameters(0, locations[k])[0];
+
+            CalibratorKriging cal(mVariable, Options(iOptions));
+            bool crossValidate = false;
+            Options(iOptions).getValue("crossValidate", crossValidate);
+            cal.calibrate(file, parFile);
+            const Field& after = *file.getField(mVariable, 0);
+            vec2 lats = file.getLats();
+            vec2 lons = file.getLons();
+            vec2 elevs = file.getElevs();
+            int numCorrected = 0;
+            std::map<int, vec2> inverses;
+            for(int i = 0; i < iGridSize; i++) {
+               for(int j = 0; j < iGridSize; j++) {
+                  Location gridPoint(lats[i][j], lons[i][j], elevs[i][j]);
+                  int exclude = Util::MV;
+                  if(crossValidate) {
+                     float maxCovar = 0;
+                     for(int k = 0; k < locations.size(); k++) {
+                        float covar = cal.calcCovar(locations[k], gridPoint);
+                        if(covar > maxCovar) {
+                           maxCovar = covar;
+                           exclude = k;
+                        }
+                     }
+                  }
+                  if(inverses.find(exclude) == inverses.end())
+                     inverses[exclude] = getInverse(cal, locations, exclude);
+                  float expected = krige(cal, locations, bias, gridPoint, inverses[exclude], exclude);
+                  if(!Util::isValid(expected))
+                     expected = 0;
+                  EXPECT_NEAR(expected, after(i, j, 0), iTolerance);
+                  numCorrected += fabs(expected) > 0.1;
+               }
+            }
+            // Check that the test is not trivial
+            EXPECT_GT(numCorrected, 10);
+            delete parFile;
+         }
          Variable mVariable;
    };
    // The parameter file has the following data:
@@ -67,6 +181,97 @@ namespace {
          EXPECT_FLOAT_EQ(0.28969184, cal.calcCovar(Location(62,10,100),Location(60,10,200)));
       }
    }
+   TEST_F(TestCalibratorKriging, calcCovarWendland) {
+      CalibratorKriging cal = CalibratorKriging(mVariable, Options("type=wendland radius=300000 maxElevDiff=100 efoldDist=200000"));
+      float h = Util::getDistance(60, 10, 61, 10, true) / 200000;
+      float horizWeight = pow(1 - h, 4) * (4 * h + 1);
+      EXPECT_FLOAT_EQ(horizWeight, cal.calcCovar(Location(60,10,100),Location(61,10,100)));
+      EXPECT_FLOAT_EQ(horizWeight, cal.calcCovar(Location(61,10,100),Location(60,10,100)));
+      // 0.5^4 * 3
+      EXPECT_FLOAT_EQ(0.1875, cal.calcCovar(Location(60,10,100),Location(60,10,150)));
+      EXPECT_FLOAT_EQ(horizWeight * 0.1875, cal.calcCovar(Location(60,10,150),Location(61,10,100)));
+      EXPECT_FLOAT_EQ(1, cal.calcCovar(Location(60,10,100),Location(60,10,100)));
+
+      // Outside the support
+      EXPECT_FLOAT_EQ(0, cal.calcCovar(Location(60,10,100),Location(62,10,100)));
+      EXPECT_FLOAT_EQ(0, cal.calcCovar(Location(60,10,100),Location(60,10,200)));
+   }
+   TEST_F(TestCalibratorKriging, sparseMatchesDense) {
+      compareDense("type=wendland radius=250000 efoldDist=250000", getSparseLocations());
+      compareDense("type=barnes radius=200000 efoldDist=80000", getSparseLocations());
+      compareDense("type=cressman radius=300000 efoldDist=150000", getSparseLocations());
+   }
+   TEST_F(TestCalibratorKriging, crossValidate) {
+      compareDense("type=wendland radius=250000 efoldDist=250000 crossValidate=1", getSparseLocations());
+      compareDense("type=barnes radius=200000 efoldDist=80000 crossValidate=1", getSparseLocations());
+   }
+   TEST_F(TestCalibratorKriging, denseNetwork) {
+      // With many stations within the default radius, the cressman and barnes matrices are not
+      // positive definite (and are ill-conditioned), but can still be solved
+      compareDense("type=cressman", getDenseLocations(200, 150000), 50, 5e-3);
+      compareDense("type=barnes radius=30000", getDenseLocations(60, 150000), 50, 5e-3);
+   }
+   TEST_F(TestCalibratorKriging, auxWindow) {
+      int nTime = 6;
+      int nEns = 3;
+      float bias = 2;
+      Variable aux("precipitation_amount");
+      FileFake file(Options("nLat=3 nLon=4 nTime=6 nEns=3"));
+      for(int t = 0; t < nTime; t++) {
+         file.addField(file.getEmptyField(0), mVariable, t);
+         FieldPtr auxField = file.getEmptyField();
+         for(int i = 0; i < 3; i++) {
+            for(int j = 0; j < 4; j++) {
+               for(int e = 0; e < nEns; e++) {
+                  // Some values are missing and some are outside the range
+                  if((i + j + e + t) % 5 != 0)
+                     (*auxField)(i, j, e) = (i * 3 + j * 2 + e + t * t) % 4;
+               }
+            }
+         }
+         file.addField(auxField, aux, t);
+      }
+      ParameterFile* parFile = ParameterFile::getScheme("text", Options("file=testing/files/temp_kriging.txt"));
+      for(int t = 0; t < nTime; t++) {
+         parFile->setParameters(Parameters(bias), t, Location(53, 4, 0));
+         parFile->setParameters(Parameters(0), t, Location(80, 80, 0));
+      }
+      parFile->recomputeTree();
+
+      // Kriging with and without the auxillary variable
+      FileFake fileNoAux(Options("nLat=3 nLon=4 nTime=6 nEns=3"));
+      for(int t = 0; t < nTime; t++)
+         fileNoAux.addField(fileNoAux.getEmptyField(0), mVariable, t);
+      CalibratorKriging calNoAux(mVariable, Options("type=barnes radius=2000000 efoldDist=300000"));
+      CalibratorKriging cal(mVariable, Options("type=barnes radius=2000000 efoldDist=300000 auxVariable=precipitation_amount range=1,2 window=1"));
+      calNoAux.calibrate(fileNoAux, parFile);
+      cal.calibrate(file, parFile);
+
+      for(int t = 0; t < nTime; t++) {
+         FieldPtr before = fileNoAux.getField(mVariable, t);
+         FieldPtr after = file.getField(mVariable, t);
+         for(int i = 0; i < 3; i++) {
+            for(int j = 0; j < 4; j++) {
+               for(int e = 0; e < nEns; e++) {
+                  // Fraction of valid timesteps within the window that are in the range
+                  int numInRange = 0;
+                  int numValid = 0;
+                  for(int tt = std::max(0, t - 1); tt <= std::min(nTime - 1, t + 1); tt++) {
+                     float value = (*file.getField(aux, tt))(i, j, e);
+                     if(Util::isValid(value)) {
+                        numValid++;
+                        numInRange += (value >= 1 && value <= 2);
+                     }
+                  }
+                  float weight = numValid == 0 ? 1 : (float) numInRange / numValid;
+                  EXPECT_GT(fabs((*before)(i, j, e)), 0.1);
+                  EXPECT_NEAR((*before)(i, j, e) * weight, (*after)(i, j, e), 1e-5);
+               }
+            }
+         }
+      }
+      delete parFile;
+   }
    // Test that we don't get negative weights with Cressman
    TEST_F(TestCalibratorKriging, radiusBiggerThanEfold) {
       CalibratorKriging cal = CalibratorKriging(mVariable, Options("radius=3000000 maxElevDiff=100 efoldDist=3000"));
@@ -166,6 +371,7 @@ namespace {
       CalibratorKriging(mVariable, Options("efoldDist=0"));
       CalibratorKriging(mVariable, Options("efoldDist=0 operator=add"));
       CalibratorKriging(mVariable, Options("efoldDist=0 operator=multiply"));
+      CalibratorKriging(mVariable, Options("type=wendland"));
    }
    TEST_F(TestCalibratorKriging, invalid) {
       ::testing::FLAGS_gtest_death_test_style = "threadsafe";
@@ -178,6 +384,12 @@ namespace {
 
       // Invalid operator
       EXPECT_DEATH(CalibratorKriging(mVariable, Options("radius=100 maxElevDiff=100 efoldDist=2 operator=nonvalidOperator")), ".*");
+
+      // Invalid window
+      EXPECT_DEATH(CalibratorKriging(mVariable, Options("auxVariable=precipitation_amount range=0,1 window=-1")), ".*");
+
+      // Invalid type
+      EXPECT_DEATH(CalibratorKriging(mVariable, Options("type=gaussian")), ".*");
    }
    TEST_F(TestCalibratorKriging, description) {
       CalibratorKriging::description();
@@ -16,6 +16,148 @@ namespace {
          }
          virtual void TearDown() {
          }
+         //! Check the weighted mean and sum against a brute force computation
+         //! @param iWeights Weights for offsets -iRadius to iRadius, row by row
+         void checkKernel(const Field& iInput, std::string iOptions, int iRadius, const std::vector<double>& iWeights) {
+            int nY = iInput.getNumY();
+            int nX = iInput.getNumX();
+            int nEns = iInput.getNumEns();
+            int width = 2 * iRadius + 1;
+            CalibratorNeighbourhood calMean(mVariable, Options(iOptions + " stat=mean"));
+            CalibratorNeighbourhood calSum(mVariable, Options(iOptions + " stat=sum"));
+            Field mean(nY, nX, nEns, 0);
+            Field sum(nY, nX, nEns, 0);
+            calMean.calibrateField(iInput, mean);
+            calSum.calibrateField(iInput, sum);
+            for(int y = 0; y < nY; y++) {
+               for(int x = 0; x < nX; x++) {
+                  for(int e = 0; e < nEns; e++) {
+                     double total = 0;
+                     double totalWeight = 0;
+                     for(int yy = std::max(0, y - iRadius); yy <= std::min(nY - 1, y + iRadius); yy++) {
+                        for(int xx = std::max(0, x - iRadius); xx <= std::min(nX - 1, x + iRadius); xx++) {
+                           double weight = iWeights[(yy - y + iRadius) * width + xx - x + iRadius];
+                           if(Util::isValid(iInput(yy, xx, e)) && weight > 0) {
+                              total += weight * iInput(yy, xx, e);
+                              totalWeight += weight;
+                           }
+                        }
+                     }
+                     if(totalWeight == 0) {
+                        EXPECT_FLOAT_EQ(Util::MV, mean(y, x, e));
+                        EXPECT_FLOAT_EQ(Util::MV, sum(y, x, e));
+                     }
+                     else {
+                        EXPECT_NEAR(total / totalWeight, mean(y, x, e), 1e-4 * fabs(total / totalWeight));
+                        EXPECT_NEAR(total, sum(y, x, e), 1e-4 * fabs(total));
+                     }
+                  }
+               }
+            }
+         }
+         //! Create a field with ties and missing values. Values are missing where
+         //! (x + 2y + e) % iMissingPeriod == 0 and in the rows from iNumValidY onwards.
+         Field getField(int iNumY, int iNumX, int iNumEns, int iMissingPeriod, int iNumValidY) {
+            Field field(iNumY, iNumX, iNumEns);
+            for(int y = 0; y < iNumValidY; y++) {
+               for(int x = 0; x < iNumX; x++) {
+                  for(int e = 0; e < iNumEns; e++) {
+                     if((x + 2 * y + e) % iMissingPeriod != 0)
+                        field(y, x, e) = 280 + (x * 7 + y * 13 + e * 5) % 23 + 0.1 * (x % 3);
+                  }
+               }
+            }
+            return field;
+         }
+         //! Create a field for testing std: a block with a large mean and a small variance, a
+         //! constant block, and a smooth block. The bottom three rows are missing.
+         Field getStdField(int iNumY, int iNumX, int iNumEns) {
+            Field field(iNumY, iNumX, iNumEns);
+            for(int y = 0; y < iNumY - 3; y++) {
+               for(int x = 0; x < iNumX; x++) {
+                  for(int e = 0; e < iNumEns; e++) {
+                     if((x + 3 * y + e) % 7 == 0)
+                        continue;
+                     if(x < 20)
+                        field(y, x, e) = 10000 + 0.01 * ((x * 3 + y) % 5);
+                     else if(x < 40)
+                        field(y, x, e) = 5;
+                     else
+                        field(y, x, e) = 280 + sin(0.3 * x + e) * 10 + 0.3 * y;
+                  }
+               }
+            }
+            return field;
+         }
+         //! Check that the fast method gives the same as the brute force method
+         //! @param iTolerance Relative tolerance. If 0, the values must be equal.
+         //! @return The output of the fast method
+         Field compareFast(const Field& iInput, std::string iOptions, float iTolerance=0) {
+            int nY = iInput.getNumY();
+            int nX = iInput.getNumX();
+            int nEns = iInput.getNumEns();
+            CalibratorNeighbourhood fast(mVariable, Options(iOptions + " fast=1"));
+            CalibratorNeighbourhood slow(mVariable, Options(iOptions + " fast=0"));
+            Field outputFast(nY, nX, nEns, 0);
+            Field outputSlow(nY, nX, nEns, 0);
+            fast.calibrateField(iInput, outputFast);
+            slow.calibrateField(iInput, outputSlow);
+            for(int y = 0; y < nY; y++) {
+               for(int x = 0; x < nX; x++) {
+                  for(int e = 0; e < nEns; e++) {
+                     if(iTolerance == 0)
+                        EXPECT_FLOAT_EQ(outputSlow(y, x, e), outputFast(y, x, e));
+                     else
+                        EXPECT_NEAR(outputSlow(y, x, e), outputFast(y, x, e), iTolerance * fabs(outputSlow(y, x, e)));
+                  }
+               }
+            }
+            return outputFast;
+         }
+         //! Check the fast std against a two-pass computation in double precision, since the brute
+         //! force method accumulates in single precision
+         //! @return The output of the fast method
+         Field checkStd(const Field& iInput, int iRadius) {
+            int nY = iInput.getNumY();
+            int nX = iInput.getNumX();
+            int nEns = iInput.getNumEns();
+            std::stringstream ss;
+            ss << "stat=std fast=1 radius=" << iRadius;
+            CalibratorNeighbourhood fast(mVariable, Options(ss.str()));
+            Field output(nY, nX, nEns, 0);
+            fast.calibrateField(iInput, output);
+            for(int y = 0; y < nY; y++) {
+               for(int x = 0; x < nX; x++) {
+                  for(int e = 0; e < nEns; e++) {
+                     double total = 0;
+                     int count = 0;
+                     for(int yy = std::max(0, y - iRadius); yy <= std::min(nY - 1, y + iRadius); yy++) {
+                        for(int xx = std::max(0, x - iRadius); xx <= std::min(nX - 1, x + iRadius); xx++) {
+                           if(Util::isValid(iInput(yy, xx, e))) {
+                              total += iInput(yy, xx, e);
+                              count++;
+                           }
+                        }
+                     }
+                     if(count == 0) {
+                        EXPECT_FLOAT_EQ(Util::MV, output(y, x, e));
+                        continue;
+                     }
+                     double mean = total / count;
+                     double total2 = 0;
+                     for(int yy = std::max(0, y - iRadius); yy <= std::min(nY - 1, y + iRadius); yy++) {
+                        for(int xx = std::max(0, x - iRadius); xx <= std::min(nX - 1, x + iRadius); xx++) {
+                           if(Util::isValid(iInput(yy, xx, e)))
+                              total2 += (iInput(yy, xx, e) - mean) * (iInput(yy, xx, e) - mean);
+                        }
+                     }
+                     float expected = sqrt(total2 / count);
+                     EXPECT_NEAR(expected, output(y, x, e), 1e-3 + 1e-5 * expected);
+                  }
+               }
+            }
+            return output;
+         }
          Variable mVariable;
    };
    TEST_F(TestCalibratorNeighbourhood, 10x10_double) {
@@ -112,6 +254,179 @@ namespace {
       EXPECT_FLOAT_EQ(Util::MV, (*field)(5,2,0));
       EXPECT_FLOAT_EQ(304.6667, (*field)(5,1,0));
    }
+   TEST_F(TestCalibratorNeighbourhood, fastMissingValues) {
+      Field input = getField(8, 7, 1, 5, 6);
+      Field output = compareFast(input, "radius=1 stat=mean");
+      // The bottom row only has missing values in its neighbourhood
+      EXPECT_FLOAT_EQ(Util::MV, output(7, 3, 0));
+   }
+   TEST_F(TestCalibratorNeighbourhood, fastEnsemble) {
+      // Use a grid that is wider than the column strips used when accumulating
+      Field input = getField(23, 150, 5, 7, 23);
+      compareFast(input, "radius=3 stat=mean", 1e-5);
+      compareFast(input, "radius=0 stat=mean", 1e-5);
+      compareFast(input, "radius=30 stat=sum", 1e-5);
+   }
+   TEST_F(TestCalibratorNeighbourhood, fastMinMax) {
+      // Include radii larger than the grid
+      Field input = getField(17, 12, 2, 6, 14);
+      const char* stats[] = {"min", "max"};
+      int radii[] = {0, 1, 2, 5, 20};
+      for(int s = 0; s < 2; s++) {
+         for(int r = 0; r < 5; r++) {
+            std::stringstream ss;
+            ss << "stat=" << stats[s] << " radius=" << radii[r];
+            Field output = compareFast(input, ss.str());
+            // The bottom rows are missing
+            if(radii[r] <= 1)
+               EXPECT_FLOAT_EQ(Util::MV, output(16, 5, 0));
+         }
+      }
+   }
+   TEST_F(TestCalibratorNeighbourhood, fastQuantile) {
+      // The fast quantiles should be exact, also when values are missing, when there are ties, and
+      // when the grid has more rows than one band
+      int nY = 70;
+      int nX = 15;
+      int nEns = 2;
+      Field input(nY, nX, nEns);
+      for(int y = 0; y < nY; y++) {
+         for(int x = 0; x < nX; x++) {
+            for(int e = 0; e < nEns; e++) {
+               if((x + 2 * y + e) % 6 != 0 && y < 66)
+                  input(y, x, e) = (x * 7 + y * 13 + e * 5) % 23 + 0.1 * (x % 3);
+            }
+         }
+      }
+      const char* stats[] = {"median", "quantile quantile=0.9", "quantile quantile=0", "quantile quantile=1", "quantile quantile=0.37"};
+      int radii[] = {0, 1, 3, 40};
+      for(int s = 0; s < 5; s++) {
+         for(int r = 0; r < 4; r++) {
+            std::stringstream ss;
+            ss << "stat=" << stats[s] << " radius=" << radii[r];
+            compareFast(input, ss.str());
+         }
+      }
+      // Same result when the output is written to the input field
+      CalibratorNeighbourhood fast(mVariable, Options("stat=median radius=2"));
+      Field output(nY, nX, nEns, 0);
+      fast.calibrateField(input, output);
+      fast.calibrateField(input, input);
+      for(int y = 0; y < nY; y++) {
+         for(int x = 0; x < nX; x++) {
+            EXPECT_FLOAT_EQ(output(y, x, 1), input(y, x, 1));
+         }
+      }
+   }
+   TEST_F(TestCalibratorNeighbourhood, fastStd) {
+      // The variance is small compared to the mean in some neighbourhoods
+      Field input = getStdField(30, 80, 3);
+      checkStd(input, 0);
+      checkStd(input, 1);
+      checkStd(input, 4);
+      checkStd(input, 50);
+
+      // The brute force method gives the same when the variance is not small compared to the mean
+      compareFast(getField(30, 80, 3, 7, 27), "stat=std radius=2", 1e-4);
+
+      // Neighbourhoods with constant values
+      Field output = checkStd(input, 2);
+      EXPECT_FLOAT_EQ(0, output(10, 30, 0));
+      EXPECT_FLOAT_EQ(Util::MV, output(29, 30, 0));
+   }
+   TEST_F(TestCalibratorNeighbourhood, kernels) {
+      int nY = 40;
+      int nX = 37;
+      int nEns = 2;
+      Field input(nY, nX, nEns);
+      for(int y = 0; y < nY; y++) {
+         for(int x = 0; x < nX; x++) {
+            for(int e = 0; e < nEns; e++) {
+               // A large block of missing values in the first member
+               if((x + 2 * y + e) % 5 == 0 || (e == 0 && y >= 8 && y < 30 && x >= 4 && x < 30))
+                  continue;
+               input(y, x, e) = 280 + sin(0.3 * x + e) * 10 + 0.3 * y;
+            }
+         }
+      }
+
+      // Disc
+      int radius = 5;
+      int width = 2 * radius + 1;
+      std::vector<double> weights(width * width);
+      for(int dy = -radius; dy <= radius; dy++) {
+         for(int dx = -radius; dx <= radius; dx++)
+            weights[(dy + radius) * width + dx + radius] = dy * dy + dx * dx <= radius * radius;
+      }
+      checkKernel(input, "kernel=disc radius=5", radius, weights);
+
+      // Gaussian, with the default sigma and with a specified sigma
+      radius = 4;
+      width = 2 * radius + 1;
+      float sigmas[] = {radius / 3.0, 1.5};
+      for(int k = 0; k < 2; k++) {
+         weights.resize(width * width);
+         for(int dy = -radius; dy <= radius; dy++) {
+            for(int dx = -radius; dx <= radius; dx++)
+               weights[(dy + radius) * width + dx + radius] = exp(-0.5 * (dy * dy + dx * dx) / (sigmas[k] * sigmas[k]));
+         }
+         std::stringstream ss;
+         ss << "kernel=gaussian radius=" << radius;
+         if(k > 0)
+            ss << " sigma=" << sigmas[k];
+         checkKernel(input, ss.str(), radius, weights);
+      }
+
+      // Asymmetric weights, both for a small kernel and a kernel large enough to use FFTs
+      int radii[] = {1, 9};
+      for(int r = 0; r < 2; r++) {
+         radius = radii[r];
+         width = 2 * radius + 1;
+         weights.resize(width * width);
+         std::stringstream ss;
+         ss << "kernel=weights weights=";
+         for(int k = 0; k < width * width; k++) {
+            int dy = k / width - radius;
+            int dx = k % width - radius;
+            weights[k] = (dy == 1 && dx == 0) ? 0 : 1 + 0.5 * (dy + radius) + 0.1 * (dx + radius) * (dx + radius);
+            ss << (k > 0 ? "," : "") << weights[k];
+         }
+         checkKernel(input, ss.str(), radius, weights);
+      }
+   }
+   TEST_F(TestCalibratorNeighbourhood, kernelSpecialCases) {
+      Field input(15, 12, 1);
+      for(int y = 0; y < 15; y++) {
+         for(int x = 0; x < 12; x++) {
+            if((x * y) % 7 != 3)
+               input(y, x, 0) = x * 1.5 - y;
+         }
+      }
+      // A disc with radius 0 does nothing
+      CalibratorNeighbourhood disc(mVariable, Options("kernel=disc radius=0"));
+      Field output(15, 12, 1, 0);
+      disc.calibrateField(input, output);
+      for(int y = 0; y < 15; y++) {
+         for(int x = 0; x < 12; x++)
+            EXPECT_FLOAT_EQ(input(y, x, 0), output(y, x, 0));
+      }
+      // Equal weights give the same as the square kernel
+      CalibratorNeighbourhood square(mVariable, Options("radius=1"));
+      CalibratorNeighbourhood weights(mVariable, Options("kernel=weights weights=2,2,2,2,2,2,2,2,2"));
+      Field outputSquare(15, 12, 1, 0);
+      Field outputWeights(15, 12, 1, 0);
+      square.calibrateField(input, outputSquare);
+      weights.calibrateField(input, outputWeights);
+      for(int y = 0; y < 15; y++) {
+         for(int x = 0; x < 12; x++)
+            EXPECT_NEAR(outputSquare(y, x, 0), outputWeights(y, x, 0), 1e-5);
+      }
+      // The weighted sum uses the weights
+      CalibratorNeighbourhood center(mVariable, Options("kernel=weights weights=0,0,0,0,3,0,0,0,0 stat=sum"));
+      center.calibrateField(input, output);
+      EXPECT_FLOAT_EQ(3 * input(4, 5, 0), output(4, 5, 0));
+      EXPECT_FLOAT_EQ(Util::MV, output(1, 3, 0));
+   }
    TEST_F(TestCalibratorNeighbourhood, mean) {
       FileNetcdf from("testing/files/10x10.nc");
       CalibratorNeighbourhood cal = CalibratorNeighbourhood(mVariable ,Options("radius=1 stat=mean"));
@@ -214,6 +529,18 @@ namespace {
       EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("stat=quantile quantile=-0.1")), ".*");
       EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("stat=quantile quantile=1.1")), ".*");
       EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("stat=quantile quantile=-999")), ".*");
+
+      // Invalid kernels
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=invalid")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=disc stat=median")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=gaussian stat=std")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=gaussian sigma=0")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights weights=1,1")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights weights=1,1,1,1")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights weights=1,1,1,1,-1,1,1,1,1")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights weights=0,0,0,0,0,0,0,0,0")), ".*");
+      EXPECT_DEATH(CalibratorNeighbourhood(mVariable, Options("kernel=weights weights=1,1,1,1,1,1,1,1,1 radius=2")), ".*");
    }
    TEST_F(TestCalibratorNeighbourhood, description) {
       CalibratorNeighbourhood::description();
@@ -0,0 +1,195 @@
+#include "../File/Fake.h"
+#include "../Util.h"
+#include "../ParameterFile/ParameterFile.h"
+#include "../Calibrator/Oi.h"
+#include <gtest/gtest.h>
+#include <fstream>
+
+namespace {
+   class TestCalibratorOi : public ::testing::Test {
+      protected:
+         TestCalibratorOi() {
+         }
+         virtual ~TestCalibratorOi() {
+         }
+         virtual void SetUp() {
+            mVariable = Variable("air_temperature_2m");
+         }
+         virtual void TearDown() {
+         }
+         //! Create a 10x10 file with a smoothly varying background that differs between members
+         void setBackground(FileFake& iFile) {
+            vec2 elevs = iFile.getElevs();
+            vec2 lafs = iFile.getElevs();
+            for(int y = 0; y < iFile.getNumY(); y++) {
+               for(int x = 0; x < iFile.getNumX(); x++) {
+                  elevs[y][x] = 10 * ((x + 2 * y) % 7);
+                  lafs[y][x] = ((x + y) % 3) / 2.0;
+               }
+            }
+            iFile.setElevs(elevs);
+            iFile.setLandFractions(lafs);
+            FieldPtr field = iFile.getEmptyField();
+            for(int y = 0; y < iFile.getNumY(); y++) {
+               for(int x = 0; x < iFile.getNumX(); x++) {
+                  for(int e = 0; e < iFile.getNumEns(); e++) {
+                     (*field)(y, x, e) = 8 + 2 * sin(0.4 * x + e) + cos(0.3 * y * (e + 1));
+                  }
+               }
+            }
+            iFile.addField(field, mVariable, 0);
+         }
+         //! Observations (value and ci) at a few locations inside the grid
+         ParameterFile* getObs() {
+            ParameterFile* obs = ParameterFile::getScheme("text", Options("file=testing/files/temp_oi.txt"));
+            for(int i = 0; i < 8; i++) {
+               float lat = 51.3 + 0.9 * i;
+               float lon = 1.2 + (i * 37 % 70) / 10.0;
+               std::vector<float> values(2);
+               values[0] = 6 + 0.7 * i;
+               values[1] = 1 + (i % 3);
+               obs->setParameters(Parameters(values), 0, Location(lat, lon, 5 * i));
+            }
+            obs->recomputeTree();
+            return obs;
+         }
+         //! Check that the single and double precision analyses are close
+         void compare(const std::string& iOptions, int iNumEns) {
+            std::stringstream ss;
+            ss << "nLat=10 nLon=10 nTime=1 nEns=" << iNumEns;
+            FileFake fileDouble(Options(ss.str()));
+            FileFake fileFloat(Options(ss.str()));
+            setBackground(fileDouble);
+            setBackground(fileFloat);
+            Field background = *fileDouble.getField(mVariable, 0);
+            ParameterFile* obs = getObs();
+
+            CalibratorOi calDouble(mVariable, Options(iOptions + " precision=double"));
+            CalibratorOi calFloat(mVariable, Options(iOptions + " precision=float"));
+            calDouble.calibrate(fileDouble, obs);
+            calFloat.calibrate(fileFloat, obs);
+
+            const Field& analysisDouble = *fileDouble.getField(mVariable, 0);
+            const Field& analysisFloat = *fileFloat.getField(mVariable, 0);
+            float maxIncrement = 0;
+            for(int y = 0; y < 10; y++) {
+               for(int x = 0; x < 10; x++) {
+                  for(int e = 0; e < iNumEns; e++) {
+                     EXPECT_NEAR(analysisDouble(y, x, e), analysisFloat(y, x, e), 1e-3);
+                     maxIncrement = std::max(maxIncrement, (float) fabs(analysisDouble(y, x, e) - background(y, x, e)));
+                  }
+               }
+            }
+            // Check that the observations have an effect
+            EXPECT_GT(maxIncrement, 0.1);
+            delete obs;
+         }
+         //! Gridpoint (y, x) of each station used by the leave-one-out test
+         void getStationPoints(std::vector<int>& iY, std::vector<int>& iX) {
+            iY.clear();
+            iX.clear();
+            for(int i = 0; i < 8; i++) {
+               iY.push_back(1 + i);
+               iX.push_back(1 + (3 * i) % 8);
+            }
+         }
+         //! Observations placed exactly on gridpoints of iFile, optionally leaving out station iSkip.
+         //! A station then has the same location, elevation and land area fraction as its gridpoint.
+         ParameterFile* getGridObs(const File& iFile, int iSkip=-1) {
+            ParameterFile* obs = ParameterFile::getScheme("text", Options("file=testing/files/temp_oi.txt"));
+            vec2 lats = iFile.getLats();
+            vec2 lons = iFile.getLons();
+            vec2 elevs = iFile.getElevs();
+            std::vector<int> Y, X;
+            getStationPoints(Y, X);
+            for(int i = 0; i < Y.size(); i++) {
+               if(i == iSkip)
+                  continue;
+               std::vector<float> values(2);
+               values[0] = 6 + 0.7 * i;
+               values[1] = 1 + (i % 3);
+               obs->setParameters(Parameters(values), 0, Location(lats[Y[i]][X[i]], lons[Y[i]][X[i]], elevs[Y[i]][X[i]]));
+            }
+            obs->recomputeTree();
+            return obs;
+         }
+         Variable mVariable;
+   };
+   TEST_F(TestCalibratorOi, leaveOneOut) {
+      // The closed-form leave-one-out analysis at a station must match the analysis at the
+      // station's gridpoint when the station is actually left out
+      std::string options = "d=200000 useEns=0 localization=radius";
+      std::string looFilename = "testing/files/temp_oi_loo.txt";
+      FileFake file(Options("nLat=10 nLon=10 nTime=1 nEns=1"));
+      setBackground(file);
+      ParameterFile* obs = getGridObs(file);
+      CalibratorOi cal(mVariable, Options(options + " looFile=" + looFilename));
+      cal.calibrate(file, obs);
+      delete obs;
+
+      // Read the leave-one-out file
+      std::ifstream ifs(looFilename.c_str());
+      ASSERT_TRUE(ifs.good());
+      std::string header;
+      std::getline(ifs, header);
+      std::vector<float> looLats, looLons, looAnalyses;
+      int time, member;
+      float lat, lon, elev, obsValue, background, analysis, residual;
+      while(ifs >> time >> member >> lat >> lon >> elev >> obsValue >> background >> analysis >> residual) {
+         looLats.push_back(lat);
+         looLons.push_back(lon);
+         looAnalyses.push_back(analysis);
+         EXPECT_NEAR(obsValue - analysis, residual, 1e-3);
+      }
+      ifs.close();
+      Util::remove(looFilename);
+
+      std::vector<int> Y, X;
+      getStationPoints(Y, X);
+      EXPECT_EQ(Y.size(), looAnalyses.size());
+      vec2 lats = file.getLats();
+      vec2 lons = file.getLons();
+      float maxDiff = 0;
+      for(int i = 0; i < Y.size(); i++) {
+         int q = -1;
+         for(int k = 0; k < looLats.size(); k++) {
+            if(fabs(looLats[k] - lats[Y[i]][X[i]]) < 1e-3 && fabs(looLons[k] - lons[Y[i]][X[i]]) < 1e-3)
+               q = k;
+         }
+         ASSERT_TRUE(q >= 0);
+
+         // Brute force: analysis without station i
+         FileFake fileSkip(Options("nLat=10 nLon=10 nTime=1 nEns=1"));
+         setBackground(fileSkip);
+         Field background = *fileSkip.getField(mVariable, 0);
+         ParameterFile* obsSkip = getGridObs(fileSkip, i);
+         CalibratorOi calSkip(mVariable, Options(options));
+         calSkip.calibrate(fileSkip, obsSkip);
+         delete obsSkip;
+         float expected = (*fileSkip.getField(mVariable, 0))(Y[i], X[i], 0);
+         EXPECT_NEAR(expected, looAnalyses[q], 1e-3);
+         maxDiff = std::max(maxDiff, (float) fabs(expected - background(Y[i], X[i], 0)));
+      }
+      // Check that the other stations have an effect
+      EXPECT_GT(maxDiff, 0.1);
+   }
+   TEST_F(TestCalibratorOi, singlePrecisionSingleMember) {
+      compare("d=200000 useEns=0", 1);
+   }
+   TEST_F(TestCalibratorOi, singlePrecisionEnsemble) {
+      compare("d=200000", 6);
+   }
+   TEST_F(TestCalibratorOi, invalid) {
+      ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+      Util::setShowError(false);
+      EXPECT_DEATH(CalibratorOi(mVariable, Options("precision=half")), ".*");
+      EXPECT_DEATH(CalibratorOi(mVariable, Options("tileSize=0")), ".*");
+   }
+   TEST_F(TestCalibratorOi, description) {
+      CalibratorOi::description();
+   }
+}
+int main(int argc, char **argv) {
+     ::testing::InitGoogleTest(&argc, argv);
+       return RUN_ALL_TESTS();
+}
@@ -125,6 +125,65 @@ namespace {
          EXPECT_FLOAT_EQ(20.666666, (*from.getField(mVariable, t))(0,0,0));
       }
    }
+   TEST_F(TestCalibratorWindow, series) {
+      // Compare against computing each window with Util::calculateStat, for a series with
+      // missing values and with windows that are longer than the series
+      int nTime = 23;
+      FileFake file(Options("nLat=2 nLon=3 nTime=23 nEns=2"));
+      for(int t = 0; t < nTime; t++) {
+         FieldPtr field = file.getField(mVariable, t);
+         for(int i = 0; i < 2; i++) {
+            for(int j = 0; j < 3; j++) {
+               for(int e = 0; e < 2; e++) {
+                  float value = 280 + 10 * sin(0.5 * t + i + 2 * j + e) + (t * 7 + j) % 3;
+                  if((t + i + j + e) % 6 == 0 || (i == 1 && j == 2 && e == 1 && t >= 5 && t < 15))
+                     value = Util::MV;
+                  (*field)(i, j, e) = value;
+               }
+            }
+         }
+      }
+      const char* stats[] = {"mean", "sum", "std", "min", "max", "median", "quantile quantile=0.3"};
+      const char* options[] = {"", " before=1", " keepMissing=1", " edgePolicy=missing"};
+      int lengths[] = {1, 4, 8, 30};
+      for(int s = 0; s < sizeof(stats) / sizeof(stats[0]); s++) {
+         Util::StatType statType;
+         Util::getStatType(Util::split(stats[s])[0], statType);
+         float quantile = statType == Util::StatTypeQuantile ? 0.3 : Util::MV;
+         for(int o = 0; o < 4; o++) {
+            for(int l = 0; l < 4; l++) {
+               int length = lengths[l];
+               std::stringstream ss;
+               ss << "length=" << length << " stat=" << stats[s] << options[o];
+               FileFake copy = file;
+               CalibratorWindow cal(mVariable, Options(ss.str()));
+               cal.calibrate(copy);
+               int before = o == 1 ? length - 1 : (length - 1) / 2;
+               int after = length - before - 1;
+               for(int t = 0; t < nTime; t++) {
+                  FieldPtr output = copy.getField(mVariable, t);
+                  for(int i = 0; i < 2; i++) {
+                     for(int j = 0; j < 3; j++) {
+                        for(int e = 0; e < 2; e++) {
+                           std::vector<float> window;
+                           bool hasMissing = false;
+                           for(int tt = std::max(0, t - before); tt <= std::min(nTime - 1, t + after); tt++) {
+                              float value = (*file.getField(mVariable, tt))(i, j, e);
+                              window.push_back(value);
+                              hasMissing = hasMissing || !Util::isValid(value);
+                           }
+                           float expected = Util::calculateStat(window, statType, quantile);
+                           if((o == 2 && hasMissing) || (o == 3 && window.size() != length))
+                              expected = Util::MV;
+                           EXPECT_NEAR(expected, (*output)(i, j, e), 1e-3) << ss.str() << " t=" << t;
+                        }
+                     }
+                  }
+               }
+            }
+         }
+      }
+   }
    TEST_F(TestCalibratorWindow, invalid) {
       ::testing::FLAGS_gtest_death_test_style = "threadsafe";
       Util::setShowError(false);
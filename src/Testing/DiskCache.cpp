@@ -0,0 +1,91 @@
+#include "../DiskCache.h"
+#include "../Util.h"
+#include <fstream>
+#include <gtest/gtest.h>
+#include <stdlib.h>
+
+namespace {
+   class DiskCacheTest : public ::testing::Test {
+      protected:
+         virtual void SetUp() {
+            char dir[] = "/tmp/gridppXXXXXX";
+            ASSERT_TRUE(mkdtemp(dir) != NULL);
+            mDirectory = dir;
+            DiskCache::setDirectory(mDirectory);
+         }
+         virtual void TearDown() {
+            DiskCache::setDirectory("");
+         }
+         std::string mDirectory;
+   };
+   TEST_F(DiskCacheTest, disabled) {
+      DiskCache::setDirectory("");
+      EXPECT_FALSE(DiskCache::isEnabled());
+      std::vector<std::vector<int> > ints(1, std::vector<int>(3, 1));
+      std::vector<std::vector<float> > floats;
+      EXPECT_FALSE(DiskCache::write("test", ints, floats));
+      EXPECT_FALSE(DiskCache::read("test", ints, floats));
+   }
+   TEST_F(DiskCacheTest, readWrite) {
+      EXPECT_TRUE(DiskCache::isEnabled());
+      EXPECT_EQ(mDirectory, DiskCache::getDirectory());
+
+      std::vector<std::vector<int> > ints(2);
+      ints[0].push_back(3);
+      ints[0].push_back(Util::MV);
+      ints[0].push_back(-7);
+      std::vector<std::vector<float> > floats(1, std::vector<float>(4, 0.25));
+      floats[0][3] = Util::MV;
+      EXPECT_TRUE(DiskCache::write("test", ints, floats));
+
+      std::vector<std::vector<int> > ints2;
+      std::vector<std::vector<float> > floats2;
+      ASSERT_TRUE(DiskCache::read("test", ints2, floats2));
+      EXPECT_EQ(ints, ints2);
+      EXPECT_EQ(floats, floats2);
+
+      // Overwrite
+      ints.resize(1);
+      EXPECT_TRUE(DiskCache::write("test", ints, floats));
+      ASSERT_TRUE(DiskCache::read("test", ints2, floats2));
+      EXPECT_EQ(ints, ints2);
+   }
+   TEST_F(DiskCacheTest, missing) {
+      std::vector<std::vector<int> > ints;
+      std::vector<std::vector<float> > floats;
+      EXPECT_FALSE(DiskCache::read("doesNotExist", ints, floats));
+   }
+   TEST_F(DiskCacheTest, invalid) {
+      Util::setShowWarning(false);
+      std::vector<std::vector<int> > ints(1, std::vector<int>(100, 2));
+      std::vector<std::vector<float> > floats;
+      EXPECT_TRUE(DiskCache::write("test", ints, floats));
+
+      // Truncate the file
+      std::string filename = mDirectory + "/test.bin";
+      std::ifstream ifs(filename.c_str(), std::ios::binary);
+      std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+      ifs.close();
+      std::ofstream ofs(filename.c_str(), std::ios::binary);
+      ofs << contents.substr(0, contents.size() - 8);
+      ofs.close();
+      EXPECT_FALSE(DiskCache::read("test", ints, floats));
+
+      // Not a cache file
+      std::ofstream ofs2(filename.c_str(), std::ios::binary);
+      ofs2 << "some text that is not a cache file";
+      ofs2.close();
+      EXPECT_FALSE(DiskCache::read("test", ints, floats));
+   }
+   TEST_F(DiskCacheTest, getKey) {
+      std::vector<uint64_t> hashes;
+      hashes.push_back(1);
+      hashes.push_back(255);
+      EXPECT_EQ("nearest_0000000000000001_00000000000000ff", DiskCache::getKey("nearest", hashes));
+      EXPECT_EQ("nearest", DiskCache::getKey("nearest", std::vector<uint64_t>()));
+   }
+}
+int main(int argc, char **argv) {
+     ::testing::InitGoogleTest(&argc, argv);
+       return RUN_ALL_TESTS();
+}
@@ -1,6 +1,7 @@
 #include "../Util.h"
 #include "../File/File.h"
 #include "../Downscaler/Downscaler.h"
+#include "../DiskCache.h"
 #include <gtest/gtest.h>
 #include <boost/assign/list_of.hpp>
 
@@ -237,6 +238,88 @@ namespace {
          }
       }
    }
+   TEST_F(TestDownscaler, sameGridSameTag) {
+      // Separate files on the same grid share the tag, and therefore the neighbour cache
+      FileFake from1(Options("nLat=3 nLon=2 nEns=1 nTime=1"));
+      FileFake from2(Options("nLat=3 nLon=2 nEns=2 nTime=3"));
+      FileFake other(Options("nLat=3 nLon=2 nEns=1 nTime=1"));
+      setLatLon(from1, (const float[]) {60,50,55}, (const float[]){5,4});
+      setLatLon(from2, (const float[]) {60,50,55}, (const float[]){5,4});
+      setLatLon(other, (const float[]) {60,50,56}, (const float[]){5,4});
+      EXPECT_EQ(from1.getUniqueTag(), from2.getUniqueTag());
+      EXPECT_NE(from1.getUniqueTag(), other.getUniqueTag());
+
+      // Longitudes are normalized before hashing
+      setLatLon(other, (const float[]) {60,50,55}, (const float[]){-355,-356});
+      EXPECT_EQ(from1.getUniqueTag(), other.getUniqueTag());
+
+      FileFake to(Options("nLat=2 nLon=2 nEns=1 nTime=1"));
+      setLatLon(to,   (const float[]) {56,49},    (const float[]){3,4.6});
+      vec2Int I1, J1, I2, J2;
+      Downscaler::clearCache();
+      Downscaler::getNearestNeighbour(from1, to, I1, J1);
+      Downscaler::getNearestNeighbour(from2, to, I2, J2);
+      EXPECT_EQ(I1, I2);
+      EXPECT_EQ(J1, J2);
+   }
+   TEST_F(TestDownscaler, regularGrid) {
+      // Nearest neighbours are computed from the projection for regular grids
+      FileFake from(Options("nLat=20 nLon=30 nEns=1 nTime=1"));
+      FileFake to(Options("nLat=15 nLon=17 nEns=1 nTime=1"));
+      ASSERT_TRUE(from.getProjection() != NULL);
+      vec2 lats = to.getLats();
+      vec2 lons = to.getLons();
+      for(int i = 0; i < lats.size(); i++) {
+         for(int j = 0; j < lats[i].size(); j++) {
+            // Include points outside the input grid
+            lats[i][j] = 48 + 14.0 * i / lats.size() + 0.01 * j;
+            lons[i][j] = -2 + 14.0 * j / lats[i].size() - 0.01 * i;
+         }
+      }
+      to.setLats(lats);
+      to.setLons(lons);
+      EXPECT_TRUE(to.getProjection() == NULL);
+
+      vec2Int I, J, If, Jf;
+      Downscaler::clearCache();
+      Downscaler::getNearestNeighbour(from, to, I, J);
+      Downscaler::clearCache();
+      Downscaler::getNearestNeighbourBruteForce(from, to, If, Jf);
+      EXPECT_EQ(I, If);
+      EXPECT_EQ(J, Jf);
+   }
+   TEST_F(TestDownscaler, diskCache) {
+      char dir[] = "/tmp/gridppXXXXXX";
+      ASSERT_TRUE(mkdtemp(dir) != NULL);
+      DiskCache::setDirectory(dir);
+
+      FileFake from(Options("nLat=3 nLon=2 nEns=1 nTime=1"));
+      FileFake to(Options("nLat=2 nLon=2 nEns=1 nTime=1"));
+      setLatLon(from, (const float[]) {60,50,55}, (const float[]){5,4});
+      setLatLon(to,   (const float[]) {56,49},    (const float[]){3,4.6});
+
+      vec2Int I, J, Icached, Jcached;
+      Downscaler::clearCache();
+      Downscaler::getNearestNeighbour(from, to, I, J);
+
+      // Read back from disk in a new file with the same grid
+      Downscaler::clearCache();
+      FileFake to2(Options("nLat=2 nLon=2 nEns=1 nTime=1"));
+      setLatLon(to2,  (const float[]) {56,49},    (const float[]){3,4.6});
+      Downscaler::getNearestNeighbour(from, to2, Icached, Jcached);
+      EXPECT_EQ(I, Icached);
+      EXPECT_EQ(J, Jcached);
+
+      // A different grid is not read from the cache
+      Downscaler::clearCache();
+      setLatLon(from, (const float[]) {60,55,50}, (const float[]){5,4});
+      Downscaler::getNearestNeighbour(from, to, I, J);
+      EXPECT_EQ(1, I[0][0]);
+      EXPECT_EQ(1, J[0][0]);
+
+      DiskCache::setDirectory("");
+      Downscaler::clearCache();
+   }
    TEST_F(TestDownscaler, missingLatLon) {
       ::testing::FLAGS_gtest_death_test_style = "threadsafe";
       Util::setShowError(false);
@@ -250,6 +250,55 @@ namespace {
       const Field& toT   = *to.getField(mVariable, 0);
       EXPECT_FLOAT_EQ(10.14606060606061, toT(0,0,0));
    }
+   TEST_F(TestDownscalerBilinear, operator) {
+      FileFake from(Options("nLat=2 nLon=2 nEns=2 nTime=1"));
+      FileFake to(Options("nLat=1 nLon=2 nEns=2 nTime=1"));
+      setLatLon(from, (const float[]) {0.3, 4.8}, (const float[]){1.1, 2.2});
+      setLatLon(to,   (const float[]) {0.6},    (const float[]){1.3, 3});
+      vec2Int I, J;
+      Downscaler::getNearestNeighbour(from, to, I, J);
+
+      SparseMatrix op;
+      DownscalerBilinear::getOperator(from, to, I, J, op);
+      ASSERT_EQ(2, op.getNumRows());
+      ASSERT_EQ(4, op.getNumCols());
+      // Four surrounding points for the first point, nearest neighbour for the second (outside)
+      EXPECT_EQ(5, op.getNumNonZeros());
+      float total = 0;
+      for(int k = 0; k < 4; k++)
+         total += op.getWeights()[k];
+      EXPECT_FLOAT_EQ(1, total);
+
+      Field input(2, 2, 2);
+      Field output(1, 2, 2);
+      input(0,0,0) = 10;
+      input(1,0,0) = 10.3;
+      input(0,1,0) = 10.7;
+      input(1,1,0) = 10.9;
+      input(0,0,1) = 10;
+      input(1,0,1) = Util::MV;
+      input(0,1,1) = 10.7;
+      input(1,1,1) = 10.9;
+      DownscalerBilinear::downscaleField(input, output, op);
+      EXPECT_FLOAT_EQ(10.14606060606061, output(0,0,0));
+      EXPECT_FLOAT_EQ(10.7, output(0,1,0));
+      EXPECT_FLOAT_EQ(Util::MV, output(0,0,1));
+      EXPECT_FLOAT_EQ(10.7, output(0,1,1));
+
+      // Vectors fall back to the nearest neighbour when values are missing
+      vec2 values = make2x2(10, 11, Util::MV, 13);
+      vec2 interpolated = DownscalerBilinear::downscaleVec(values, op, I, J);
+      EXPECT_FLOAT_EQ(values[I[0][0]][J[0][0]], interpolated[0][0]);
+      EXPECT_FLOAT_EQ(11, interpolated[0][1]);
+
+      // The same operator is used for a different file on the same grid
+      FileFake to2(Options("nLat=1 nLon=2 nEns=1 nTime=1"));
+      setLatLon(to2,  (const float[]) {0.6},    (const float[]){1.3, 3});
+      SparseMatrix op2;
+      DownscalerBilinear::getOperator(from, to2, I, J, op2);
+      EXPECT_EQ(op.getColumns(), op2.getColumns());
+      EXPECT_EQ(op.getWeights(), op2.getWeights());
+   }
    TEST_F(TestDownscalerBilinear, outside) {
       DownscalerBilinear d(mVariable, mVariable, Options());
       vec2 lats = make2x2(0, 0, 1, 1);
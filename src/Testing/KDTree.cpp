@@ -172,6 +172,224 @@ namespace {
       EXPECT_EQ(0, I);
       EXPECT_EQ(0, J);
    }
+   // Grid of points 1 degree apart: lat = i, lon = j
+   TEST_F(KDTreeTest, kNearest) {
+      vec2 lats(5), lons(5);
+      for(int i = 0; i < 5; i++) {
+         lats[i].resize(5);
+         lons[i].resize(5);
+         for(int j = 0; j < 5; j++) {
+            lats[i][j] = i;
+            lons[i][j] = j;
+         }
+      }
+      KDTree tree(lats, lons);
+      std::vector<int> I, J;
+      std::vector<float> dist;
+      tree.getKNearest(2.1, 2, 3, I, J, dist);
+      ASSERT_EQ(3, I.size());
+      ASSERT_EQ(3, J.size());
+      ASSERT_EQ(3, dist.size());
+      EXPECT_EQ(2, I[0]);
+      EXPECT_EQ(2, J[0]);
+      EXPECT_FLOAT_EQ(Util::getDistance(2.1, 2, 2, 2), dist[0]);
+      EXPECT_EQ(3, I[1]);
+      EXPECT_EQ(2, J[1]);
+      // The third nearest is either west or east of the nearest
+      EXPECT_EQ(2, I[2]);
+      EXPECT_TRUE(J[2] == 1 || J[2] == 3);
+      EXPECT_LE(dist[0], dist[1]);
+      EXPECT_LE(dist[1], dist[2]);
+
+      // Fewer points available than requested
+      tree.getKNearest(2, 2, 100, I, J, dist);
+      EXPECT_EQ(25, I.size());
+      for(int n = 1; n < I.size(); n++)
+         EXPECT_LE(dist[n-1], dist[n]);
+
+      tree.getKNearest(2, 2, 0, I, J, dist);
+      EXPECT_EQ(0, I.size());
+   }
+   TEST_F(KDTreeTest, withinRadius) {
+      vec2 lats(5), lons(5);
+      for(int i = 0; i < 5; i++) {
+         lats[i].resize(5);
+         lons[i].resize(5);
+         for(int j = 0; j < 5; j++) {
+            lats[i][j] = i;
+            lons[i][j] = j;
+         }
+      }
+      // Skip missing points
+      lats[1][2] = Util::MV;
+      KDTree tree(lats, lons);
+      std::vector<int> I, J;
+      std::vector<float> dist;
+      // Slightly more than one degree
+      float radius = Util::getDistance(0, 0, 0, 1) * 1.05;
+      tree.getWithinRadius(2, 2, radius, I, J, dist);
+      ASSERT_EQ(4, I.size());
+      EXPECT_EQ(2, I[0]);
+      EXPECT_EQ(2, J[0]);
+      EXPECT_FLOAT_EQ(0, dist[0]);
+      for(int n = 0; n < I.size(); n++) {
+         EXPECT_LE(dist[n], radius);
+         EXPECT_FALSE(I[n] == 1 && J[n] == 2);
+      }
+
+      // Compare against brute force
+      float lat = 1.3;
+      float lon = 2.7;
+      radius = 200000;
+      tree.getWithinRadius(lat, lon, radius, I, J, dist);
+      int count = 0;
+      for(int i = 0; i < 5; i++) {
+         for(int j = 0; j < 5; j++) {
+            if(Util::isValid(lats[i][j]) && Util::getDistance(lat, lon, lats[i][j], lons[i][j]) <= radius)
+               count++;
+         }
+      }
+      EXPECT_EQ(count, I.size());
+
+      // Nothing within radius
+      tree.getWithinRadius(30, 30, radius, I, J, dist);
+      EXPECT_EQ(0, I.size());
+   }
+   TEST_F(KDTreeTest, emptyQueries) {
+      KDTree tree;
+      std::vector<int> I, J;
+      std::vector<float> dist;
+      tree.getKNearest(2, 2, 3, I, J, dist);
+      EXPECT_EQ(0, I.size());
+      tree.getWithinRadius(2, 2, 1e6, I, J, dist);
+      EXPECT_EQ(0, I.size());
+      int i, j;
+      tree.getNearestNeighbour(2, 2, i, j);
+      EXPECT_EQ(Util::MV, i);
+      EXPECT_EQ(Util::MV, j);
+   }
+   // Check that the cartesian tree gives the same results as the lat/lon tree
+   TEST_F(KDTreeTest, cartesian) {
+      vec2 lats(5), lons(5);
+      for(int i = 0; i < 5; i++) {
+         lats[i].resize(5);
+         lons[i].resize(5);
+         for(int j = 0; j < 5; j++) {
+            lats[i][j] = i;
+            lons[i][j] = j;
+         }
+      }
+      KDTree tree(lats, lons, KDTree::TypeCartesian);
+      EXPECT_EQ(KDTree::TypeCartesian, tree.getType());
+      EXPECT_EQ(25, tree.size());
+      int I, J;
+      tree.getNearestNeighbour(1.1, 2.6, I, J);
+      EXPECT_EQ(1, I);
+      EXPECT_EQ(3, J);
+      tree.getNearestNeighbour(-10, 10, I, J);
+      EXPECT_EQ(0, I);
+      EXPECT_EQ(4, J);
+
+      std::vector<int> Is, Js;
+      std::vector<float> dist;
+      tree.getKNearest(2.1, 2, 2, Is, Js, dist);
+      ASSERT_EQ(2, Is.size());
+      EXPECT_EQ(2, Is[0]);
+      EXPECT_EQ(2, Js[0]);
+      EXPECT_EQ(3, Is[1]);
+      EXPECT_EQ(2, Js[1]);
+      // Distances are in meters
+      EXPECT_NEAR(Util::getDistance(2.1, 2, 2, 2), dist[0], 1);
+      EXPECT_NEAR(Util::getDistance(2.1, 2, 3, 2), dist[1], 1);
+
+      float radius = Util::getDistance(0, 0, 0, 1) * 1.05;
+      tree.getWithinRadius(2, 2, radius, Is, Js, dist);
+      EXPECT_EQ(5, Is.size());
+      tree.getWithinRadius(2, 2, 1e9, Is, Js, dist);
+      EXPECT_EQ(25, Is.size());
+   }
+   // Points on either side of the dateline
+   TEST_F(KDTreeTest, cartesianDateline) {
+      vec2 lats, lons;
+      std::vector<float> lat(4,0), lon(4,0);
+      lon[0] = 178;
+      lon[1] = 179.5;
+      lon[2] = -177;
+      lon[3] = -170;
+      lats.push_back(lat);
+      lons.push_back(lon);
+      KDTree tree(lats, lons, KDTree::TypeCartesian);
+      int I, J;
+      tree.getNearestNeighbour(0, -179.8, I, J);
+      EXPECT_EQ(0, I);
+      EXPECT_EQ(1, J);
+      tree.getNearestNeighbour(0, 181, I, J);
+      EXPECT_EQ(1, J);
+      tree.getNearestNeighbour(0, -178.1, I, J);
+      EXPECT_EQ(2, J);
+
+      std::vector<int> Is, Js;
+      std::vector<float> dist;
+      tree.getWithinRadius(0, 180, Util::getDistance(0, 0, 0, 3.5), Is, Js, dist);
+      ASSERT_EQ(3, Is.size());
+      EXPECT_EQ(1, Js[0]);
+      EXPECT_EQ(0, Js[1]);
+      EXPECT_EQ(2, Js[2]);
+   }
+   // Points near the north pole, on opposite sides
+   TEST_F(KDTreeTest, cartesianPole) {
+      vec2 lats, lons;
+      std::vector<float> lat(3,89.9), lon(3,0);
+      lon[0] = 0;
+      lon[1] = 90;
+      lon[2] = 180;
+      lat[2] = 89.95;
+      lats.push_back(lat);
+      lons.push_back(lon);
+      KDTree tree(lats, lons, KDTree::TypeCartesian);
+      int I, J;
+      tree.getNearestNeighbour(89.95, 170, I, J);
+      EXPECT_EQ(2, J);
+      tree.getNearestNeighbour(90, 0, I, J);
+      EXPECT_EQ(2, J);
+      tree.getNearestNeighbour(89.5, -10, I, J);
+      EXPECT_EQ(0, J);
+   }
+   // Check that the batch query gives the same results as querying one point at a time
+   TEST_F(KDTreeTest, batch) {
+      vec2 lats(20), lons(20);
+      for(int i = 0; i < 20; i++) {
+         lats[i].resize(30);
+         lons[i].resize(30);
+         for(int j = 0; j < 30; j++) {
+            lats[i][j] = 50 + 0.1 * i + 0.01 * j;
+            lons[i][j] = 5 + 0.2 * j - 0.03 * i;
+         }
+      }
+      std::vector<float> qlats, qlons;
+      for(int n = 0; n < 500; n++) {
+         qlats.push_back(49 + 4.0 * (n % 23) / 23);
+         qlons.push_back(4 + 8.0 * (n % 37) / 37);
+      }
+      qlats[10] = Util::MV;
+      qlons[20] = Util::MV;
+      for(int t = 0; t < 2; t++) {
+         KDTree::Type type = t == 0 ? KDTree::TypeLatLon : KDTree::TypeCartesian;
+         KDTree tree(lats, lons, type);
+         std::vector<int> I, J;
+         tree.getNearestNeighbour(qlats, qlons, I, J);
+         ASSERT_EQ(500, I.size());
+         ASSERT_EQ(500, J.size());
+         for(int n = 0; n < 500; n++) {
+            int currI, currJ;
+            tree.getNearestNeighbour(qlats[n], qlons[n], currI, currJ);
+            EXPECT_EQ(currI, I[n]);
+            EXPECT_EQ(currJ, J[n]);
+         }
+         EXPECT_EQ(Util::MV, I[10]);
+         EXPECT_EQ(Util::MV, J[20]);
+      }
+   }
 }
 int main(int argc, char **argv) {
      ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,145 @@
+#include "../Projection.h"
+#include "../Util.h"
+#include <gtest/gtest.h>
+
+namespace {
+   class ProjectionTest : public ::testing::Test {
+      protected:
+         //! Create a grid with lats[i][j] = iLats[i] and lons[i][j] = iLons[j]
+         void makeGrid(const std::vector<float>& iLats, const std::vector<float>& iLons, vec2& iLatGrid, vec2& iLonGrid) {
+            iLatGrid.resize(iLats.size());
+            iLonGrid.resize(iLats.size());
+            for(int i = 0; i < iLats.size(); i++) {
+               iLatGrid[i].assign(iLons.size(), iLats[i]);
+               iLonGrid[i] = iLons;
+            }
+         }
+         std::vector<float> range(float iStart, float iSpacing, int iNum) {
+            std::vector<float> values(iNum);
+            for(int i = 0; i < iNum; i++)
+               values[i] = iStart + i * iSpacing;
+            return values;
+         }
+   };
+
+   TEST_F(ProjectionTest, detectLatLon) {
+      vec2 lats, lons;
+      makeGrid(range(60, -0.5, 5), range(5, 0.25, 4), lats, lons);
+      ProjectionLatLon* projection = ProjectionLatLon::detect(lats, lons);
+      ASSERT_TRUE(projection != NULL);
+      EXPECT_EQ(5, projection->getNumY());
+      EXPECT_EQ(4, projection->getNumX());
+      EXPECT_TRUE(projection->isConsistent(lats, lons));
+
+      float I, J;
+      ASSERT_TRUE(projection->getIndex(59.25, 5.6, I, J));
+      EXPECT_FLOAT_EQ(1.5, I);
+      EXPECT_FLOAT_EQ(2.4, J);
+      // Outside the grid
+      ASSERT_TRUE(projection->getIndex(61, 4, I, J));
+      EXPECT_FLOAT_EQ(-2, I);
+      EXPECT_FLOAT_EQ(-4, J);
+      // Missing
+      EXPECT_FALSE(projection->getIndex(Util::MV, 4, I, J));
+      delete projection;
+   }
+   TEST_F(ProjectionTest, detectLatLonDateline) {
+      vec2 lats, lons;
+      std::vector<float> lonValues;
+      lonValues.push_back(178);
+      lonValues.push_back(179);
+      lonValues.push_back(180);
+      lonValues.push_back(-179);
+      makeGrid(range(0, 1, 3), lonValues, lats, lons);
+      ProjectionLatLon* projection = ProjectionLatLon::detect(lats, lons);
+      ASSERT_TRUE(projection != NULL);
+      float I, J;
+      ASSERT_TRUE(projection->getIndex(1, -179.5, I, J));
+      EXPECT_FLOAT_EQ(1, I);
+      EXPECT_FLOAT_EQ(2.5, J);
+      ASSERT_TRUE(projection->getIndex(1, 178.5, I, J));
+      EXPECT_FLOAT_EQ(0.5, J);
+      delete projection;
+   }
+   TEST_F(ProjectionTest, detectIrregular) {
+      vec2 lats, lons;
+      // Unevenly spaced latitudes
+      std::vector<float> latValues = range(0, 1, 4);
+      latValues[2] = 2.5;
+      makeGrid(latValues, range(0, 1, 3), lats, lons);
+      EXPECT_TRUE(ProjectionLatLon::detect(lats, lons) == NULL);
+
+      // Latitudes vary along a row
+      makeGrid(range(0, 1, 4), range(0, 1, 3), lats, lons);
+      lats[1][2] = 1.1;
+      EXPECT_TRUE(ProjectionLatLon::detect(lats, lons) == NULL);
+
+      // Missing values
+      makeGrid(range(0, 1, 4), range(0, 1, 3), lats, lons);
+      lons[0][0] = Util::MV;
+      EXPECT_TRUE(ProjectionLatLon::detect(lats, lons) == NULL);
+
+      // A single row
+      makeGrid(range(0, 1, 1), range(0, 1, 3), lats, lons);
+      EXPECT_TRUE(ProjectionLatLon::detect(lats, lons) == NULL);
+   }
+   TEST_F(ProjectionTest, lambert) {
+      // Numerical example from Snyder (1987), Map projections: A working manual, p. 295
+      ProjectionLambert projection(33, 45, -96, 23, 1);
+      double x, y;
+      ASSERT_TRUE(projection.project(35, -75, x, y));
+      EXPECT_NEAR(0.2966785, x, 1e-6);
+      EXPECT_NEAR(0.2462112, y, 1e-6);
+      // The origin
+      ASSERT_TRUE(projection.project(23, -96, x, y));
+      EXPECT_NEAR(0, x, 1e-6);
+      EXPECT_NEAR(0, y, 1e-6);
+      // The opposite pole cannot be projected
+      EXPECT_FALSE(projection.project(-90, 0, x, y));
+   }
+   TEST_F(ProjectionTest, lambertGrid) {
+      // A 2.5 km grid similar to operational Nordic models
+      ProjectionLambert projection(63.3, 63.3, 15, 63.3, 6371000);
+      int nY = 20;
+      int nX = 30;
+      double x0 = -1e5;
+      double y0 = -2e5;
+      double dx = 2500;
+      projection.setAxes(nY, y0, dx, nX, x0, dx);
+
+      // Create lats/lons by inverting the projection numerically
+      vec2 lats(nY, std::vector<float>(nX));
+      vec2 lons(nY, std::vector<float>(nX));
+      for(int i = 0; i < nY; i++) {
+         for(int j = 0; j < nX; j++) {
+            double lat = 63.3;
+            double lon = 15;
+            for(int iter = 0; iter < 50; iter++) {
+               double x, y;
+               projection.project(lat, lon, x, y);
+               double errX = x0 + j * dx - x;
+               double errY = y0 + i * dx - y;
+               lat += errY / 111000;
+               lon += errX / (111000 * cos(lat * Util::pi / 180));
+            }
+            lats[i][j] = lat;
+            lons[i][j] = lon;
+         }
+      }
+      EXPECT_TRUE(projection.isConsistent(lats, lons));
+      float I, J;
+      ASSERT_TRUE(projection.getIndex(lats[4][7], lons[4][7], I, J));
+      EXPECT_NEAR(4, I, 0.01);
+      EXPECT_NEAR(7, J, 0.01);
+
+      // A different grid does not match
+      vec2 shifted = lats;
+      shifted[nY-1][nX-1] += 0.1;
+      EXPECT_FALSE(projection.isConsistent(shifted, lons));
+      EXPECT_FALSE(projection.isConsistent(vec2(nY, std::vector<float>(nX-1)), lons));
+   }
+}
+int main(int argc, char **argv) {
+     ::testing::InitGoogleTest(&argc, argv);
+       return RUN_ALL_TESTS();
+}
@@ -0,0 +1,137 @@
+#include "../SparseCholesky.h"
+#include "../SparseMatrix.h"
+#include "../Util.h"
+#include <gtest/gtest.h>
+
+namespace {
+   class SparseCholeskyTest : public ::testing::Test {
+      protected:
+         //! Create a sparse matrix from a dense one, skipping zeros
+         SparseMatrix toSparse(const vec2& iMatrix) {
+            SparseMatrix matrix(iMatrix.size());
+            for(int i = 0; i < iMatrix.size(); i++) {
+               std::vector<int> columns;
+               std::vector<float> weights;
+               for(int j = 0; j < iMatrix[i].size(); j++) {
+                  if(iMatrix[i][j] != 0) {
+                     columns.push_back(j);
+                     weights.push_back(iMatrix[i][j]);
+                  }
+               }
+               matrix.addRow(columns, weights);
+            }
+            return matrix;
+         }
+         //! Check that x solves the dense system A x = b
+         void checkSolution(const vec2& iMatrix, const std::vector<float>& iB, const std::vector<float>& iX) {
+            ASSERT_EQ(iB.size(), iX.size());
+            for(int i = 0; i < iMatrix.size(); i++) {
+               float total = 0;
+               for(int j = 0; j < iMatrix[i].size(); j++)
+                  total += iMatrix[i][j] * iX[j];
+               EXPECT_NEAR(iB[i], total, 1e-4);
+            }
+         }
+   };
+
+   TEST_F(SparseCholeskyTest, empty) {
+      SparseCholesky factor;
+      EXPECT_TRUE(factor.factorize(SparseMatrix(0)));
+      EXPECT_EQ(0, factor.size());
+      std::vector<float> x;
+      factor.solve(std::vector<float>(), x);
+      EXPECT_EQ(0, x.size());
+   }
+   TEST_F(SparseCholeskyTest, diagonal) {
+      vec2 matrix(3, std::vector<float>(3, 0));
+      matrix[0][0] = 2;
+      matrix[1][1] = 4;
+      matrix[2][2] = 0.5;
+      SparseCholesky factor;
+      ASSERT_TRUE(factor.factorize(toSparse(matrix)));
+      EXPECT_EQ(0, factor.getNumStored());
+      std::vector<float> b(3, 1), x;
+      factor.solve(b, x);
+      EXPECT_FLOAT_EQ(0.5, x[0]);
+      EXPECT_FLOAT_EQ(0.25, x[1]);
+      EXPECT_FLOAT_EQ(2, x[2]);
+   }
+   TEST_F(SparseCholeskyTest, grid) {
+      // Covariances between points on a 12x9 grid, with a compact support of 2 gridpoints.
+      // Points are numbered along the long side of the grid, which gives a poor ordering.
+      int nY = 12;
+      int nX = 9;
+      int n = nY * nX;
+      vec2 matrix(n, std::vector<float>(n, 0));
+      for(int i = 0; i < n; i++) {
+         for(int j = 0; j < n; j++) {
+            float dy = i % nY - j % nY;
+            float dx = i / nY - j / nY;
+            float r = sqrt(dx * dx + dy * dy) / 2.5;
+            if(r < 1)
+               matrix[i][j] = pow(1 - r, 4) * (4 * r + 1);
+         }
+      }
+      SparseCholesky factor;
+      ASSERT_TRUE(factor.factorize(toSparse(matrix)));
+      EXPECT_EQ(n, factor.size());
+      // The reordering should keep the envelope narrower than the short side of the grid
+      EXPECT_LT(factor.getNumStored(), n * (2 * nX + 1));
+
+      std::vector<float> b(n), x;
+      for(int i = 0; i < n; i++)
+         b[i] = sin(0.3 * i) + 0.5;
+      factor.solve(b, x);
+      checkSolution(matrix, b, x);
+   }
+   TEST_F(SparseCholeskyTest, disconnected) {
+      // Two independent blocks, with the rows interleaved
+      vec2 matrix(4, std::vector<float>(4, 0));
+      matrix[0][0] = 2;
+      matrix[2][2] = 2;
+      matrix[0][2] = 1;
+      matrix[2][0] = 1;
+      matrix[1][1] = 3;
+      matrix[3][3] = 1;
+      matrix[1][3] = -1;
+      matrix[3][1] = -1;
+      SparseCholesky factor;
+      ASSERT_TRUE(factor.factorize(toSparse(matrix)));
+      std::vector<float> b(4), x;
+      b[0] = 1;
+      b[1] = 2;
+      b[2] = 3;
+      b[3] = 4;
+      factor.solve(b, x);
+      checkSolution(matrix, b, x);
+   }
+   TEST_F(SparseCholeskyTest, singular) {
+      vec2 matrix(3, std::vector<float>(3, 1));
+      SparseCholesky factor;
+      EXPECT_FALSE(factor.factorize(toSparse(matrix)));
+   }
+   TEST_F(SparseCholeskyTest, indefinite) {
+      // Symmetric and non-singular, but with eigenvalues 3 and -1
+      vec2 matrix(2, std::vector<float>(2, 1));
+      matrix[0][1] = 2;
+      matrix[1][0] = 2;
+      SparseCholesky factor;
+      EXPECT_FALSE(factor.factorize(toSparse(matrix)));
+
+      // Negative diagonal
+      vec2 negative(1, std::vector<float>(1, -1));
+      EXPECT_FALSE(factor.factorize(toSparse(negative)));
+
+      // Indefinite matrices can still be solved when not requiring positive definiteness
+      ASSERT_TRUE(factor.factorize(toSparse(matrix), false));
+      std::vector<float> b(2), x;
+      b[0] = 1;
+      b[1] = 2;
+      factor.solve(b, x);
+      checkSolution(matrix, b, x);
+   }
+}
+int main(int argc, char **argv) {
+     ::testing::InitGoogleTest(&argc, argv);
+       return RUN_ALL_TESTS();
+}
@@ -0,0 +1,124 @@
+#include "../SparseMatrix.h"
+#include "../Util.h"
+#include <gtest/gtest.h>
+
+namespace {
+   class SparseMatrixTest : public ::testing::Test {
+      protected:
+   };
+
+   TEST_F(SparseMatrixTest, empty) {
+      SparseMatrix matrix(3);
+      EXPECT_EQ(0, matrix.getNumRows());
+      EXPECT_EQ(3, matrix.getNumCols());
+      EXPECT_EQ(0, matrix.getNumNonZeros());
+      std::vector<float> input(3, 1), output;
+      matrix.multiply(input, output);
+      EXPECT_EQ(0, output.size());
+   }
+   TEST_F(SparseMatrixTest, multiply) {
+      // 1 0 2
+      // 0 0 0
+      // 0 3 0
+      SparseMatrix matrix(3);
+      std::vector<int> columns;
+      std::vector<float> weights;
+      columns.push_back(0);
+      columns.push_back(2);
+      weights.push_back(1);
+      weights.push_back(2);
+      matrix.addRow(columns, weights);
+      matrix.addRow(std::vector<int>(), std::vector<float>());
+      matrix.addRow(1, 3);
+      EXPECT_EQ(3, matrix.getNumRows());
+      EXPECT_EQ(3, matrix.getNumNonZeros());
+
+      std::vector<float> input, output;
+      input.push_back(1);
+      input.push_back(2);
+      input.push_back(3);
+      matrix.multiply(input, output);
+      ASSERT_EQ(3, output.size());
+      EXPECT_FLOAT_EQ(7, output[0]);
+      EXPECT_FLOAT_EQ(Util::MV, output[1]);
+      EXPECT_FLOAT_EQ(6, output[2]);
+
+      // Missing values only affect the rows that use them
+      input[2] = Util::MV;
+      matrix.multiply(input, output);
+      EXPECT_FLOAT_EQ(Util::MV, output[0]);
+      EXPECT_FLOAT_EQ(Util::MV, output[1]);
+      EXPECT_FLOAT_EQ(6, output[2]);
+   }
+   TEST_F(SparseMatrixTest, multiplyInterleaved) {
+      // Two vectors stored in an array with three values per element
+      SparseMatrix matrix(2);
+      std::vector<int> columns;
+      std::vector<float> weights;
+      columns.push_back(0);
+      columns.push_back(1);
+      weights.push_back(0.25);
+      weights.push_back(0.75);
+      matrix.addRow(columns, weights);
+      matrix.addRow(0, 1);
+
+      float input[] = {4, 8, -1, 0, Util::MV, -1};
+      float output[4];
+      matrix.multiply(input, output, 2, 3, 2);
+      EXPECT_FLOAT_EQ(1, output[0]);
+      EXPECT_FLOAT_EQ(Util::MV, output[1]);
+      EXPECT_FLOAT_EQ(4, output[2]);
+      EXPECT_FLOAT_EQ(8, output[3]);
+   }
+   TEST_F(SparseMatrixTest, get) {
+      // 1 0 2
+      // 0 0 0
+      SparseMatrix matrix(3);
+      std::vector<int> columns;
+      std::vector<float> weights;
+      columns.push_back(0);
+      columns.push_back(2);
+      weights.push_back(1);
+      weights.push_back(2);
+      matrix.addRow(columns, weights);
+      matrix.addRow(std::vector<int>(), std::vector<float>());
+
+      float value = Util::MV;
+      EXPECT_TRUE(matrix.get(0, 0, value));
+      EXPECT_FLOAT_EQ(1, value);
+      EXPECT_TRUE(matrix.get(0, 2, value));
+      EXPECT_FLOAT_EQ(2, value);
+      // Entries that are not stored
+      EXPECT_FALSE(matrix.get(0, 1, value));
+      EXPECT_FALSE(matrix.get(1, 2, value));
+      EXPECT_FALSE(matrix.get(2, 0, value));
+      EXPECT_FALSE(matrix.get(-1, 0, value));
+      EXPECT_FLOAT_EQ(2, value);
+   }
+   TEST_F(SparseMatrixTest, set) {
+      SparseMatrix matrix(2);
+      matrix.addRow(1, 2);
+      matrix.addRow(0, 3);
+
+      SparseMatrix copy;
+      EXPECT_TRUE(copy.set(matrix.getNumCols(), matrix.getRowStarts(), matrix.getColumns(), matrix.getWeights()));
+      EXPECT_EQ(2, copy.getNumRows());
+      EXPECT_EQ(2, copy.getNumCols());
+      EXPECT_EQ(matrix.getColumns(), copy.getColumns());
+      EXPECT_EQ(matrix.getWeights(), copy.getWeights());
+
+      // Invalid column
+      EXPECT_FALSE(copy.set(1, matrix.getRowStarts(), matrix.getColumns(), matrix.getWeights()));
+      // Inconsistent sizes
+      std::vector<int> rowStarts = matrix.getRowStarts();
+      rowStarts.push_back(3);
+      EXPECT_FALSE(copy.set(2, rowStarts, matrix.getColumns(), matrix.getWeights()));
+      EXPECT_FALSE(copy.set(2, std::vector<int>(), matrix.getColumns(), matrix.getWeights()));
+      // The matrix is unchanged after a failed set
+      EXPECT_EQ(2, copy.getNumRows());
+   }
+}
+int main(int argc, char **argv) {
+     ::testing::InitGoogleTest(&argc, argv);
+       return RUN_ALL_TESTS();
+}
@@ -93,6 +93,19 @@ namespace {
       // EXPECT_NEAR(16879114, Util::getDistance(60.5,5.25,-84.75,-101.75, true), 100);
       EXPECT_NEAR(124084.21, Util::getDistance(60,10,61,11, true), 100);
    }
+   TEST_F(UtilTest, hash) {
+      vec2 a(2, std::vector<float>(3, 1));
+      vec2 b = a;
+      EXPECT_EQ(Util::hash(a), Util::hash(b));
+      b[1][2] = 1.0001;
+      EXPECT_NE(Util::hash(a), Util::hash(b));
+      // Same values, different shapes
+      vec2 c(3, std::vector<float>(2, 1));
+      EXPECT_NE(Util::hash(a), Util::hash(c));
+      // Combining hashes depends on the order
+      EXPECT_NE(Util::hash(a, Util::hash(b)), Util::hash(b, Util::hash(a)));
+      EXPECT_EQ(Util::hash(a, Util::hash(b)), Util::hash(a, Util::hash(b)));
+   }
    TEST_F(UtilTest, getDistanceInvalid) {
       EXPECT_FLOAT_EQ(Util::MV, Util::getDistance(Util::MV,5.25,-84.75,-101.75));
       EXPECT_FLOAT_EQ(Util::MV, Util::getDistance(60.5,Util::MV,-84.75,-101.75));
@@ -210,6 +223,49 @@ namespace {
       }
       EXPECT_FLOAT_EQ(Util::MV, Util::invLogit((float) 1/0));
    }
+   TEST_F(UtilTest, fastExp) {
+      const float x[] = {-1e10, -100, -87.5, -50, -3.7, -1, -0.01, 0, 0.5, 2, 40};
+      int num = sizeof(x)/sizeof(float);
+      std::vector<float> values(x, x + num);
+      std::vector<float> ans(num);
+      Util::fastExp(&values[0], &ans[0], num);
+      EXPECT_FLOAT_EQ(0, ans[0]);
+      EXPECT_FLOAT_EQ(0, ans[1]);
+      EXPECT_FLOAT_EQ(0, ans[2]);
+      for(int i = 3; i < num; i++) {
+         EXPECT_FLOAT_EQ(exp(x[i]), ans[i]);
+      }
+      // In-place
+      Util::fastExp(&values[0], &values[0], num);
+      EXPECT_EQ(ans, values);
+   }
+   TEST_F(UtilTest, fft) {
+      // Compare against the discrete Fourier transform
+      int n = 16;
+      std::vector<std::complex<double> > values(n);
+      for(int i = 0; i < n; i++)
+         values[i] = std::complex<double>(sin(0.7 * i) + i % 3, cos(1.3 * i));
+      std::vector<std::complex<double> > transform = values;
+      Util::fft(transform);
+      for(int k = 0; k < n; k++) {
+         std::complex<double> expected = 0;
+         for(int i = 0; i < n; i++)
+            expected += values[i] * std::polar(1.0, -2 * M_PI * i * k / n);
+         EXPECT_NEAR(expected.real(), transform[k].real(), 1e-10);
+         EXPECT_NEAR(expected.imag(), transform[k].imag(), 1e-10);
+      }
+      // The inverse recovers the original values
+      Util::fft(transform, true);
+      for(int i = 0; i < n; i++) {
+         EXPECT_NEAR(values[i].real(), transform[i].real(), 1e-12);
+         EXPECT_NEAR(values[i].imag(), transform[i].imag(), 1e-12);
+      }
+      // Length 1
+      std::vector<std::complex<double> > single(1, std::complex<double>(3, -2));
+      Util::fft(single);
+      EXPECT_DOUBLE_EQ(3, single[0].real());
+      EXPECT_DOUBLE_EQ(-2, single[0].imag());
+   }
    TEST_F(UtilTest, error) {
       ::testing::FLAGS_gtest_death_test_style = "threadsafe";
       Util::setShowError(false);
@@ -6,6 +6,7 @@
 #include <cmath>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 namespace Cglob {
 #include <glob.h>
 }
@@ -269,6 +270,79 @@ float Util::invLogit(float x) {
    return exp(x)/(exp(x)+1);
 }
 
+void Util::fastExp(const float* iValues, float* iOutput, int iNum) {
+   // Write exp(x) = 2^n * exp(r), where n = round(x / ln(2)) and |r| <= ln(2)/2, and approximate
+   // exp(r) by a polynomial (coefficients from the Cephes library). 2^n is constructed directly
+   // in the exponent bits. Comparisons and selections are done on the bit patterns, since
+   // floating point comparisons prevent the compiler from vectorizing the loop.
+   const float log2e = 1.44269504088896341;
+   const float c1 = 0.693359375;
+   const float c2 = -2.12194440e-4;
+   const float minValue = -87;
+   unsigned int minBits;
+   memcpy(&minBits, &minValue, sizeof(float));
+   for(int i = 0; i < iNum; i++) {
+      float x = iValues[i];
+      // Values below -87 (and negative NaNs) have larger unsigned bit patterns than -87
+      unsigned int xBits;
+      memcpy(&xBits, &x, sizeof(float));
+      bool underflow = xBits > minBits;
+      xBits = underflow ? minBits : xBits;
+      memcpy(&x, &xBits, sizeof(float));
+
+      // Round to the nearest integer. The offset keeps the argument positive, so that truncation
+      // gives the floor.
+      int n = (int) (x * log2e + 128.5f) - 128;
+      float fn = n;
+      float r = x - fn * c1 - fn * c2;
+      float p = 1.9875691500e-4f;
+      p = p * r + 1.3981999507e-3f;
+      p = p * r + 8.3334519073e-3f;
+      p = p * r + 4.1665795894e-2f;
+      p = p * r + 1.6666665459e-1f;
+      p = p * r + 5.0000001201e-1f;
+      p = p * r * r + r + 1;
+
+      int pow2nBits = underflow ? 0 : (n + 127) << 23;
+      float pow2n;
+      memcpy(&pow2n, &pow2nBits, sizeof(float));
+      iOutput[i] = p * pow2n;
+   }
+}
+
+void Util::fft(std::vector<std::complex<double> >& iValues, bool iInverse) {
+   int n = iValues.size();
+   assert((n & (n - 1)) == 0);
+   // Reorder the values by bit-reversed index
+   for(int i = 1, j = 0; i < n; i++) {
+      int bit = n >> 1;
+      for(; j & bit; bit >>= 1)
+         j ^= bit;
+      j ^= bit;
+      if(i < j)
+         std::swap(iValues[i], iValues[j]);
+   }
+   // Combine transforms of increasing length
+   double sign = iInverse ? 1 : -1;
+   for(int length = 2; length <= n; length *= 2) {
+      double angle = sign * 2 * M_PI / length;
+      int half = length / 2;
+      for(int k = 0; k < half; k++) {
+         std::complex<double> w(cos(angle * k), sin(angle * k));
+         for(int start = 0; start < n; start += length) {
+            std::complex<double> u = iValues[start + k];
+            std::complex<double> v = iValues[start + k + half] * w;
+            iValues[start + k] = u + v;
+            iValues[start + k + half] = u - v;
+         }
+      }
+   }
+   if(iInverse) {
+      for(int i = 0; i < n; i++)
+         iValues[i] /= n;
+   }
+}
+
 bool Util::hasChar(std::string iString, char iChar) {
    return iString.find(iChar) != std::string::npos;
 }
@@ -291,6 +365,32 @@ bool Util::remove(std::string iFilename) {
    return !failure;
 }
 
+const uint64_t Util::hashSeed = 14695981039346656037ULL;
+
+uint64_t Util::hash(const vec2& iValues, uint64_t iSeed) {
+   const uint64_t prime = 1099511628211ULL;
+   uint64_t hash = iSeed;
+
+   // Include the dimensions, so that arrays with the same values but different shapes differ
+   std::vector<int> dims(1, iValues.size());
+   for(int i = 0; i < iValues.size(); i++)
+      dims.push_back(iValues[i].size());
+   const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&dims[0]);
+   for(int b = 0; b < dims.size() * sizeof(int); b++) {
+      hash = (hash ^ bytes[b]) * prime;
+   }
+
+   for(int i = 0; i < iValues.size(); i++) {
+      if(iValues[i].size() == 0)
+         continue;
+      bytes = reinterpret_cast<const unsigned char*>(&iValues[i][0]);
+      for(int b = 0; b < iValues[i].size() * sizeof(float); b++) {
+         hash = (hash ^ bytes[b]) * prime;
+      }
+   }
+   return hash;
+}
+
 std::string Util::formatDescription(std::string iTitle, std::string iMessage, int iTitleLength, int iMaxLength, int iTitleIndent) {
    // Invalid input
    if(iTitleLength >= iMaxLength ) {
@@ -4,6 +4,8 @@
 #include <vector>
 #include <set>
 #include <cmath>
+#include <complex>
+#include <stdint.h>
 
 typedef std::vector<std::vector<float> > vec2; // Lat, Lon
 
@@ -118,6 +120,16 @@ class Util {
       //! @return x A value on the interval (0,1)
       static float invLogit(float x);
 
+      //! \brief Computes exp of each value in an array. Uses a polynomial approximation (relative
+      //! error below 1e-7) without branches or function calls, so that the loop can be vectorized.
+      //! Values below -87 give 0. Values must be below 88. iValues and iOutput may be the same array.
+      static void fastExp(const float* iValues, float* iOutput, int iNum);
+
+      //! \brief Computes the discrete Fourier transform of a sequence in place, using the radix-2
+      //! fast Fourier transform. The length must be a power of 2.
+      //! @param iInverse Compute the inverse transform instead (including the division by the length)
+      static void fft(std::vector<std::complex<double> >& iValues, bool iInverse=false);
+
       template <class T> static std::vector<T> combine(const std::vector<T>& i1, const std::vector<T>& i2) {
          std::set<T> allValues(i1.begin(), i1.end());
          for(int i = 0; i < i2.size(); i++) {
@@ -189,6 +201,12 @@ class Util {
      
       //! Remove the file with filename. Returns true if successful.
       static bool remove(std::string iFilename);
+
+      //! Computes a 64-bit FNV-1a hash of the dimensions and values of the array. Use the hash of
+      //! another array as iSeed to combine several arrays into one hash.
+      static uint64_t hash(const vec2& iValues, uint64_t iSeed=hashSeed);
+      //! Initial value of a hash
+      static const uint64_t hashSeed;
      
       //! \brief Comparator class for sorting pairs using the second entry.
       //! Sorts from smallest to largest
@@ -1,4 +1,4 @@
-// #include <boost/uuid/uuid.hpp>
-// Type for unique id. boost::uuids::uuid isn't always installed
-// with boost, so an int can be used instead.
-typedef int Uuid; // boost::uuids::uuid
+#include <stdint.h>
+// Type for the identity of a lat/lon grid. This is a hash of the coordinates, so that files on the
+// same grid have the same identity.
+typedef uint64_t Uuid;